@@ -0,0 +1,172 @@
+#ifndef D1VREADER_HPP
+#define D1VREADER_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Streaming reader for DXT1 video (.d1v) files.
+// A background thread reads frames in order into a bounded ring of `ring_size` buffers,
+// so memory use is independent of video length and the first frame is ready immediately.
+class D1vReader {
+private:
+	int fd;
+	uint32_t width;
+	uint32_t height;
+	uint32_t num_frames;
+	uint16_t fps;
+	uint32_t frame_size;
+
+	std::vector<unsigned char*> slots;
+	std::vector<int64_t> slot_frame;   // frame currently held by each slot (-1 = none)
+	std::vector<bool> slot_free;
+	std::thread loader;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping;
+	bool failed;       // a read failed - no further frames are published
+
+	void LoadFrames();
+
+public:
+	D1vReader(const char *filename, uint32_t ring_size);
+	~D1vReader();
+
+	bool IsOpen();
+	uint32_t GetWidth();
+	uint32_t GetHeight();
+	uint32_t GetFrameCount();
+	uint16_t GetFps();
+	unsigned char* AcquireFrame(uint32_t index);
+	void ReleaseFrame(uint32_t index);
+};
+
+inline D1vReader::D1vReader(const char *filename, uint32_t ring_size) : fd(-1), width(0), height(0), num_frames(0), fps(0), frame_size(0), stopping(false), failed(false) {
+	unsigned char header[18];
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error: cannot open %s\n", filename);
+		return;
+	}
+	// magic (big endian), width, height, frame count (little endian uint32), fps (little endian uint16)
+	if (pread(fd, header, 18, 0) != 18 || header[0] != '.' || header[1] != 'D' || header[2] != '1' || header[3] != 'V') {
+		fprintf(stderr, "Error: input file not recognized as D1V video\n");
+		close(fd);
+		fd = -1;
+		return;
+	}
+	width = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+	height = header[8] | (header[9] << 8) | (header[10] << 16) | ((uint32_t)header[11] << 24);
+	num_frames = header[12] | (header[13] << 8) | (header[14] << 16) | ((uint32_t)header[15] << 24);
+	fps = header[16] | (header[17] << 8);
+	frame_size = width * height / 2;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	uint32_t i;
+	for (i = 0; i < ring_size; i++) {
+		slots.push_back(new unsigned char[frame_size]);
+		slot_frame.push_back(-1);
+		slot_free.push_back(true);
+	}
+	loader = std::thread(&D1vReader::LoadFrames, this);
+}
+
+inline D1vReader::~D1vReader() {
+	std::unique_lock<std::mutex> lock(mutex);
+	stopping = true;
+	lock.unlock();
+	condition.notify_all();
+	if (loader.joinable()) loader.join();
+	for (size_t i = 0; i < slots.size(); i++) {
+		delete[] slots[i];
+	}
+	if (fd >= 0) close(fd);
+}
+
+inline bool D1vReader::IsOpen() {
+	return fd >= 0;
+}
+
+inline uint32_t D1vReader::GetWidth() {
+	return width;
+}
+
+inline uint32_t D1vReader::GetHeight() {
+	return height;
+}
+
+inline uint32_t D1vReader::GetFrameCount() {
+	return num_frames;
+}
+
+inline uint16_t D1vReader::GetFps() {
+	return fps;
+}
+
+inline unsigned char* D1vReader::AcquireFrame(uint32_t index) {
+	// blocks until the loader has filled the frame's slot - NULL if the frame could not be read
+	size_t slot = index % slots.size();
+	std::unique_lock<std::mutex> lock(mutex);
+	while (slot_frame[slot] != (int64_t)index && !failed) {
+		condition.wait(lock);
+	}
+	return (slot_frame[slot] == (int64_t)index) ? slots[slot] : NULL;
+}
+
+inline void D1vReader::ReleaseFrame(uint32_t index) {
+	size_t slot = index % slots.size();
+	std::unique_lock<std::mutex> lock(mutex);
+	if (slot_frame[slot] == (int64_t)index) {
+		slot_free[slot] = true;
+	}
+	lock.unlock();
+	condition.notify_all();
+}
+
+inline void D1vReader::LoadFrames() {
+	uint32_t i;
+	for (i = 0; i < num_frames; i++) {
+		size_t slot = i % slots.size();
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!slot_free[slot] && !stopping) {
+			condition.wait(lock);
+		}
+		if (stopping) break;
+		slot_free[slot] = false;
+		lock.unlock();
+
+		// hint the kernel to start reading the frames after the ring window
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(fd, 18 + ((off_t)i + slots.size()) * frame_size, (off_t)frame_size * slots.size(), POSIX_FADV_WILLNEED);
+#endif
+		ssize_t total = 0;
+		while (total < frame_size) {
+			ssize_t rc = pread(fd, slots[slot] + total, frame_size - total, 18 + (off_t)i * frame_size + total);
+			if (rc <= 0) {
+				fprintf(stderr, "Error: failed to read frame %u of D1V video\n", i);
+				break;
+			}
+			total += rc;
+		}
+
+		lock.lock();
+		if (total < frame_size) {
+			failed = true;
+			lock.unlock();
+			condition.notify_all();
+			break;
+		}
+		slot_frame[slot] = i;
+		lock.unlock();
+		condition.notify_all();
+	}
+}
+
+#endif // D1VREADER_HPP
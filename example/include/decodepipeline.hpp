@@ -0,0 +1,138 @@
+#ifndef DECODEPIPELINE_HPP
+#define DECODEPIPELINE_HPP
+
+#include <cstdint>
+#include <chrono>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Worker pool that decodes frames up to `depth` frames ahead of the consumer.
+// Output buffers come from `acquire` (e.g. Server::AcquireFrame), so blocking there means
+// the network is the bottleneck, while the consumer stalling in Next() means decode is.
+class DecodePipeline {
+public:
+	typedef std::function<void*()> AcquireBuffer;
+	typedef std::function<bool(uint32_t index, void *dst)> DecodeFrame;
+
+private:
+	uint32_t num_frames;
+	uint32_t depth;
+	AcquireBuffer acquire;
+	DecodeFrame decode;
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::map<uint32_t, void*> ready;
+	uint32_t next_claim;
+	uint32_t next_consume;
+	bool stopping;
+
+	double decode_time;
+	double acquire_wait_time;
+	double consumer_stall_time;
+
+	void Work();
+	static double Seconds(std::chrono::steady_clock::time_point start);
+
+public:
+	DecodePipeline(uint32_t num_frames, uint32_t num_workers, uint32_t depth, AcquireBuffer acquire, DecodeFrame decode);
+	~DecodePipeline();
+
+	void* Next(uint32_t index);
+	uint32_t GetWorkerCount();
+	double GetDecodeTime();
+	double GetAcquireWaitTime();
+	double GetConsumerStallTime();
+};
+
+inline DecodePipeline::DecodePipeline(uint32_t num_frames, uint32_t num_workers, uint32_t depth, AcquireBuffer acquire, DecodeFrame decode) :
+	num_frames(num_frames), depth(depth), acquire(acquire), decode(decode), next_claim(0), next_consume(0), stopping(false),
+	decode_time(0.0), acquire_wait_time(0.0), consumer_stall_time(0.0) {
+	uint32_t i;
+	for (i = 0; i < num_workers; i++) {
+		workers.push_back(std::thread(&DecodePipeline::Work, this));
+	}
+}
+
+inline DecodePipeline::~DecodePipeline() {
+	std::unique_lock<std::mutex> lock(mutex);
+	stopping = true;
+	lock.unlock();
+	condition.notify_all();
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+}
+
+inline void* DecodePipeline::Next(uint32_t index) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(mutex);
+	while (ready.find(index) == ready.end()) {
+		condition.wait(lock);
+	}
+	consumer_stall_time += Seconds(start);
+	void *buffer = ready[index];
+	ready.erase(index);
+	next_consume = index + 1;
+	lock.unlock();
+	condition.notify_all();
+	return buffer;
+}
+
+inline uint32_t DecodePipeline::GetWorkerCount() {
+	return workers.size();
+}
+
+inline double DecodePipeline::GetDecodeTime() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return decode_time;
+}
+
+inline double DecodePipeline::GetAcquireWaitTime() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return acquire_wait_time;
+}
+
+inline double DecodePipeline::GetConsumerStallTime() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return consumer_stall_time;
+}
+
+inline void DecodePipeline::Work() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		// never run more than `depth` frames ahead of the consumer
+		while (!stopping && next_claim < num_frames && next_claim >= next_consume + depth) {
+			condition.wait(lock);
+		}
+		if (stopping || next_claim >= num_frames) break;
+		uint32_t index = next_claim++;
+		lock.unlock();
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		void *buffer = acquire();
+		double acquire_wait = Seconds(start);
+		start = std::chrono::steady_clock::now();
+		if (!decode(index, buffer)) {
+			fprintf(stderr, "Error: failed to decode frame %u\n", index);
+		}
+		double decode_elapsed = Seconds(start);
+
+		lock.lock();
+		acquire_wait_time += acquire_wait;
+		decode_time += decode_elapsed;
+		ready[index] = buffer;
+		condition.notify_all();
+	}
+}
+
+inline double DecodePipeline::Seconds(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+#endif // DECODEPIPELINE_HPP
@@ -0,0 +1,236 @@
+#ifndef SYNTHETICSOURCE_HPP
+#define SYNTHETICSOURCE_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "pxstream.h"
+
+// Procedural frame source for transport benchmarks - no disk I/O or decode in the stream path.
+// `ring_size` distinct frames are generated up front by `workers` threads; frame i is ring slot
+// i % ring_size, so animated patterns loop with a period of ring_size frames.
+class SyntheticSource {
+public:
+	enum Pattern : uint8_t {Gradient, Noise, Moving, Changed};
+
+private:
+	uint32_t width;
+	uint32_t height;
+	uint32_t offset_x;
+	uint32_t offset_y;
+	PxStream::PixelFormat format;
+	PxStream::PixelDataType data_type;
+	Pattern pattern;
+	double change_fraction;
+	uint32_t frame_size;
+	bool valid;
+
+	std::vector<unsigned char*> slots;
+	std::vector<bool> slot_free;
+	std::mutex mutex;
+	std::condition_variable condition;
+
+	static uint32_t Hash(uint32_t x);
+	void Sample(uint32_t frame, uint32_t x, uint32_t y, double rgba[4]);
+	void Store(unsigned char *dst, double value);
+	void GenerateFrame(uint32_t frame, unsigned char *dst);
+
+public:
+	SyntheticSource(uint32_t width, uint32_t height, uint32_t offset_x, uint32_t offset_y, PxStream::PixelFormat format,
+	                PxStream::PixelDataType data_type, Pattern pattern, double change_fraction, uint32_t ring_size, uint32_t workers);
+	~SyntheticSource();
+
+	bool IsValid();
+	uint32_t GetFrameSize();
+	unsigned char* AcquireFrame(uint32_t index);
+	void ReleaseFrame(uint32_t index);
+};
+
+inline SyntheticSource::SyntheticSource(uint32_t width, uint32_t height, uint32_t offset_x, uint32_t offset_y, PxStream::PixelFormat format,
+                                        PxStream::PixelDataType data_type, Pattern pattern, double change_fraction, uint32_t ring_size, uint32_t workers) :
+                                        width(width), height(height), offset_x(offset_x), offset_y(offset_y), format(format), data_type(data_type),
+                                        pattern(pattern), change_fraction(change_fraction), frame_size(0), valid(false) {
+	bool supported_format = format == PxStream::PixelFormat::RGBA || format == PxStream::PixelFormat::RGB || format == PxStream::PixelFormat::GrayScale ||
+	                        (format == PxStream::PixelFormat::DXT1 && data_type == PxStream::PixelDataType::Uint8);
+	bool supported_type = data_type == PxStream::PixelDataType::Uint8 || data_type == PxStream::PixelDataType::Uint16 ||
+	                      data_type == PxStream::PixelDataType::Uint32 || data_type == PxStream::PixelDataType::Float ||
+	                      data_type == PxStream::PixelDataType::Double;
+	if (!supported_format || !supported_type) {
+		fprintf(stderr, "Error: synthetic frames support RGBA, RGB, GrayScale (Uint8/16/32, Float, Double) and DXT1 (Uint8)\n");
+		return;
+	}
+	if (format == PxStream::PixelFormat::DXT1 && (width % 4 != 0 || height % 4 != 0)) {
+		fprintf(stderr, "Error: DXT1 synthetic frames must be a multiple of 4 pixels in each dimension\n");
+		return;
+	}
+	frame_size = (uint32_t)((uint64_t)width * height * PxStream::GetBitsPerPixel(format, data_type) / 8);
+
+	uint32_t i;
+	for (i = 0; i < ring_size; i++) {
+		slots.push_back(new unsigned char[frame_size]);
+		slot_free.push_back(true);
+	}
+	// every ring frame is generated before streaming starts
+	std::vector<std::thread> threads;
+	uint32_t num_workers = std::max(1u, std::min(workers, ring_size));
+	for (i = 0; i < num_workers; i++) {
+		threads.push_back(std::thread([this, i, num_workers, ring_size]() {
+			uint32_t frame;
+			for (frame = i; frame < ring_size; frame += num_workers) {
+				GenerateFrame(frame, slots[frame]);
+			}
+		}));
+	}
+	for (i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+	valid = true;
+}
+
+inline SyntheticSource::~SyntheticSource() {
+	uint32_t i;
+	for (i = 0; i < slots.size(); i++) {
+		delete[] slots[i];
+	}
+}
+
+inline bool SyntheticSource::IsValid() {
+	return valid;
+}
+
+inline uint32_t SyntheticSource::GetFrameSize() {
+	return frame_size;
+}
+
+inline unsigned char* SyntheticSource::AcquireFrame(uint32_t index) {
+	// a ring frame cannot be handed out again until the previous send of it has been released
+	uint32_t slot = index % slots.size();
+	std::unique_lock<std::mutex> lock(mutex);
+	condition.wait(lock, [this, slot]() { return (bool)slot_free[slot]; });
+	slot_free[slot] = false;
+	return slots[slot];
+}
+
+inline void SyntheticSource::ReleaseFrame(uint32_t index) {
+	std::lock_guard<std::mutex> lock(mutex);
+	slot_free[index % slots.size()] = true;
+	condition.notify_all();
+}
+
+inline uint32_t SyntheticSource::Hash(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+inline void SyntheticSource::Sample(uint32_t frame, uint32_t x, uint32_t y, double rgba[4]) {
+	// global coordinates so patterns are continuous across every rank's tile
+	uint32_t gx = offset_x + x;
+	uint32_t gy = offset_y + y;
+	uint32_t cycle = slots.size();
+	double phase;
+	uint32_t noise;
+	rgba[3] = 1.0;
+	switch (pattern) {
+		case Pattern::Gradient:
+			rgba[0] = (double)(gx % 1024) / 1023.0;
+			rgba[1] = (double)(gy % 1024) / 1023.0;
+			rgba[2] = 0.5;
+			break;
+		case Pattern::Noise:
+			noise = Hash(gx * 0x9e3779b1 ^ gy * 0x85ebca77 ^ frame * 0xc2b2ae3d);
+			rgba[0] = (double)(noise & 0xFF) / 255.0;
+			rgba[1] = (double)((noise >> 8) & 0xFF) / 255.0;
+			rgba[2] = (double)((noise >> 16) & 0xFF) / 255.0;
+			break;
+		case Pattern::Moving:
+			// diagonal bands scrolling one full period per ring cycle
+			phase = (double)(gx + gy) / 64.0 + (double)frame / (double)cycle;
+			rgba[0] = 0.5 + 0.5 * sin(2.0 * M_PI * phase);
+			rgba[1] = 0.5 + 0.5 * sin(2.0 * M_PI * (phase + 1.0 / 3.0));
+			rgba[2] = 0.5 + 0.5 * sin(2.0 * M_PI * (phase + 2.0 / 3.0));
+			break;
+		case Pattern::Changed:
+			// fixed subset of pixels (change_fraction of the image) differs from one frame to the next
+			if ((double)Hash(gx * 0x9e3779b1 ^ gy * 0x85ebca77) / 4294967295.0 < change_fraction) {
+				rgba[0] = (double)((frame * 53) % cycle) / (double)std::max(cycle - 1, 1u);
+				rgba[1] = 1.0 - rgba[0];
+				rgba[2] = 0.0;
+			}
+			else {
+				rgba[0] = (double)(gx % 1024) / 1023.0;
+				rgba[1] = (double)(gy % 1024) / 1023.0;
+				rgba[2] = 0.5;
+			}
+			break;
+	}
+}
+
+inline void SyntheticSource::Store(unsigned char *dst, double value) {
+	switch (data_type) {
+		case PxStream::PixelDataType::Uint8:
+			*dst = (uint8_t)(value * 255.0 + 0.5);
+			break;
+		case PxStream::PixelDataType::Uint16:
+			*reinterpret_cast<uint16_t*>(dst) = (uint16_t)(value * 65535.0 + 0.5);
+			break;
+		case PxStream::PixelDataType::Uint32:
+			*reinterpret_cast<uint32_t*>(dst) = (uint32_t)(value * 4294967295.0 + 0.5);
+			break;
+		case PxStream::PixelDataType::Float:
+			*reinterpret_cast<float*>(dst) = (float)value;
+			break;
+		case PxStream::PixelDataType::Double:
+			*reinterpret_cast<double*>(dst) = value;
+			break;
+		default:
+			break;
+	}
+}
+
+inline void SyntheticSource::GenerateFrame(uint32_t frame, unsigned char *dst) {
+	double rgba[4];
+	uint32_t x, y, c;
+	if (format == PxStream::PixelFormat::DXT1) {
+		// generate RGBA then compress with the same encoder the server uses for adaptive streaming
+		unsigned char *pixels = new unsigned char[width * height * 4];
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				Sample(frame, x, y, rgba);
+				for (c = 0; c < 4; c++) {
+					pixels[(y * width + x) * 4 + c] = (uint8_t)(rgba[c] * 255.0 + 0.5);
+				}
+			}
+		}
+		PxStream::EncodeDxt1(pixels, width, height, dst);
+		delete[] pixels;
+		return;
+	}
+
+	uint32_t channels = (format == PxStream::PixelFormat::RGBA) ? 4 : ((format == PxStream::PixelFormat::RGB) ? 3 : 1);
+	uint32_t type_size = PxStream::GetDataTypeSize(data_type);
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			Sample(frame, x, y, rgba);
+			unsigned char *px = dst + ((uint64_t)y * width + x) * channels * type_size;
+			if (channels == 1) {
+				Store(px, 0.299 * rgba[0] + 0.587 * rgba[1] + 0.114 * rgba[2]);
+				continue;
+			}
+			for (c = 0; c < channels; c++) {
+				Store(px + c * type_size, rgba[c]);
+			}
+		}
+	}
+}
+
+#endif // SYNTHETICSOURCE_HPP
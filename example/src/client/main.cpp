@@ -1,8 +1,53 @@
 #include <iostream>
 #include <chrono>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <mpi.h>
 #include "pxstream/client.h"
 
+// Headless sink: receives frames in constant memory, optionally verifying checksums, tracking
+// latency and writing frames to disk through an async I/O thread
+//   pxclient <host> <port> [-verify] [-write <prefix>] [-frames <max>] [-channel <name> ...]
+
+#define WRITE_BUFFER_COUNT 3
+#define LATENCY_BUCKETS 4096       // 0.25 ms buckets -> ~1 s, last bucket collects everything slower
+#define LATENCY_BUCKET_WIDTH 0.00025
+
+typedef struct WriteJob {
+    uint8_t *buffer;
+    uint64_t size;
+} WriteJob;
+
+class AsyncWriter {
+private:
+    FILE *fp;
+    std::vector<uint8_t*> buffers;
+    std::deque<uint8_t*> free_buffers;
+    std::deque<WriteJob> jobs;
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool done;
+    uint64_t bytes_written;
+
+    void WriteLoop();
+
+public:
+    AsyncWriter(const char *filename, uint64_t buffer_size, int buffer_count);
+    ~AsyncWriter();
+
+    bool IsOpen();
+    uint8_t* AcquireBuffer();
+    void Write(uint8_t *buffer, uint64_t size);
+    uint64_t Close();
+};
+
 uint64_t GetCurrentTime();
 
 int main(int argc, char **argv)
@@ -24,69 +69,163 @@ int main(int argc, char **argv)
         fprintf(stderr, "Error: no host and port provided for PxStream server (rank 0)\n");
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
-    PxStream::Client stream(argv[1], atoi(argv[2]), MPI_COMM_WORLD);
-
-    int num_frames = 0;
-    uint64_t start = GetCurrentTime();
+    bool verify = false;
+    const char *write_prefix = NULL;
+    int64_t max_frames = -1;
+    std::vector<std::string> channel_names;
+    uint32_t frame_credits = 0;
+    PxStream::TransportProfile profile = PxStream::TransportProfile::Default;
+    int i;
+    for (i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-verify") == 0) verify = true;
+        else if (strcmp(argv[i], "-write") == 0 && i + 1 < argc) write_prefix = argv[++i];
+        else if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc) max_frames = atoll(argv[++i]);
+        else if (strcmp(argv[i], "-channel") == 0 && i + 1 < argc) channel_names.push_back(argv[++i]);
+        else if (strcmp(argv[i], "-credits") == 0 && i + 1 < argc) frame_credits = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-latency") == 0) profile = PxStream::TransportProfile::LowLatency;
+        else if (strcmp(argv[i], "-throughput") == 0) profile = PxStream::TransportProfile::HighThroughput;
+        else if (strcmp(argv[i], "-cpus") == 0 && i + 1 < argc) PxStream::SetThreadAffinity(PxStream::ThreadRole::ReaderThreads, argv[++i]);
+        else
+        {
+            fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    PxStream::Client stream(argv[1], atoi(argv[2]), MPI_COMM_WORLD, channel_names, frame_credits, profile);
+    stream.SetVerifyChecksums(verify);
 
     uint32_t global_width, global_height;
     stream.GetGlobalDimensions(&global_width, &global_height);
 
     int32_t sizes[2] = {(int32_t)global_width / num_ranks, (int32_t)global_height};
     int32_t offsets[2] = {rank * sizes[0], 0};
-    DDR_DataDescriptor *selection = stream.CreateGlobalPixelSelection(sizes, offsets);
+    // one selection per subscribed channel (every channel of a frame arrives before the next frame)
+    std::vector<int> channels;
+    std::vector<DDR_DataDescriptor*> selections;
+    uint32_t bpp = 0;
+    for (i = 0; i < stream.GetChannelCount(); i++)
+    {
+        if (!stream.ChannelSubscribed(i)) continue;
+        channels.push_back(i);
+        selections.push_back(stream.CreateGlobalPixelSelection(i, sizes, offsets));
+        bpp = std::max(bpp, PxStream::GetBitsPerPixel(stream.GetChannelPixelFormat(i), stream.GetChannelPixelDataType(i)));
+    }
 
-    //uint32_t img_size = sizes[0] * sizes[1] * 4;
-    uint32_t img_size = sizes[0] * sizes[1] / 2;
-    uint8_t *pixel_list = new uint8_t[img_size * 27];
+    // the stream can switch between RGBA and DXT1 per frame - size buffers for the larger of the two
+    bpp = std::max(bpp, PxStream::GetBitsPerPixel(PxStream::PixelFormat::RGBA, stream.GetPixelDataType()));
+    uint64_t max_img_size = (uint64_t)sizes[0] * sizes[1] * bpp / 8;
 
+    AsyncWriter *writer = NULL;
+    uint8_t *pixels = NULL;
+    if (write_prefix != NULL)
+    {
+        char filename[256];
+        snprintf(filename, 256, "%s_r%02d.raw", write_prefix, rank);
+        writer = new AsyncWriter(filename, max_img_size, WRITE_BUFFER_COUNT);
+        if (!writer->IsOpen())
+        {
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    else
+    {
+        pixels = new uint8_t[max_img_size];
+    }
+
+    std::vector<uint64_t> latency_histogram(LATENCY_BUCKETS, 0);
+    double latency_min = 1.0e12, latency_max = 0.0, latency_sum = 0.0;
+    uint64_t num_frames = 0;
+    uint64_t num_bytes = 0;
+    uint64_t invalid_frames = 0;
+    uint64_t invalid_selections = 0;
     uint64_t redist_time = 0;
     uint64_t redist_start, redist_end;
-    while (!stream.ServerFinished())
+    uint64_t start = GetCurrentTime();
+    while (!stream.ServerFinished() && (max_frames < 0 || (int64_t)num_frames < max_frames))
     {
         stream.Read();
-        MPI_Barrier(MPI_COMM_WORLD);
-        // process data
-        redist_start = GetCurrentTime();
-        stream.FillSelection(selection, pixel_list + (img_size * num_frames));
-        redist_end = GetCurrentTime();
-        redist_time += redist_end - redist_start;
-
-        MPI_Barrier(MPI_COMM_WORLD);
+        if (stream.ServerFinished())
+        {
+            break;
+        }
+        // frame stats - latency assumes server and client clocks are synchronized
+        double latency = stream.GetFrameLatency();
+        latency_min = std::min(latency_min, latency);
+        latency_max = std::max(latency_max, latency);
+        latency_sum += latency;
+        latency_histogram[std::min((uint64_t)std::max(latency / LATENCY_BUCKET_WIDTH, 0.0), (uint64_t)LATENCY_BUCKETS - 1)]++;
+        if (verify && !stream.FrameChecksumValid())
+        {
+            fprintf(stderr, "[rank %d] checksum mismatch in frame %u\n", rank, stream.GetFrameId());
+            invalid_frames++;
+        }
+
+        int c;
+        for (c = 0; c < channels.size(); c++)
+        {
+            uint64_t img_size = (uint64_t)sizes[0] * sizes[1] * PxStream::GetBitsPerPixel(stream.GetChannelPixelFormat(channels[c]), stream.GetChannelPixelDataType(channels[c])) / 8;
+            uint8_t *dst = (writer != NULL) ? writer->AcquireBuffer() : pixels;
+            redist_start = GetCurrentTime();
+            stream.FillSelection(selections[c], dst);
+            redist_end = GetCurrentTime();
+            redist_time += redist_end - redist_start;
+            if (verify && !stream.SelectionChecksumValid())
+            {
+                invalid_selections++;
+            }
+            if (writer != NULL)
+            {
+                writer->Write(dst, img_size);
+            }
+            num_bytes += img_size;
+        }
         num_frames++;
     }
-    num_frames--;
     uint64_t end = GetCurrentTime();
+    uint64_t bytes_written = (writer != NULL) ? writer->Close() : 0;
+
+    // aggregate across ranks
+    uint64_t local_counts[4] = {num_bytes, invalid_frames, bytes_written, invalid_selections};
+    uint64_t total_counts[4];
+    double local_latency[2] = {-latency_min, latency_max};
+    double global_latency[2];
+    double total_latency_sum;
+    std::vector<uint64_t> global_histogram(LATENCY_BUCKETS, 0);
+    MPI_Reduce(local_counts, total_counts, 4, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(local_latency, global_latency, 2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&latency_sum, &total_latency_sum, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(latency_histogram.data(), global_histogram.data(), LATENCY_BUCKETS, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
     if (rank == 0)
     {
         double elapsed = (double)(end - start) / 1000.0;
-        uint64_t overall_data = global_width * global_height * 4LL * 26LL;//4LL * 8LL * 26LL;
-        double speed = (double)overall_data / elapsed;
-        printf("finished - received %d frames in %.3lf secs (%.3lf Mbps)\n", num_frames + 1, (double)(end - start) / 1000.0, speed / (1024.0 * 1024.0));
+        printf("finished - received %lu frames in %.3lf secs (%.3lf fps, %.3lf Mbps)\n", num_frames, elapsed,
+               num_frames / elapsed, 8.0 * total_counts[0] / elapsed / (1000.0 * 1000.0));
         printf("redistribution time: %.3lf\n", (double)redist_time / 1000.0);
+        if (num_frames > 0)
+        {
+            // percentile from the merged histogram (bucket upper bound)
+            uint64_t samples = num_frames * num_ranks;
+            uint64_t p99_target = (uint64_t)ceil(0.99 * samples);
+            uint64_t seen = 0;
+            int bucket;
+            for (bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++)
+            {
+                seen += global_histogram[bucket];
+                if (seen >= p99_target) break;
+            }
+            printf("latency: min %.3lf ms, mean %.3lf ms, p99 < %.3lf ms, max %.3lf ms\n", -global_latency[0] * 1000.0,
+                   total_latency_sum / samples * 1000.0, (bucket + 1) * LATENCY_BUCKET_WIDTH * 1000.0, global_latency[1] * 1000.0);
+        }
+        if (verify) printf("checksums: %lu invalid frame tiles (after receive), %lu invalid selections (after redistribution)\n", total_counts[1], total_counts[3]);
+        if (writer != NULL) printf("wrote %lu bytes\n", total_counts[2]);
     }
 
-    
-    char filename[64];
-    int i;
-    /*
-    sprintf(filename, "pxstream_%02d.ppm", rank);
-    FILE *fp = fopen(filename, "wb");
-    fprintf(fp, "P6\n%d %d\n255\n", sizes[0], sizes[1]);
-    for (i = 0; i < sizes[0] * sizes[1]; i++)
-    {
-        uint8_t *px = pixel_list + (num_frames * sizes[0] * sizes[1] * 4) + i * 4;
-        fprintf(fp, "%c%c%c", px[0], px[1], px[2]);
-    }
-    fclose(fp);
-    */
-    sprintf(filename, "pxstream_%02d.dxt1", rank);
-    FILE *fp = fopen(filename, "wb");
-    fwrite(pixel_list + (num_frames * sizes[0] * sizes[1] / 2), 1, sizes[0] * sizes[1] / 2, fp);
-    fclose(fp);
+    delete writer;
+    delete[] pixels;
 
     MPI_Finalize();
-    
+
     return 0;
 }
 
@@ -94,3 +233,96 @@ uint64_t GetCurrentTime()
 {
     return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 }
+
+AsyncWriter::AsyncWriter(const char *filename, uint64_t buffer_size, int buffer_count) :
+    done(false),
+    bytes_written(0)
+{
+    fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Error: cannot open %s\n", filename);
+        return;
+    }
+    int i;
+    for (i = 0; i < buffer_count; i++)
+    {
+        buffers.push_back(new uint8_t[buffer_size]);
+        free_buffers.push_back(buffers[i]);
+    }
+    writer = std::thread(&AsyncWriter::WriteLoop, this);
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    Close();
+    int i;
+    for (i = 0; i < buffers.size(); i++)
+    {
+        delete[] buffers[i];
+    }
+}
+
+bool AsyncWriter::IsOpen()
+{
+    return fp != NULL;
+}
+
+uint8_t* AsyncWriter::AcquireBuffer()
+{
+    // blocks when the disk falls behind - memory stays bounded at buffer_count frames
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this]() { return !free_buffers.empty(); });
+    uint8_t *buffer = free_buffers.front();
+    free_buffers.pop_front();
+    return buffer;
+}
+
+void AsyncWriter::Write(uint8_t *buffer, uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back({buffer, size});
+    condition.notify_all();
+}
+
+uint64_t AsyncWriter::Close()
+{
+    if (writer.joinable())
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done = true;
+        lock.unlock();
+        condition.notify_all();
+        writer.join();
+    }
+    if (fp != NULL)
+    {
+        fclose(fp);
+        fp = NULL;
+    }
+    return bytes_written;
+}
+
+void AsyncWriter::WriteLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        condition.wait(lock, [this]() { return done || !jobs.empty(); });
+        if (jobs.empty())
+        {
+            break;
+        }
+        WriteJob job = jobs.front();
+        jobs.pop_front();
+        lock.unlock();
+        if (fwrite(job.buffer, 1, job.size, fp) != job.size)
+        {
+            fprintf(stderr, "Error: frame write failed\n");
+        }
+        lock.lock();
+        bytes_written += job.size;
+        free_buffers.push_back(job.buffer);
+        condition.notify_all();
+    }
+}
@@ -0,0 +1,94 @@
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "pxstream.h"
+
+// Memory placement benchmark: cost per frame of receiving a frame into a pixel buffer (socket -> buffer
+// copy) and redistributing it (buffer -> send copy), for different placements of the pixel buffer
+//   pxmembench [width] [height] [frames]
+// the benchmark thread runs on NUMA node 0 (the "NIC" node) - buffers are allocated with new[], with the
+// default allocator on node 0 (local) and on the last node (remote, only on multi-socket machines).
+// Each frame moves 4x its size over the memory bus (two copies, each reading and writing it once);
+// prints one CSV line per placement: placement,ms_per_frame,bus_gb_per_s,remote_mb_per_frame
+
+typedef struct Placement {
+    std::string name;
+    int numa_node;      // -2 = new[]
+} Placement;
+
+double GetElapsed(std::chrono::steady_clock::time_point start);
+
+int main(int argc, char **argv)
+{
+    uint64_t width = (argc >= 2) ? atoll(argv[1]) : 3840;
+    uint64_t height = (argc >= 3) ? atoll(argv[2]) : 2160;
+    int frames = (argc >= 4) ? atoi(argv[3]) : 100;
+    uint64_t frame_size = width * height * 4;
+
+    int num_nodes = PxStream::GetNumaNodeCount();
+    if (!PxStream::BindThreadToNumaNode(0))
+    {
+        fprintf(stderr, "Warning: could not bind benchmark thread to NUMA node 0\n");
+    }
+    std::vector<Placement> placements = {{"new[]", -2}, {"local", 0}};
+    if (num_nodes > 1)
+    {
+        placements.push_back({"remote", num_nodes - 1});
+    }
+
+    // stand-ins for the socket receive buffer and the redistribution send buffer (both local)
+    uint8_t *socket_buffer = reinterpret_cast<uint8_t*>(PxStream::AllocateHugePageBuffer(frame_size, 0));
+    uint8_t *send_buffer = reinterpret_cast<uint8_t*>(PxStream::AllocateHugePageBuffer(frame_size, 0));
+    memset(socket_buffer, 0x5A, frame_size);
+
+    printf("placement,ms_per_frame,bus_gb_per_s,remote_mb_per_frame\n");
+    for (auto& placement : placements)
+    {
+        uint8_t *pixels;
+        if (placement.numa_node == -2)
+        {
+            pixels = new uint8_t[frame_size];
+            memset(pixels, 0, frame_size);
+        }
+        else
+        {
+            pixels = reinterpret_cast<uint8_t*>(PxStream::AllocateHugePageBuffer(frame_size, placement.numa_node));
+        }
+
+        int i;
+        memcpy(pixels, socket_buffer, frame_size); // warm up
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (i = 0; i < frames; i++)
+        {
+            socket_buffer[i % frame_size]++;
+            memcpy(pixels, socket_buffer, frame_size);
+            memcpy(send_buffer, pixels, frame_size);
+        }
+        double seconds = GetElapsed(start);
+
+        // every access to a remote buffer crosses the socket interconnect
+        double remote_mb = (placement.numa_node > 0) ? 2.0 * frame_size / 1048576.0 : 0.0;
+        printf("%s,%.3lf,%.2lf,%.1lf\n", placement.name.c_str(), 1000.0 * seconds / frames,
+               4.0 * frame_size * frames / seconds / 1.0e9, remote_mb);
+
+        if (placement.numa_node == -2)
+        {
+            delete[] pixels;
+        }
+        else
+        {
+            PxStream::FreeHugePageBuffer(pixels, frame_size);
+        }
+    }
+    PxStream::FreeHugePageBuffer(socket_buffer, frame_size);
+    PxStream::FreeHugePageBuffer(send_buffer, frame_size);
+
+    return 0;
+}
+
+double GetElapsed(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,155 @@
+#include <iostream>
+#include <string>
+#include <cmath>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <mpi.h>
+
+#include "pxstream/server.h"
+#include "pxstream/mappedstream.h"
+
+void GetClosestFactors2(int value, int *factor_1, int *factor_2);
+uint64_t GetCurrentTime();
+
+int main(int argc, char **argv)
+{
+    // initialize MPI
+    int rc, rank, num_ranks;
+    rc = MPI_Init(&argc, &argv);
+    rc |= MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    rc |= MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+    if (rc != 0)
+    {
+        fprintf(stderr, "Error initializing MPI and obtaining task ID information\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    // open this rank's segment (<base>_r<rank><ext>) of a recording (.pxr) or DXT1 video (.d1v)
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: pxreplay <recording.pxr | video.d1v> [fps] [prefetch_frames]\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    double fps = (argc >= 3) ? atof(argv[2]) : 0.0;
+    uint32_t prefetch = (argc >= 4) ? atoi(argv[3]) : 8;
+    std::string stream_template = std::string(argv[1]);
+    int pos = stream_template.rfind(".");
+    std::string base = stream_template.substr(0, pos);
+    std::string extension = stream_template.substr(pos, stream_template.length() - pos);
+    char filename[256];
+    snprintf(filename, 256, "%s_r%02d%s", base.c_str(), rank, extension.c_str());
+    PxStream::MappedStream video(filename);
+    if (!video.IsOpen())
+    {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    PxStream::RecordingHeader header = video.GetHeader();
+    if (fps <= 0.0)
+    {
+        fps = video.GetFramesPerSecond();
+    }
+
+    // all ranks stream the same number of frames
+    uint64_t local_frames = video.GetFrameCount();
+    uint64_t num_frames;
+    MPI_Allreduce(&local_frames, &num_frames, 1, MPI_UINT64_T, MPI_MIN, MPI_COMM_WORLD);
+    if (rank == 0) printf("[Replay] Found %llu frames to stream (%.2lf fps)\n", (unsigned long long)num_frames, fps);
+
+    // recordings carry their own tile layout - videos are split into a grid
+    uint32_t global_width = header.global_width;
+    uint32_t global_height = header.global_height;
+    uint32_t offset_x = header.local_offset_x;
+    uint32_t offset_y = header.local_offset_y;
+    if (header.magic == PXSTREAM_D1V_MAGIC)
+    {
+        int rows;
+        int cols;
+        GetClosestFactors2(num_ranks, &cols, &rows);
+        global_width = header.local_width * cols;
+        global_height = header.local_height * rows;
+        offset_x = (rank % cols) * header.local_width;
+        offset_y = (rank / cols) * header.local_height;
+    }
+
+    // initialize PxStream
+    uint16_t port_min = 8000;
+    uint16_t port_max = 8015;
+    PxStream::Server stream("lo0", port_min, port_max, MPI_COMM_WORLD, PxStream::TransportProfile::HighThroughput);
+    stream.SetImageFormat(header.format, header.data_type);
+    stream.SetGlobalImageSize(global_width, global_height);
+    stream.SetLocalImageSize(header.local_width, header.local_height);
+    stream.SetLocalImageOffset(offset_x, offset_y);
+    stream.SetFrameRateLimit(fps);
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (rank == 0)
+    {
+        char master_ip[16];
+        uint16_t master_port;
+        stream.GetMasterIpAddress(master_ip);
+        stream.GetMasterPort(&master_port);
+        printf("[Replay] Ready for client connections on %s:%u\n", master_ip, master_port);
+    }
+    stream.Listen(PxStream::Server::StreamBehavior::WaitForAll, 1);
+
+    // stream loop - frames are sent straight out of the mapping, at most `prefetch` in flight
+    std::mutex in_flight_mutex;
+    std::condition_variable in_flight_condition;
+    uint32_t in_flight = 0;
+    uint64_t i;
+    uint32_t size;
+    PxStream::PixelFormat format;
+    PxStream::PixelDataType type;
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (rank == 0) printf("[Replay] Begin stream loop\n");
+    uint64_t start = GetCurrentTime();
+    video.Prefetch(0, prefetch);
+    for (i = 0; i < num_frames; i++)
+    {
+        std::unique_lock<std::mutex> lock(in_flight_mutex);
+        while (in_flight >= prefetch)
+        {
+            in_flight_condition.wait(lock);
+        }
+        in_flight++;
+        lock.unlock();
+
+        video.Prefetch(i + prefetch, 1);
+        void *frame = video.GetFrame(i, &size, &format, &type);
+        stream.SubmitFrame(frame, size, format, type, [&, i](void *buffer) {
+            video.Evict(i, 1);
+            std::lock_guard<std::mutex> lock(in_flight_mutex);
+            in_flight--;
+            in_flight_condition.notify_all();
+        });
+    }
+    std::unique_lock<std::mutex> lock(in_flight_mutex);
+    while (in_flight > 0)
+    {
+        in_flight_condition.wait(lock);
+    }
+    lock.unlock();
+    uint64_t end = GetCurrentTime();
+    if (rank == 0) printf("[Replay] streamed %llu frames in %.3lf secs\n", (unsigned long long)num_frames, (double)(end - start) / 1000.0);
+    stream.Finalize();
+
+    MPI_Finalize();
+
+    return 0;
+}
+
+void GetClosestFactors2(int value, int *factor_1, int *factor_2)
+{
+    int test_num = (int)sqrt(value);
+    while (value % test_num != 0)
+    {
+        test_num--;
+    }
+    *factor_2 = test_num;
+    *factor_1 = value / test_num;
+}
+
+uint64_t GetCurrentTime()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
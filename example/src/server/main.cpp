@@ -1,15 +1,26 @@
 #include <iostream>
 #include <string>
+#include <chrono>
+#include <thread>
 #include <vector>
+#include <mutex>
+#include <condition_variable>
 #include <ifaddrs.h>
 #include <mpi.h>
 
 #include "pxstream/server.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#include "d1vreader.hpp"
+#include "decodepipeline.hpp"
+#include "syntheticsource.hpp"
 
 #define IMAGE_SEQUENCE 0
 #define IMAGE_DXT1VIDEO 1
+#define IMAGE_SYNTHETIC 2
+#define D1V_RING_SIZE 8
+#define PASSTHROUGH_IN_FLIGHT 4
+#define SYNTHETIC_RING_SIZE 16
 
 typedef struct CompressedImageData {
     unsigned char *data;
@@ -22,12 +33,21 @@ typedef struct ImageData {
     int32_t height;
 } ImageData;
 
+typedef struct SyntheticSpec {
+    int32_t width;
+    int32_t height;
+    SyntheticSource::Pattern pattern;
+    double change_fraction;
+    PxStream::PixelFormat format;
+    PxStream::PixelDataType data_type;
+    int32_t num_frames;
+    double fps;
+} SyntheticSpec;
+
 void GetFrameList(int rank, std::string img_template, int start, int increment, std::vector<std::string> *frame_list);
-void LoadD1vInfo(int rank, std::string filename, int *d1v_w, int *d1v_h, int *d1v_num_frames);
 void GetClosestFactors2(int value, int *factor_1, int *factor_2);
 int32_t ReadFile(const char *filename, char **data);
-uint32_t toBigEndian(uint32_t val);
-uint32_t toLittleEndian(uint32_t val);
+bool ParseSyntheticSpec(std::string spec, SyntheticSpec *synthetic);
 
 int main(int argc, char **argv)
 {
@@ -51,9 +71,14 @@ int main(int argc, char **argv)
     int start = 0;
     int increment = 1;
     bool predecompress = false;
+    bool passthrough = false;
     if (argc >= 3) start = atoi(argv[2]);
     if (argc >= 4) increment = atoi(argv[3]);
-    if (argc >= 5) predecompress = strcmp(argv[4], "0") != 0;
+    if (argc >= 5) predecompress = strcmp(argv[4], "1") == 0;
+    if (argc >= 5) passthrough = strcmp(argv[4], "2") == 0; // send image files as-is, clients decode
+    uint32_t decode_workers = std::max(1u, std::thread::hardware_concurrency() - 1);
+    if (argc >= 6) decode_workers = std::max(1, atoi(argv[5]));
+    uint32_t decode_depth = 2 * decode_workers;
     std::vector<std::string> frame_list;
     std::string image_template = std::string(argv[1]);
     int type = IMAGE_SEQUENCE;
@@ -61,23 +86,46 @@ int main(int argc, char **argv)
     std::string base = image_template.substr(0, pos);
     std::string extension = image_template.substr(pos, image_template.length() - pos);
     char filename[256];
-    int d1v_w, d1v_h, d1v_num_frames;
-    if (extension == ".d1v")
+    D1vReader *d1v = NULL;
+    SyntheticSource *synthetic = NULL;
+    SyntheticSource *synthetic_depth = NULL;
+    SyntheticSpec synthetic_spec;
+    if (image_template.compare(0, 10, "synthetic:") == 0)
+    {
+        // synthetic:WxH[:pattern[:format[:frames[:fps]]]] - procedural frames, no disk I/O or decode
+        type = IMAGE_SYNTHETIC;
+        if (!ParseSyntheticSpec(image_template.substr(10), &synthetic_spec))
+        {
+            fprintf(stderr, "Error: synthetic source must be synthetic:WxH[:gradient|noise|moving|changed=F[:rgba|rgb|gray|dxt1[-uint16|-uint32|-float|-double][:frames[:fps]]]]\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    else if (extension == ".d1v")
     {
         type = IMAGE_DXT1VIDEO;
     }
-    if (type == IMAGE_SEQUENCE)
+    if (type == IMAGE_SYNTHETIC)
+    {
+        // frame generation is deferred until the tile offset is known
+    }
+    else if (type == IMAGE_SEQUENCE)
     {
         GetFrameList(rank, image_template, start, increment, &frame_list);
     }
     else
     {
         snprintf(filename, 256, "%s_r%02d%s", base.c_str(), rank, extension.c_str());
-        LoadD1vInfo(rank, filename, &d1v_w, &d1v_h, &d1v_num_frames);
+        // frames are streamed from disk through a small prefetch ring rather than loaded up front
+        d1v = new D1vReader(filename, D1V_RING_SIZE);
+        if (!d1v->IsOpen())
+        {
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
     }
     MPI_Barrier(MPI_COMM_WORLD);
     if (rank == 0 && type == IMAGE_SEQUENCE) printf("[ImageStream] Found %lu frames to stream\n", frame_list.size());
-    else if (rank == 0 && type == IMAGE_DXT1VIDEO) printf("[ImageStream] Found %d frames to stream\n", d1v_num_frames);
+    else if (rank == 0 && type == IMAGE_DXT1VIDEO) printf("[ImageStream] Found %u frames to stream (%u fps)\n", d1v->GetFrameCount(), d1v->GetFps());
+    else if (rank == 0) printf("[ImageStream] Generating %d synthetic frames to stream\n", synthetic_spec.num_frames);
 
     // split into grid
     int rows;
@@ -108,35 +156,48 @@ int main(int argc, char **argv)
             }
         }
     }
+    else if (type == IMAGE_DXT1VIDEO)
+    {
+        w = d1v->GetWidth();
+        h = d1v->GetHeight();
+    }
     else
     {
-        predecompress = true;
-        w = d1v_w;
-        h = d1v_h;
-        FILE *d1vF = fopen(filename, "rb");
-        fseek(d1vF, 18, SEEK_SET);
-        uint32_t frame_size = d1v_w * d1v_h / 2;
-        for (i = 0; i < d1v_num_frames; i++)
+        w = synthetic_spec.width;
+        h = synthetic_spec.height;
+        uint32_t workers = std::max(1u, std::thread::hardware_concurrency());
+        std::chrono::steady_clock::time_point generate_start = std::chrono::steady_clock::now();
+        synthetic = new SyntheticSource(w, h, m_col * w, m_row * h, synthetic_spec.format, synthetic_spec.data_type, synthetic_spec.pattern,
+                                        synthetic_spec.change_fraction, SYNTHETIC_RING_SIZE, workers);
+        if (!synthetic->IsValid())
         {
-            ImageData decompressed_img;
-            decompressed_img.data = new unsigned char[frame_size];
-            decompressed_img.width = d1v_w;
-            decompressed_img.height = d1v_h;
-            fread(decompressed_img.data, 1, frame_size, d1vF);
-            decompressed_images.push_back(decompressed_img);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        double generate_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - generate_start).count();
+        if (rank == 0) printf("[ImageStream] Generated %u synthetic ring frames (%u bytes each) in %.3lf s\n", SYNTHETIC_RING_SIZE, synthetic->GetFrameSize(), generate_time);
+        if (getenv("PXSTREAM_DEPTH_CHANNEL") != NULL)
+        {
+            // float depth layer published alongside the color image on the same connections
+            synthetic_depth = new SyntheticSource(w, h, m_col * w, m_row * h, PxStream::PixelFormat::GrayScale, PxStream::PixelDataType::Float,
+                                                  synthetic_spec.pattern, synthetic_spec.change_fraction, SYNTHETIC_RING_SIZE, workers);
         }
-        fclose(d1vF);
     }
 
     // decompress first image
     ImageData send_img;
-    if (predecompress)
+    if (type == IMAGE_DXT1VIDEO || type == IMAGE_SYNTHETIC)
+    {
+        send_img.data = NULL;
+    }
+    else if (predecompress)
     {
         send_img = decompressed_images[0];
     }
     else
     {
-        send_img.data = stbi_load_from_memory(compressed_images[0].data, compressed_images[0].length, &w, &h, &c, STBI_rgb_alpha);
+        // frames are decoded during streaming (or by clients) - only need dimensions here
+        stbi_info_from_memory(compressed_images[0].data, compressed_images[0].length, &w, &h, &c);
+        send_img.data = NULL;
         send_img.width = w;
         send_img.height = h;
     }
@@ -148,18 +209,48 @@ int main(int argc, char **argv)
     uint32_t global_width = w * cols;
     uint32_t global_height = h * rows;
     if (rank == 0) printf("[ImageStream] Image load complete (%dx%d)\n", global_width, global_height);
-    PxStream::Server stream("lo0", port_min, port_max, MPI_COMM_WORLD);
-    if (type == IMAGE_SEQUENCE)
+    PxStream::TransportProfile profile = PxStream::TransportProfile::Default;
+    const char *profile_name = getenv("PXSTREAM_PROFILE"); // "latency" (steering) or "throughput" (playback)
+    if (profile_name != NULL && strcmp(profile_name, "latency") == 0) profile = PxStream::TransportProfile::LowLatency;
+    if (profile_name != NULL && strcmp(profile_name, "throughput") == 0) profile = PxStream::TransportProfile::HighThroughput;
+    PxStream::Server stream("lo0", port_min, port_max, MPI_COMM_WORLD, profile);
+    if (type == IMAGE_SEQUENCE && passthrough)
+    {
+        stream.SetImageFormat(PxStream::PixelFormat::EncodedImage, PxStream::PixelDataType::Uint8);
+    }
+    else if (type == IMAGE_SEQUENCE)
     {
         stream.SetImageFormat(PxStream::PixelFormat::RGBA, PxStream::PixelDataType::Uint8);
     }
-    else
+    else if (type == IMAGE_DXT1VIDEO)
     {
         stream.SetImageFormat(PxStream::PixelFormat::DXT1, PxStream::PixelDataType::Uint8);
     }
+    else
+    {
+        stream.SetImageFormat(synthetic_spec.format, synthetic_spec.data_type);
+    }
+    if (synthetic_depth != NULL)
+    {
+        stream.AddChannel("depth", PxStream::PixelFormat::GrayScale, PxStream::PixelDataType::Float);
+    }
+    stream.SetFrameChecksums(getenv("PXSTREAM_CHECKSUMS") != NULL); // lets a -verify sink validate every frame
     stream.SetGlobalImageSize(global_width, global_height);
     stream.SetLocalImageSize(w, h);
     stream.SetLocalImageOffset(m_col * w, m_row * h);
+    if (type == IMAGE_DXT1VIDEO)
+    {
+        stream.SetFrameRateLimit(d1v->GetFps());
+    }
+    else if (type == IMAGE_SYNTHETIC)
+    {
+        if (synthetic_spec.fps > 0.0) stream.SetFrameRateLimit(synthetic_spec.fps);
+    }
+    else if (!predecompress && !passthrough)
+    {
+        // enough pooled frames for every decoded-ahead frame plus one being sent
+        stream.SetFramePoolSize(decode_depth + 2);
+    }
     MPI_Barrier(MPI_COMM_WORLD);
     if (rank == 0)
     {
@@ -174,30 +265,114 @@ int main(int argc, char **argv)
     // stream loop
     MPI_Barrier(MPI_COMM_WORLD);
     if (rank == 0) printf("[ImageStream] Begin stream loop\n");
-    int num_frames = (type == IMAGE_SEQUENCE) ? frame_list.size() : d1v_num_frames;
+    int num_frames = (type == IMAGE_SEQUENCE) ? frame_list.size() : ((type == IMAGE_DXT1VIDEO) ? d1v->GetFrameCount() : synthetic_spec.num_frames);
+    DecodePipeline *decoder = NULL;
+    if (type == IMAGE_SEQUENCE && !predecompress && !passthrough)
+    {
+        // decode workers fill pooled server frames ahead of the stream loop
+        decoder = new DecodePipeline(num_frames, decode_workers, decode_depth, [&stream]() {
+            return stream.AcquireFrame();
+        }, [&compressed_images, w, h](uint32_t index, void *dst) {
+            int dw, dh, dc;
+            unsigned char *pixels = stbi_load_from_memory(compressed_images[index].data, compressed_images[index].length, &dw, &dh, &dc, STBI_rgb_alpha);
+            if (pixels == NULL || dw != w || dh != h)
+            {
+                if (pixels != NULL) stbi_image_free(pixels);
+                return false;
+            }
+            memcpy(dst, pixels, w * h * 4);
+            stbi_image_free(pixels);
+            return true;
+        });
+    }
+    std::mutex passthrough_mutex;
+    std::condition_variable passthrough_condition;
+    int passthrough_in_flight = 0;
+    std::chrono::steady_clock::time_point stream_start = std::chrono::steady_clock::now();
     for (i = 0; i < num_frames; i++)
     {
-        stream.SetFrameImage(send_img.data);
-        stream.Write();
-
-        if (i + 1 < num_frames)
+        if (type == IMAGE_DXT1VIDEO)
         {
-            if (predecompress)
+            // ring slot is handed back to the reader once every client has received it
+            unsigned char *frame = d1v->AcquireFrame(i);
+            if (frame == NULL)
             {
-                send_img = decompressed_images[i + 1];
+                fprintf(stderr, "Error: D1V video ended early (frame %d)\n", i);
+                MPI_Abort(MPI_COMM_WORLD, 1);
             }
-            else
+            stream.SubmitFrame(frame, [d1v, i](void *buffer) {
+                d1v->ReleaseFrame(i);
+            });
+            continue;
+        }
+
+        if (type == IMAGE_SYNTHETIC)
+        {
+            if (synthetic_depth != NULL)
             {
-                send_img.data = stbi_load_from_memory(compressed_images[i + 1].data, compressed_images[i + 1].length, &w, &h, &c, STBI_rgb_alpha);
-                send_img.width = w;
-                send_img.height = h;
+                stream.SubmitChannelFrame(1, synthetic_depth->AcquireFrame(i), [synthetic_depth, i](void *buffer) {
+                    synthetic_depth->ReleaseFrame(i);
+                });
             }
+            stream.SubmitFrame(synthetic->AcquireFrame(i), [synthetic, i](void *buffer) {
+                synthetic->ReleaseFrame(i);
+            });
+            continue;
         }
 
+        if (passthrough)
+        {
+            // compressed file bytes are sent untouched - bound how many are queued on the network
+            std::unique_lock<std::mutex> lock(passthrough_mutex);
+            passthrough_condition.wait(lock, [&passthrough_in_flight]() { return passthrough_in_flight < PASSTHROUGH_IN_FLIGHT; });
+            passthrough_in_flight++;
+            lock.unlock();
+            stream.SubmitFrame(compressed_images[i].data, compressed_images[i].length, PxStream::PixelFormat::EncodedImage, PxStream::PixelDataType::Uint8,
+                               [&passthrough_mutex, &passthrough_condition, &passthrough_in_flight](void *buffer) {
+                std::lock_guard<std::mutex> guard(passthrough_mutex);
+                passthrough_in_flight--;
+                passthrough_condition.notify_one();
+            });
+            continue;
+        }
+
+        if (!predecompress)
+        {
+            stream.SubmitFrame(decoder->Next(i));
+            continue;
+        }
+
+        stream.SetFrameImage(send_img.data);
+        stream.Write();
+        if (i + 1 < num_frames)
+        {
+            send_img = decompressed_images[i + 1];
+        }
         stream.AdvanceToNextFrame();
     }
+    double stream_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - stream_start).count();
+    if (decoder != NULL)
+    {
+        // decode-bound: stream loop stalled waiting on decoders; network-bound: decoders waited for free frames
+        double decode_fps = (decoder->GetDecodeTime() > 0.0) ? num_frames * decoder->GetWorkerCount() / decoder->GetDecodeTime() : 0.0;
+        double stall = decoder->GetConsumerStallTime();
+        double blocked = decoder->GetAcquireWaitTime() / decoder->GetWorkerCount();
+        printf("[ImageStream] [rank %d] %.2lf fps overall, decode capacity %.2lf fps (%u workers), stream stalled on decode %.3lf s, decoders blocked on network %.3lf s -> %s-bound\n",
+               rank, num_frames / stream_time, decode_fps, decoder->GetWorkerCount(), stall, blocked, (stall > blocked) ? "decode" : "network");
+        delete decoder;
+    }
+    if (type == IMAGE_SYNTHETIC)
+    {
+        // pure transport throughput - nothing but the network in the stream path
+        double bytes = (double)(synthetic->GetFrameSize() + ((synthetic_depth != NULL) ? synthetic_depth->GetFrameSize() : 0)) * num_frames;
+        printf("[ImageStream] [rank %d] %.2lf fps, %.3lf Mbps (%u bytes/frame)\n", rank, num_frames / stream_time,
+               8.0 * bytes / stream_time / (1000.0 * 1000.0), (uint32_t)(bytes / num_frames));
+    }
     if (rank == 0) printf("all done - goodbye\n");
     stream.Finalize();
+    delete d1v;
+    delete synthetic;
+    delete synthetic_depth;
 
     MPI_Finalize();
     
@@ -287,33 +462,6 @@ void GetFrameList(int rank, std::string img_template, int start, int increment,
     frame_list->pop_back();
 }
 
-void LoadD1vInfo(int rank, std::string filename, int *d1v_w, int *d1v_h, int *d1v_num_frames)
-{
-    uint32_t magic;
-    uint32_t d_uint32;
-    uint16_t d_uint16;
-
-    FILE *d1vF = fopen(filename.c_str(), "rb");
-
-    // check for magic number at beginning of file
-    fread(&d_uint32, 4, 1, d1vF);
-    magic = toBigEndian(d_uint32);
-    if (magic != 0x2E443156) { //.D1V
-        printf("Error: input file not recognized as D1V video\n");
-        return;
-    }
-    fread(&d_uint32, 4, 1, d1vF);
-    *d1v_w = toLittleEndian(d_uint32);
-    fread(&d_uint32, 4, 1, d1vF);
-    *d1v_h = toLittleEndian(d_uint32);
-    fread(&d_uint32, 4, 1, d1vF);
-    *d1v_num_frames = toLittleEndian(d_uint32);
-    fread(&d_uint16, 2, 1, d1vF);
-    uint16_t d1vFps = toLittleEndian(d_uint16);
-
-    fclose(d1vF);
-}
-
 void GetClosestFactors2(int value, int *factor_1, int *factor_2)
 {
     int test_num = (int)sqrt(value);
@@ -350,28 +498,63 @@ int32_t ReadFile(const char *filename, char **data)
     return fsize;
 }
 
-uint32_t toBigEndian(uint32_t val)
+bool ParseSyntheticSpec(std::string spec, SyntheticSpec *synthetic)
 {
-    uint32_t test = 0x01000000;
-    uint8_t isBigEndian = *(uint8_t*)&test;
-
-    if (isBigEndian) return val;
-
-    return (val        & 0xFF) << 24
-        | ((val >>  8) & 0xFF) << 16
-        | ((val >> 16) & 0xFF) <<  8
-        | ((val >> 24) & 0xFF);
-}
-
-uint32_t toLittleEndian(uint32_t val)
-{
-    uint32_t test = 0x00000001;
-    uint8_t isLittleEndian = *(uint8_t*)&test;
-
-    if (isLittleEndian) return val;
+    synthetic->pattern = SyntheticSource::Pattern::Moving;
+    synthetic->change_fraction = 0.0;
+    synthetic->format = PxStream::PixelFormat::RGBA;
+    synthetic->data_type = PxStream::PixelDataType::Uint8;
+    synthetic->num_frames = 300;
+    synthetic->fps = 0.0;
+
+    std::vector<std::string> fields;
+    size_t start = 0, end;
+    do
+    {
+        end = spec.find(':', start);
+        fields.push_back(spec.substr(start, end - start));
+        start = end + 1;
+    } while (end != std::string::npos);
 
-    return (val        & 0xFF) << 24
-        | ((val >>  8) & 0xFF) << 16
-        | ((val >> 16) & 0xFF) <<  8
-        | ((val >> 24) & 0xFF);
+    if (sscanf(fields[0].c_str(), "%dx%d", &(synthetic->width), &(synthetic->height)) != 2 || synthetic->width <= 0 || synthetic->height <= 0)
+    {
+        return false;
+    }
+    if (fields.size() > 1)
+    {
+        if (fields[1] == "gradient") synthetic->pattern = SyntheticSource::Pattern::Gradient;
+        else if (fields[1] == "noise") synthetic->pattern = SyntheticSource::Pattern::Noise;
+        else if (fields[1] == "moving") synthetic->pattern = SyntheticSource::Pattern::Moving;
+        else if (fields[1].compare(0, 8, "changed=") == 0)
+        {
+            synthetic->pattern = SyntheticSource::Pattern::Changed;
+            synthetic->change_fraction = atof(fields[1].substr(8).c_str());
+        }
+        else return false;
+    }
+    if (fields.size() > 2)
+    {
+        std::string format = fields[2];
+        std::string data_type = "uint8";
+        size_t dash = format.find('-');
+        if (dash != std::string::npos)
+        {
+            data_type = format.substr(dash + 1);
+            format = format.substr(0, dash);
+        }
+        if (format == "rgba") synthetic->format = PxStream::PixelFormat::RGBA;
+        else if (format == "rgb") synthetic->format = PxStream::PixelFormat::RGB;
+        else if (format == "gray") synthetic->format = PxStream::PixelFormat::GrayScale;
+        else if (format == "dxt1") synthetic->format = PxStream::PixelFormat::DXT1;
+        else return false;
+        if (data_type == "uint8") synthetic->data_type = PxStream::PixelDataType::Uint8;
+        else if (data_type == "uint16") synthetic->data_type = PxStream::PixelDataType::Uint16;
+        else if (data_type == "uint32") synthetic->data_type = PxStream::PixelDataType::Uint32;
+        else if (data_type == "float") synthetic->data_type = PxStream::PixelDataType::Float;
+        else if (data_type == "double") synthetic->data_type = PxStream::PixelDataType::Double;
+        else return false;
+    }
+    if (fields.size() > 3) synthetic->num_frames = atoi(fields[3].c_str());
+    if (fields.size() > 4) synthetic->fps = atof(fields[4].c_str());
+    return synthetic->num_frames > 0;
 }
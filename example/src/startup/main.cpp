@@ -0,0 +1,65 @@
+#include <iostream>
+#include <chrono>
+#include <mpi.h>
+#include "pxstream/client.h"
+
+// Startup benchmark: time from client construction to connected, and to first complete frame
+//   pxstartup <host> <port>
+// run against any server (e.g. pxserver synthetic:1920x1080) with different rank counts, e.g.
+//   for n in 1 2 4 8 16; do mpirun -np $n pxstartup <host> <port>; done
+// each run prints one CSV line: client_ranks,server_ranks,connect_s,first_frame_s
+
+double GetElapsed(std::chrono::steady_clock::time_point start);
+
+int main(int argc, char **argv)
+{
+    // initialize MPI
+    int rc, rank, num_ranks;
+    rc = MPI_Init(&argc, &argv);
+    rc |= MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    rc |= MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+    if (rc != 0)
+    {
+        fprintf(stderr, "Error initializing MPI and obtaining task ID information\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "Error: no host and port provided for PxStream server (rank 0)\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    // all ranks start together so the slowest rank defines time-to-first-frame
+    MPI_Barrier(MPI_COMM_WORLD);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    PxStream::Client stream(argv[1], atoi(argv[2]), MPI_COMM_WORLD);
+    double local_times[2];
+    local_times[0] = GetElapsed(start);
+    stream.Read();
+    local_times[1] = GetElapsed(start);
+
+    double max_times[2];
+    int server_ranks = stream.GetServerRankCount();
+    MPI_Reduce(local_times, max_times, 2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (rank == 0)
+    {
+        printf("client_ranks,server_ranks,connect_s,first_frame_s\n");
+        printf("%d,%d,%.6lf,%.6lf\n", num_ranks, server_ranks, max_times[0], max_times[1]);
+    }
+
+    // drain the rest of the stream so the server can finish normally
+    while (!stream.ServerFinished())
+    {
+        stream.Read();
+    }
+
+    MPI_Finalize();
+
+    return 0;
+}
+
+double GetElapsed(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
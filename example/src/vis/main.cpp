@@ -9,6 +9,8 @@
 #include <mpi.h>
 #include "pxstream/client.h"
 #include "jsobject.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
 
 // from glcorearb.h
 #ifndef GL_EXT_texture_compression_s3tc
@@ -86,6 +88,19 @@ int main(int argc, char **argv)
         fprintf(stderr, "Error: no host and port provided for PxStream server (rank 0)\n");
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
+    // servers streaming image files as-is (pass-through) need a decoder - tiles decode on reader threads
+    PxStream::SetImageDecoder([](const uint8_t *data, uint32_t length, uint8_t *rgba, uint32_t width, uint32_t height) {
+        int w, h, c;
+        unsigned char *pixels = stbi_load_from_memory(data, length, &w, &h, &c, STBI_rgb_alpha);
+        if (pixels == NULL || (uint32_t)w != width || (uint32_t)h != height)
+        {
+            if (pixels != NULL) stbi_image_free(pixels);
+            return false;
+        }
+        memcpy(rgba, pixels, width * height * 4);
+        stbi_image_free(pixels);
+        return true;
+    });
     PxStream::Client stream(argv[1], atoi(argv[2]), MPI_COMM_WORLD);
 
     uint32_t global_width, global_height;
@@ -2,6 +2,8 @@
 #define __PXSTREAM_H_
 
 #include <iostream>
+#include <string>
+#include <functional>
 #include <arpa/inet.h>
 
 #ifdef __APPLE__
@@ -12,20 +14,94 @@
 
 #define PXSTREAM_FLOATTEST 1.9961090087890625e2 // IEEE 754 ==> 0x4068F38C80000000
 #define PXSTREAM_FLOATBINARY 0x4068F38C80000000LL
+#define PXSTREAM_HUGEPAGE_SIZE 2097152ULL
+#define PXSTREAM_HUGEPAGE_THRESHOLD 8388608ULL
+#define PXSTREAM_BUFFER_ALIGNMENT 4096
+#define PXSTREAM_DEFAULT_CHUNK_SIZE 1048576
+#define PXSTREAM_FRAME_HEADER_SIZE 32
+#define PXSTREAM_SERVER_INFO_HEADER_SIZE 16
+#define PXSTREAM_CONNECT_TIMEOUT 30.0
+#define PXSTREAM_MAX_CHANNELS 32
+#define PXSTREAM_PRIMARY_CHANNEL_NAME "color"
+#define PXSTREAM_ADAPTIVE_HEADROOM 1.25
+#define PXSTREAM_ADAPTIVE_DEGRADE_FRAMES 5
+#define PXSTREAM_ADAPTIVE_UPGRADE_FRAMES 30
+#define PXSTREAM_BALANCE_THRESHOLD 1.1
+#define PXSTREAM_LOW_LATENCY_CHUNK_SIZE 65536
+#define PXSTREAM_HIGH_THROUGHPUT_SOCKET_BUFFER 16777216
+#define PXSTREAM_HIGH_THROUGHPUT_PIPELINE_DEPTH 8
+#define PXSTREAM_PROBE_FLAG 253
+#define PXSTREAM_PROBE_SIZE 4194304
+#define PXSTREAM_PROBE_MAX_SIZE 16777216
+#define PXSTREAM_MIN_SOCKET_BUFFER 262144
+#define PXSTREAM_MAX_SOCKET_BUFFER 67108864
 
 namespace PxStream {
     enum PixelDataType : uint8_t {Uint8, Uint16, Uint32, Uint64, Int8, Int16, Int32, Int64, Float, Double};
-    enum PixelFormat : uint8_t {RGBA, RGB, GrayScale, YUV444, YUV422, YUV420, DXT1};
+    enum PixelFormat : uint8_t {RGBA, RGB, GrayScale, YUV444, YUV422, YUV420, DXT1, EncodedImage};
     enum PixelOrigin : uint8_t {TopLeft, BottomLeft};
     enum Endian : uint8_t {Little, Big};
+    // LowLatency: small send chunks, no Nagle, busy-polling readers, one frame in flight (interactive steering)
+    // HighThroughput: large socket buffers, coalesced sends, deep frame pipeline (movie playback)
+    enum TransportProfile : uint8_t {Default, LowLatency, HighThroughput};
+    // library threads that can be pinned - configured with SetThreadAffinity() or PXSTREAM_READER_CPUS,
+    // PXSTREAM_SENDER_CPUS (server send / event threads) and PXSTREAM_ENCODER_CPUS (DXT1 compression)
+    enum ThreadRole : uint8_t {ReaderThreads, SenderThreads, EncoderThreads};
+
+    typedef struct FrameHeader {
+        uint8_t flag;
+        PixelFormat format;
+        PixelDataType data_type;
+        uint32_t payload_size;
+        uint32_t frame_id;
+        uint64_t timestamp;      // microseconds since epoch when the frame was submitted
+        bool has_checksum;
+        uint64_t checksum;       // ComputeChecksum() of the payload
+        uint8_t channel;         // 0 = primary image, others added with Server::AddChannel()
+    } FrameHeader;
+
+    // decodes a compressed image (PNG, JPEG, ...) into a width x height Uint8 RGBA buffer
+    typedef std::function<bool(const uint8_t *data, uint32_t length, uint8_t *rgba, uint32_t width, uint32_t height)> ImageDecoder;
+    // allocates zeroed pixel memory, preferably on `numa_node` (-1 = no preference) - and releases it again
+    // (each buffer is released by the function installed when it was allocated, so SetPixelAllocator may be
+    // called at any time - it only affects buffers allocated afterwards)
+    typedef std::function<void*(uint64_t size, int numa_node)> PixelAllocateFunction;
+    typedef std::function<void(void *buffer, uint64_t size)> PixelReleaseFunction;
 
     class Server;
     class Client;
+    class Recorder;
+    class ReaderPool;
+    class DepthCompositor;
+    class MappedStream;
 
     uint32_t GetDataTypeSize(PixelDataType type);
     uint32_t GetBitsPerPixel(PixelFormat format, PixelDataType type);
     uint64_t HToNLL(uint64_t val);
     uint64_t NToHLL(uint64_t val);
+    void PackFrameHeader(const FrameHeader& header, uint8_t buffer[PXSTREAM_FRAME_HEADER_SIZE]);
+    void UnpackFrameHeader(const uint8_t buffer[PXSTREAM_FRAME_HEADER_SIZE], FrameHeader *header);
+    uint64_t GetTimestamp();
+    uint64_t ComputeChecksum(const void *data, uint64_t size);
+    void SetImageDecoder(ImageDecoder decoder);
+    ImageDecoder GetImageDecoder();
+    void StartEncoderThreads();
+    void EncodeDxt1(const uint8_t *rgba, uint32_t width, uint32_t height, uint8_t *dxt1);
+    void CompositeDepth(const uint8_t *src_color, const float *src_depth, uint8_t *dst_color, float *dst_depth, uint64_t num_pixels, uint32_t pixel_size);
+    void CompositeOver(const uint8_t *front, const uint8_t *back, uint8_t *dst, uint64_t num_pixels);
+    void SetPixelAllocator(PixelAllocateFunction allocate, PixelReleaseFunction release);
+    void* AllocatePixelBuffer(uint64_t size, int numa_node = -1);
+    void FreePixelBuffer(void *buffer, uint64_t size);
+    void* AllocateHugePageBuffer(uint64_t size, int numa_node);
+    void FreeHugePageBuffer(void *buffer, uint64_t size);
+    int GetNumaNodeCount();
+    int GetInterfaceNumaNode(const char *iface);
+    int GetAddressNumaNode(const char *ip_address);
+    bool BindThreadToNumaNode(int numa_node);
+    void SetThreadAffinity(ThreadRole role, const char *cpus);
+    std::string GetThreadAffinity(ThreadRole role);
+    std::string DescribeThreadAffinity(ThreadRole role, int numa_node);
+    bool ApplyThreadAffinity(ThreadRole role, int numa_node);
 }
 
 #endif // __PXSTREAM_H_
@@ -2,7 +2,12 @@
 #define __PXSTREAM_CLIENT_H_
 
 #include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
 #include <thread>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <sys/ipc.h>
@@ -13,18 +18,75 @@ extern "C" {
 }
 #include <netsocket/client.h>
 #include "pxstream.h"
+#include "pxstream/readerpool.h"
 
 class PxStream::Client {
 private:
+    typedef struct Region {
+        int32_t width;
+        int32_t height;
+        int32_t offset_x;
+        int32_t offset_y;
+        int32_t priority;
+        std::vector<int32_t> visible;      // parts not hidden by higher priority regions: dims[2], offsets[2] (pixels)
+    } Region;
     typedef struct Connection {
         NetSocket::Client *client;
-        uint32_t local_width;
-        uint32_t local_height;
-        uint32_t local_offset_x;
-        uint32_t local_offset_y;
+        std::shared_ptr<std::mutex> send_mutex; // readers (acks) and the application (messages) both send
+        uint32_t server_rank;
+        std::vector<Region> regions;       // packed back to back in each frame, in the order sent
+        std::vector<Region> next_regions;  // announced by the server (load balancing) - used from the next frame
+        bool layout_received;
+        bool server_finished;              // finished flag received or server disconnected
         void *pixels;
         uint32_t pixel_size;
+        uint32_t frame_size;
+        PixelFormat frame_format;
+        PixelDataType frame_data_type;
+        std::vector<uint8_t> encoded;
+        uint32_t frame_id;
+        uint64_t frame_timestamp;
+        uint64_t receive_time;
+        bool has_checksum;
+        uint64_t frame_checksum;
+        bool checksum_valid;
+        int reader_id;
+        bool header_received;
+        bool is_encoded;
+        uint8_t channel;
+        uint32_t channels_received;
+        uint32_t read_offset;
     } Connection;
+    typedef struct Channel {
+        std::string name;
+        PixelFormat format;        // as presented (encoded images are decoded to RGBA)
+        PixelDataType data_type;
+        bool subscribed;
+        uint8_t *pixel_list[2];    // received tiles packed in connection order (double buffered)
+        uint64_t buffer_size;
+    } Channel;
+    typedef struct Selection {
+        int channel;
+        int32_t sizes[2];
+        int32_t offsets[2];
+        std::map<uint16_t, DDR_DataDescriptor*> descriptors;
+    } Selection;
+    typedef struct SelectionLayout {
+        uint32_t element_size;
+        std::vector<int32_t> own_chunks;   // visible parts of local tiles: dims[2], offsets[2] (DDR units)
+        std::vector<int64_t> own_sources;  // for each own chunk: tile byte offset, tile dims[2], tile offsets[2]
+        std::vector<int32_t> all_chunks;   // every rank's visible tile parts: dims[2], offsets[2]
+        std::vector<int32_t> needs;        // every rank's selection: dims[2], offsets[2]
+    } SelectionLayout;
+    typedef struct Transfer {
+        int rank;
+        uint64_t offset;
+        MPI_Datatype type;
+    } Transfer;
+    typedef struct RedistributionPlan {
+        std::vector<Transfer> sends;       // subarrays of the received tiles
+        std::vector<Transfer> receives;    // subarrays of the selection
+    } RedistributionPlan;
 
     int _rank;
     int _num_ranks;
@@ -36,37 +98,83 @@ private:
 
     uint32_t _global_width;
     uint32_t _global_height;
-    PixelFormat _px_format;
-    PixelDataType _px_data_type;
     PixelOrigin _px_origin;
-    uint8_t *_begin_read;
     uint32_t _finished;
-    uint8_t *_connection_pixel_list[2];
+    std::vector<Channel> _channels;
+    uint32_t _num_subscribed;
+    uint32_t _frame_credits;
+    int _numa_node;
     uint8_t _back_buffer;
+    std::map<DDR_DataDescriptor*, Selection> _selections;
+    std::map<DDR_DataDescriptor*, SelectionLayout> _layouts;
+    std::map<DDR_DataDescriptor*, RedistributionPlan> _plans;
+    bool _regions_overlap;
+    bool _verify_checksums;
+    uint32_t _frame_id;
+    double _frame_latency;
+    bool _frame_valid;
+    uint64_t _checksum_errors;
+    bool _selection_valid;
+    uint64_t _redistribution_errors;
 
-    std::thread *_read_threads;
+    ReaderPool *_reader_pool;
     std::mutex _read_mutex;
-    std::condition_variable _read_condition;
     std::condition_variable _finished_condition;
     uint32_t _read_finished_count;
 
     int _shmid;
     uint8_t *_shmem;
 
-    void ConnectionRead(int connection_idx);
+    double ProbeLink(double *rtt, double *bandwidth);
+    void SendToServer(Connection& conn, const void *data, uint32_t length);
+    void AwaitConnectionEvents(int first, int count, NetSocket::Client::EventType type, std::vector<NetSocket::Client::Event> *events, const char *stage);
+    void StartRead();
+    bool HandleReadEvent(int connection_idx, NetSocket::Client::Event& event);
+    void ReadFinished();
+    void FinishTile(int connection_idx, bool is_encoded);
+    void DecodeTile(int connection_idx);
+    uint64_t ConnectionBufferOffset(int connection_idx, PixelFormat format, PixelDataType type);
+    void AllocateChannelBuffers(Channel& channel);
+    bool ParseRegions(const uint8_t *data, uint32_t length, std::vector<Region>& regions);
+    void ApplyLayout();
+    void ResolveRegionVisibility();
+    void PixelRectToElements(const int32_t *rect, PixelFormat format, PixelDataType type, int32_t *elements);
+    void CreateRedistributionPlan(DDR_DataDescriptor *desc, MPI_Datatype type, const std::vector<int>& counts, const std::vector<int>& displacements);
+    DDR_DataDescriptor* CreatePixelSelection(int32_t *sizes, int32_t *offsets, PixelFormat format, PixelDataType type);
+    void VerifySelection(DDR_DataDescriptor *desc, const uint8_t *tiles, const uint8_t *data);
 
 public:
     Client(const char *host, uint16_t port, MPI_Comm comm);
+    Client(const char *host, uint16_t port, MPI_Comm comm, const std::vector<std::string>& channels, uint32_t frame_credits = 0,
+           TransportProfile profile = TransportProfile::Default);
     ~Client();
 
     void Init(int argc, char **argv);
     void Read();
     bool ServerFinished();
     void GetGlobalDimensions(uint32_t *width, uint32_t *height);
+    int GetServerRankCount();
     PixelFormat GetPixelFormat();
     PixelDataType GetPixelDataType();
+    int GetChannelCount();
+    int GetChannelIndex(const char *name);
+    const char* GetChannelName(int channel);
+    PixelFormat GetChannelPixelFormat(int channel);
+    PixelDataType GetChannelPixelDataType(int channel);
+    bool ChannelSubscribed(int channel);
     DDR_DataDescriptor* CreateGlobalPixelSelection(int32_t *sizes, int32_t *offsets);
+    DDR_DataDescriptor* CreateGlobalPixelSelection(int channel, int32_t *sizes, int32_t *offsets);
     void FillSelection(DDR_DataDescriptor *selection, void *data);
+    bool SendMessage(const void *data, uint32_t length, int server_rank = 0);
+    uint8_t* GetFrameTiles(int channel, uint64_t *size);
+    bool TileLayoutMatches(Client *other);
+    void SetVerifyChecksums(bool verify);
+    uint32_t GetFrameId();
+    double GetFrameLatency();
+    bool FrameChecksumValid();
+    uint64_t GetChecksumErrorCount();
+    bool SelectionChecksumValid();
+    uint64_t GetRedistributionErrorCount();
 };
 
 #endif // __PXSTREAM_CLIENT_H_
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef __PXSTREAM_COMPOSITOR_H_
+#define __PXSTREAM_COMPOSITOR_H_
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <mpi.h>
+extern "C" {
+#include <ddr.h>
+}
+#include "pxstream.h"
+#include "pxstream/client.h"
+
+#define PXSTREAM_DEFAULT_DEPTH_CHANNEL "depth"
+
+// Sort-last compositing of K upstream sources (e.g. renderer jobs that each draw part of the scene at
+// full resolution). Every source publishes the primary color image plus a GrayScale/Float depth channel.
+// Nearest depth wins, ties go to the lower source index. When every source delivers the same tiles to
+// each rank, Read() z-composites the received tiles in place and only the result is redistributed.
+// Otherwise each rank redistributes every source into its own selection and z-composites them there.
+// Either way the work is split across ranks and vectorized within each rank.
+class PxStream::DepthCompositor {
+private:
+    typedef struct SourceSelection {
+        DDR_DataDescriptor *color;
+        DDR_DataDescriptor *depth;
+    } SourceSelection;
+    typedef struct Selection {
+        uint64_t num_pixels;
+        std::vector<SourceSelection> sources;
+        std::vector<uint8_t> color_scratch;
+        std::vector<float> depth_scratch;
+    } Selection;
+
+    int _rank;
+    MPI_Comm _comm;
+
+    std::vector<Client*> _sources;
+    std::vector<int> _depth_channels;
+    uint32_t _global_width;
+    uint32_t _global_height;
+    std::map<DDR_DataDescriptor*, Selection> _selections;
+    bool _tiles_composited;
+
+    void CompositeFrameTiles();
+
+public:
+    DepthCompositor(const std::vector<std::string>& hosts, const std::vector<uint16_t>& ports, MPI_Comm comm, const char *depth_channel = PXSTREAM_DEFAULT_DEPTH_CHANNEL);
+    ~DepthCompositor();
+
+    void Read();
+    bool ServerFinished();
+    void GetGlobalDimensions(uint32_t *width, uint32_t *height);
+    PixelFormat GetPixelFormat();
+    PixelDataType GetPixelDataType();
+    int GetSourceCount();
+    Client* GetSource(int source);
+    DDR_DataDescriptor* CreateGlobalPixelSelection(int32_t *sizes, int32_t *offsets);
+    void FillSelection(DDR_DataDescriptor *selection, void *color, float *depth);
+};
+
+#endif // __PXSTREAM_COMPOSITOR_H_
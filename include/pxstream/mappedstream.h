@@ -0,0 +1,46 @@
+#ifndef __PXSTREAM_MAPPEDSTREAM_H_
+#define __PXSTREAM_MAPPEDSTREAM_H_
+
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pxstream.h"
+#include "pxstream/recorder.h"
+
+#define PXSTREAM_D1V_MAGIC 0x2E443156 // ".D1V"
+#define PXSTREAM_D1V_HEADER_SIZE 18
+
+// Read-only, memory-mapped view of a recording segment (.pxr) or DXT1 video (.d1v).
+// Frames are returned as pointers into the mapping (backed by the page cache), so they
+// can be handed directly to Server::SubmitFrame without copying.
+class PxStream::MappedStream {
+private:
+    int _fd;
+    uint8_t *_map;
+    uint64_t _map_size;
+    bool _is_recording;
+    RecordingHeader _header;
+    const RecordingIndexEntry *_index;
+    uint32_t _d1v_frame_size;
+    double _fps;
+
+    bool OpenRecording();
+    bool OpenD1v();
+    void AdviseFrames(uint64_t index, uint64_t count, int advice);
+
+public:
+    MappedStream(const char *filename);
+    ~MappedStream();
+
+    bool IsOpen();
+    uint64_t GetFrameCount();
+    const RecordingHeader& GetHeader();
+    double GetFramesPerSecond();
+    void* GetFrame(uint64_t index, uint32_t *size, PixelFormat *format, PixelDataType *type);
+    void Prefetch(uint64_t index, uint64_t count);
+    void Evict(uint64_t index, uint64_t count);
+};
+
+#endif // __PXSTREAM_MAPPEDSTREAM_H_
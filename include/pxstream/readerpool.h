@@ -0,0 +1,82 @@
+#ifndef __PXSTREAM_READERPOOL_H_
+#define __PXSTREAM_READERPOOL_H_
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <netsocket/client.h>
+#include "pxstream.h"
+
+#define PXSTREAM_READER_SPIN_PASSES 64
+#define PXSTREAM_READER_IDLE_SLEEP_US 50
+
+// Process-wide pool of reader threads shared by every Client in the process.
+// Each registered connection is owned by one reader thread, which polls it only while it is
+// active (a frame has been requested) - so many streams can share a few threads.
+// Shutdown() stops the threads once every connection has been unregistered.
+class PxStream::ReaderPool {
+public:
+    // called on a reader thread for each received buffer (and on disconnect, after which the connection
+    // is no longer polled and every later read completes at once) - returns true once the requested read is complete
+    typedef std::function<bool(NetSocket::Client::Event& event)> EventHandler;
+    // called on a reader thread after the connection has been deactivated
+    typedef std::function<void()> CompletionHandler;
+
+private:
+    typedef struct Registration {
+        NetSocket::Client *client;
+        EventHandler handler;
+        CompletionHandler complete;
+        int reader;
+        bool busy_poll;
+        bool active;
+        bool removed;
+        bool closed;
+        std::mutex mutex;
+    } Registration;
+    typedef struct Reader {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::vector<std::shared_ptr<Registration>> active;
+        uint32_t num_connections;
+        int numa_node;
+        bool stopping;
+    } Reader;
+
+    static uint32_t _requested_threads;
+    static int _requested_numa_node;
+    static ReaderPool *_instance;
+    static std::mutex _instance_mutex;
+
+    std::mutex _mutex;
+    std::map<int, std::shared_ptr<Registration>> _registrations;
+    std::vector<Reader*> _readers;
+    int _next_id;
+
+    ReaderPool(uint32_t num_threads, int numa_node);
+    ~ReaderPool();
+    void ReadLoop(Reader *reader);
+    void Deactivate(Reader *reader, const std::shared_ptr<Registration>& registration);
+
+public:
+    static ReaderPool* GetInstance(int numa_node = -1);
+    static void SetThreadCount(uint32_t count);
+    static void SetNumaNode(int numa_node);
+    static bool Shutdown();
+
+    uint32_t GetThreadCount();
+    int GetNumaNode();
+    int Register(NetSocket::Client *client, EventHandler handler, CompletionHandler complete, bool busy_poll = false);
+    void Unregister(int id);
+    void Activate(int id);
+};
+
+#endif // __PXSTREAM_READERPOOL_H_
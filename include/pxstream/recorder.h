@@ -0,0 +1,110 @@
+#ifndef __PXSTREAM_RECORDER_H_
+#define __PXSTREAM_RECORDER_H_
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unistd.h>
+#include <fcntl.h>
+#include "pxstream.h"
+
+// Recording container (one file per server rank):
+//   [header, padded to PXSTREAM_RECORDING_ALIGNMENT]
+//   [frame 0 payload, padded] [frame 1 payload, padded] ...
+//   [index: frame_count RecordingIndexEntry structs, padded]
+// All offsets are aligned so the file can be mmap'd and frame i located in O(1).
+#define PXSTREAM_RECORDING_MAGIC 0x31525850 // "PXR1"
+#define PXSTREAM_RECORDING_VERSION 1
+#define PXSTREAM_RECORDING_ALIGNMENT 4096
+#define PXSTREAM_RECORDING_STAGING_SLOTS 4
+
+namespace PxStream {
+    typedef struct RecordingHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t global_width;
+        uint32_t global_height;
+        uint32_t local_width;
+        uint32_t local_height;
+        uint32_t local_offset_x;
+        uint32_t local_offset_y;
+        uint32_t rank;
+        uint32_t num_ranks;
+        PixelFormat format;
+        PixelDataType data_type;
+        Endian endianness;
+        uint8_t reserved[5];
+        uint64_t frame_count;
+        uint64_t index_offset;
+    } RecordingHeader;
+
+    typedef struct RecordingIndexEntry {
+        uint64_t offset;
+        uint32_t size;
+        PixelFormat format;
+        PixelDataType data_type;
+        uint16_t reserved;
+        uint64_t frame_id;
+        uint64_t timestamp; // microseconds since epoch
+    } RecordingIndexEntry;
+}
+
+// Frames are copied into a ring of staging slots and handed back right away, while a separate thread writes
+// the slots to disk. A frame is held only for its copy - if the disk falls more than PXSTREAM_RECORDING_STAGING_SLOTS
+// frames behind, new frames are dropped from the recording (and counted) instead of waiting for a free slot.
+class PxStream::Recorder {
+public:
+    typedef std::function<void(const void *data)> ReleaseCallback;
+
+private:
+    typedef struct PendingRecord {
+        const void *data;
+        RecordingIndexEntry entry;
+        ReleaseCallback release_callback;
+    } PendingRecord;
+    typedef struct StagingSlot {
+        uint8_t *buffer;
+        uint64_t size;
+        RecordingIndexEntry entry;
+    } StagingSlot;
+
+    int _fd;
+    bool _direct_io;
+    RecordingHeader _header;
+    std::vector<RecordingIndexEntry> _index;
+    uint64_t _write_offset;
+    uint8_t *_staging;
+    uint64_t _staging_size;
+    StagingSlot _slots[PXSTREAM_RECORDING_STAGING_SLOTS];
+    uint64_t _dropped_frames;
+
+    std::thread _io_thread;
+    std::thread _write_thread;
+    std::mutex _queue_mutex;
+    std::condition_variable _queue_condition;
+    std::condition_variable _write_condition;
+    std::deque<PendingRecord> _queue;
+    std::deque<int> _free_slots;
+    std::deque<int> _staged_slots;
+    bool _closing;
+    bool _staging_done;
+
+    void IoLoop();
+    void WriteLoop();
+    uint8_t* StagingBuffer(uint64_t size);
+    bool WriteAligned(const void *data, uint64_t size, uint64_t offset);
+
+public:
+    Recorder(const char *filename, const RecordingHeader& header);
+    ~Recorder();
+
+    bool IsOpen();
+    void Record(const void *data, uint32_t size, PixelFormat format, PixelDataType type, uint64_t frame_id, ReleaseCallback release_callback);
+    void Close();
+};
+
+#endif // __PXSTREAM_RECORDER_H_
@@ -2,20 +2,50 @@
 #define __PXSTREAM_SERVER_H_
 
 #include <iostream>
+#include <chrono>
 #include <random>
 #include <map>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include <ifaddrs.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <mpi.h>
 #include <netsocket/server.h>
+#include <netsocket/client.h>
 #include "pxstream.h"
+#include "pxstream/recorder.h"
 
 
 class PxStream::Server {
 public:
     enum StreamBehavior : uint8_t {WaitForAll, DropFrames};
+    enum CompositeOperator : uint8_t {NoComposite, DepthTest, AlphaOver};
+    typedef std::function<void(void *buffer)> ReleaseCallback;
+    typedef struct ClientMessage {
+        uint64_t client_id;
+        std::vector<uint8_t> data;
+    } ClientMessage;
 
 private:
     enum ClientState : uint8_t {Connecting, Handshake, Streaming, Finished};
+    typedef struct TokenBucket {
+        double rate;
+        double capacity;
+        double tokens;
+        std::chrono::steady_clock::time_point last_update;
+    } TokenBucket;
+    typedef struct PendingSend {
+        void *frame;
+        void *last_chunk;
+        uint32_t payload_size;
+        std::chrono::steady_clock::time_point submit_time;
+    } PendingSend;
     typedef struct Connection {
         uint64_t id;
         ClientState state;
@@ -23,7 +53,43 @@ private:
         bool is_new;
         bool has_same_endianness;
         bool ready_to_advance;
+        uint32_t channels;       // subscription mask (bit i = channel i)
+        uint32_t credit_window;  // frames the client may have unacknowledged (0 = no flow control)
+        uint32_t credits;
+        bool frame_started;      // part of the current frame has been sent (or skipped)
+        bool skip_frame;
+        std::deque<PendingSend> pending_sends;
+        std::shared_ptr<TokenBucket> bucket;
+        double throughput;
+        std::chrono::steady_clock::time_point last_completion;
+        std::shared_ptr<std::vector<uint8_t>> connect_header; // header sent (zero-copy) during the handshake
     } Connection;
+    typedef struct ImageRegion {
+        uint32_t width;
+        uint32_t height;
+        uint32_t offset_x;
+        uint32_t offset_y;
+        int32_t priority;
+    } ImageRegion;
+    typedef struct Channel {
+        std::string name;
+        PixelFormat format;
+        PixelDataType data_type;
+        uint32_t pixel_size;
+        void *pixels;
+    } Channel;
+    typedef struct InFlightFrame {
+        uint32_t pending_sends;
+        std::vector<ReleaseCallback> callbacks;
+        std::chrono::steady_clock::time_point submit_time;
+    } InFlightFrame;
+    typedef struct PacedFrame {
+        void *buffer;
+        FrameHeader header;
+        uint32_t chunk_size;
+        std::vector<std::string> connection_ids;
+        std::shared_ptr<std::vector<uint8_t>> message; // in-band control message (sent unpaced) instead of a frame
+    } PacedFrame;
 
     int _rank;
     int _num_ranks;
@@ -35,7 +101,8 @@ private:
     Endian _endianness;
     StreamBehavior _stream_behavior;
     uint32_t _num_connections;
-    uint8_t _connect_header[16];
+    std::shared_ptr<std::vector<uint8_t>> _connect_header; // replaced (never modified) on re-tiling
+    std::vector<uint8_t> _server_info;
     NetSocket::Server *_server;
 
     uint32_t _global_width;
@@ -44,18 +111,94 @@ private:
     uint32_t _local_height;
     uint32_t _local_offset_x;
     uint32_t _local_offset_y;
+    std::vector<ImageRegion> _regions;     // packed back to back in each frame, in the order added
     PixelFormat _px_format;
     PixelDataType _px_data_type;
     void *_pixels;
     uint32_t _pixel_size;
+    std::vector<Channel> _channels;   // auxiliary channels 1..n (channel 0 is the primary image)
 
     std::map<std::string, Connection> _connections;
 
+    std::thread _event_thread;
+    std::mutex _event_mutex;
+    std::condition_variable _release_condition;
+    std::map<void*, InFlightFrame> _in_flight_frames;
+    std::deque<void*> _released_frames;
+    int _release_fd[2];
+    std::deque<ClientMessage> _messages;
+    int _message_fd[2];
+    bool _finalizing;
+    bool _event_stop;
+    uint32_t _finished_count;
+
+    int _numa_node;
+    uint32_t _frame_pool_size;
+    uint32_t _frame_pool_slot_size;
+    std::vector<void*> _frame_pool;
+    std::deque<void*> _free_frames;
+
+    double _frame_interval;
+    uint64_t _bit_rate;
+    uint64_t _connection_bit_rate;
+    uint32_t _send_chunk_size;
+    TokenBucket _send_bucket;
+    std::chrono::steady_clock::time_point _next_frame_time;
+    std::thread _send_thread;
+    std::condition_variable _send_condition;
+    std::deque<PacedFrame> _send_queue;
+    bool _send_busy;
+    bool _send_done;
+
+    double _adaptive_interval;
+    int _adaptive_level;
+    uint32_t _degrade_count;
+    uint32_t _upgrade_count;
+    double _frame_latency;
+    std::vector<void*> _encode_pool;
+    std::deque<void*> _free_encode_buffers;
+
+    uint32_t _balance_interval;
+    double _render_time;
+
+    CompositeOperator _composite_op;
+    int _composite_vrank;          // rank among the power-of-two group that runs binary swap (-1 = folded)
+    int _composite_vranks;
+    std::vector<uint8_t> _composite_color;
+    std::vector<float> _composite_depth;
+    std::vector<uint8_t> _composite_recv_color;
+    std::vector<float> _composite_recv_depth;
+    MPI_Datatype _composite_row_type;       // one full-width row of color / depth - MPI counts are in rows, so
+    MPI_Datatype _composite_depth_row_type; // images beyond 2 GB do not overflow int counts
+
+    uint64_t _frame_id;
+    bool _frame_checksums;
+    Recorder *_recorder;
+
     void GetIpAddress(const char *iface, uint8_t ip_address[4]);
     bool HandleNewConnection(NetSocket::Server::Event& event);
+    void EventLoop();
+    void StopEventThread();
+    void StopSendThread(bool drain);
+    void CompleteSend(Connection& connection, void *data, std::unique_lock<std::mutex>& lock);
+    void ReleaseFrame(void *buffer, std::unique_lock<std::mutex>& lock);
+    void SendFrame(void *buffer, uint8_t channel, PixelFormat format, PixelDataType type, uint32_t payload_size, ReleaseCallback release_callback);
+    void UpdateAdaptiveLevel();
+    void* AcquireEncodeBuffer();
+    void RecordingFinished(const void *buffer);
+    void BuildConnectHeader();
+    void RebalanceTiles();
+    void SetupCompositing();
+    int CompositeActualRank(int vrank);
+    void CompositeStrip(int vrank, uint32_t *row, uint32_t *rows);
+    void CompositeRows(const void *color, const float *depth, uint32_t row, uint32_t rows, bool received_in_front);
+    bool PacingEnabled();
+    void SendLoop();
+    void InitTokenBucket(TokenBucket& bucket, uint64_t bits_per_second);
+    void AcquireTokens(TokenBucket& bucket, uint64_t bytes);
 
 public:
-    Server(const char *iface, uint16_t port_min, uint16_t port_max, MPI_Comm comm);
+    Server(const char *iface, uint16_t port_min, uint16_t port_max, MPI_Comm comm, TransportProfile profile = TransportProfile::Default);
     ~Server();
 
     void GetMasterIpAddress(char *addr);
@@ -65,8 +208,36 @@ public:
     void SetGlobalImageSize(uint32_t width, uint32_t height);
     void SetLocalImageSize(uint32_t width, uint32_t height);
     void SetLocalImageOffset(uint32_t x, uint32_t y);
+    void AddLocalImageRegion(uint32_t width, uint32_t height, uint32_t x, uint32_t y, int32_t priority);
+    void GetLocalImageSize(uint32_t *width, uint32_t *height);
+    void GetLocalImageOffset(uint32_t *x, uint32_t *y);
     void SetFrameImage(void *data);
+    int AddChannel(const char *name, PixelFormat format, PixelDataType type);
+    int GetChannelCount();
+    void SetChannelImage(int channel, void *data);
+    void SetFrameRateLimit(double fps);
+    void SetBitRateLimit(uint64_t bits_per_second);
+    void SetConnectionBitRateLimit(uint64_t bits_per_second);
+    void SetSendChunkSize(uint32_t bytes);
+    void SetAdaptiveFormat(double target_fps);
+    void SetFrameChecksums(bool enable);
+    void SetCompositing(CompositeOperator op);
+    void SetLoadBalancing(uint32_t interval_frames);
+    void SetFrameRenderTime(double seconds);
+    bool StartRecording(const char *filename);
+    void StopRecording();
     void Write();
+    void SubmitFrame(void *buffer, ReleaseCallback release_callback);
+    void SubmitFrame(void *buffer, uint32_t size, PixelFormat format, PixelDataType type, ReleaseCallback release_callback);
+    void SubmitChannelFrame(int channel, void *buffer, ReleaseCallback release_callback);
+    int GetReleaseFd();
+    bool GetReleasedFrame(void **buffer);
+    int GetMessageFd();
+    uint32_t PollMessages(std::vector<ClientMessage>& messages);
+    void SetFramePoolSize(uint32_t count);
+    void* AcquireFrame();
+    void SubmitFrame(void *frame);
+    void CompositeFrame(const void *color, const float *depth);
     void AdvanceToNextFrame();
     void Finalize();
 };
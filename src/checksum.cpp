@@ -0,0 +1,235 @@
+#include <cstring>
+#include "pxstream.h"
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define PXSTREAM_X86_SIMD
+#endif
+
+// 64-bit non-cryptographic hash for integrity checks (xxh3-style accumulate/scramble)
+//  - 8 x 64-bit lanes per 64-byte stripe: acc[i] += data[i ^ 1] + lo32(data[i] ^ key[i]) * hi32(data[i] ^ key[i])
+//  - lane keys advance every stripe and accumulators are scrambled every 1 KiB block, so moving
+//    data to a different position changes the hash
+//  - scalar, SSE2 and AVX2 kernels compute identical results (data read as little endian)
+
+#define CHECKSUM_LANES 8
+#define CHECKSUM_STRIPE_SIZE 64
+#define CHECKSUM_BLOCK_STRIPES 16
+#define CHECKSUM_BLOCK_SIZE (CHECKSUM_STRIPE_SIZE * CHECKSUM_BLOCK_STRIPES)
+#define CHECKSUM_PRIME32 0x9E3779B1ULL
+#define CHECKSUM_PRIME64 0x9E3779B185EBCA87ULL
+#define CHECKSUM_KEY_STEP 0x165667B19E3779F9ULL
+
+static const uint64_t checksum_keys[CHECKSUM_LANES] = {
+    0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL,
+    0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL, 0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL
+};
+
+static inline uint64_t LoadLittleEndian64(const uint8_t *bytes)
+{
+    uint64_t value = 0;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    memcpy(&value, bytes, 8);
+#else
+    int i;
+    for (i = 7; i >= 0; i--)
+    {
+        value = (value << 8) | bytes[i];
+    }
+#endif
+    return value;
+}
+
+static inline uint64_t Avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void AccumulateStripesScalar(uint64_t acc[CHECKSUM_LANES], const uint8_t *data, uint32_t num_stripes)
+{
+    uint32_t s;
+    int i;
+    uint64_t lane[CHECKSUM_LANES];
+    for (s = 0; s < num_stripes; s++)
+    {
+        for (i = 0; i < CHECKSUM_LANES; i++)
+        {
+            lane[i] = LoadLittleEndian64(data + s * CHECKSUM_STRIPE_SIZE + i * 8);
+        }
+        for (i = 0; i < CHECKSUM_LANES; i++)
+        {
+            uint64_t key = checksum_keys[i] + s * CHECKSUM_KEY_STEP;
+            uint64_t data_key = lane[i] ^ key;
+            acc[i] += lane[i ^ 1] + (data_key & 0xFFFFFFFFULL) * (data_key >> 32);
+        }
+    }
+}
+
+#if !defined(PXSTREAM_X86_SIMD) || __BYTE_ORDER != __LITTLE_ENDIAN
+// whole-block kernel for hosts without the SIMD kernels (the scalar stripe accumulation also finishes the tail)
+static void ScrambleScalar(uint64_t acc[CHECKSUM_LANES])
+{
+    int i;
+    for (i = 0; i < CHECKSUM_LANES; i++)
+    {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= checksum_keys[i];
+        acc[i] *= CHECKSUM_PRIME32;
+    }
+}
+
+static void ProcessBlocksScalar(uint64_t acc[CHECKSUM_LANES], const uint8_t *data, uint64_t num_blocks)
+{
+    uint64_t b;
+    for (b = 0; b < num_blocks; b++)
+    {
+        AccumulateStripesScalar(acc, data + b * CHECKSUM_BLOCK_SIZE, CHECKSUM_BLOCK_STRIPES);
+        ScrambleScalar(acc);
+    }
+}
+#endif
+
+#ifdef PXSTREAM_X86_SIMD
+static void ProcessBlocksSse2(uint64_t acc[CHECKSUM_LANES], const uint8_t *data, uint64_t num_blocks)
+{
+    __m128i vacc[4], vkey_base[4];
+    __m128i step = _mm_set1_epi64x((long long)CHECKSUM_KEY_STEP);
+    __m128i prime = _mm_set1_epi32((int)CHECKSUM_PRIME32);
+    int j;
+    for (j = 0; j < 4; j++)
+    {
+        vacc[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + j * 2));
+        vkey_base[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(checksum_keys + j * 2));
+    }
+    uint64_t b;
+    uint32_t s;
+    for (b = 0; b < num_blocks; b++)
+    {
+        const uint8_t *block = data + b * CHECKSUM_BLOCK_SIZE;
+        __m128i vkey[4] = {vkey_base[0], vkey_base[1], vkey_base[2], vkey_base[3]};
+        for (s = 0; s < CHECKSUM_BLOCK_STRIPES; s++)
+        {
+            for (j = 0; j < 4; j++)
+            {
+                __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + s * CHECKSUM_STRIPE_SIZE + j * 16));
+                __m128i dk = _mm_xor_si128(d, vkey[j]);
+                __m128i product = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+                __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+                vacc[j] = _mm_add_epi64(vacc[j], _mm_add_epi64(swapped, product));
+                vkey[j] = _mm_add_epi64(vkey[j], step);
+            }
+        }
+        for (j = 0; j < 4; j++)
+        {
+            __m128i a = _mm_xor_si128(vacc[j], _mm_srli_epi64(vacc[j], 47));
+            a = _mm_xor_si128(a, vkey_base[j]);
+            __m128i lo = _mm_mul_epu32(a, prime);
+            __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+            vacc[j] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+        }
+    }
+    for (j = 0; j < 4; j++)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + j * 2), vacc[j]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void ProcessBlocksAvx2(uint64_t acc[CHECKSUM_LANES], const uint8_t *data, uint64_t num_blocks)
+{
+    __m256i vacc[2], vkey_base[2];
+    __m256i step = _mm256_set1_epi64x((long long)CHECKSUM_KEY_STEP);
+    __m256i prime = _mm256_set1_epi32((int)CHECKSUM_PRIME32);
+    int j;
+    for (j = 0; j < 2; j++)
+    {
+        vacc[j] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + j * 4));
+        vkey_base[j] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(checksum_keys + j * 4));
+    }
+    uint64_t b;
+    uint32_t s;
+    for (b = 0; b < num_blocks; b++)
+    {
+        const uint8_t *block = data + b * CHECKSUM_BLOCK_SIZE;
+        __m256i vkey[2] = {vkey_base[0], vkey_base[1]};
+        for (s = 0; s < CHECKSUM_BLOCK_STRIPES; s++)
+        {
+            for (j = 0; j < 2; j++)
+            {
+                __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + s * CHECKSUM_STRIPE_SIZE + j * 32));
+                __m256i dk = _mm256_xor_si256(d, vkey[j]);
+                __m256i product = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+                __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+                vacc[j] = _mm256_add_epi64(vacc[j], _mm256_add_epi64(swapped, product));
+                vkey[j] = _mm256_add_epi64(vkey[j], step);
+            }
+        }
+        for (j = 0; j < 2; j++)
+        {
+            __m256i a = _mm256_xor_si256(vacc[j], _mm256_srli_epi64(vacc[j], 47));
+            a = _mm256_xor_si256(a, vkey_base[j]);
+            __m256i lo = _mm256_mul_epu32(a, prime);
+            __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+            vacc[j] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+        }
+    }
+    for (j = 0; j < 2; j++)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + j * 4), vacc[j]);
+    }
+}
+#endif
+
+typedef void (*ProcessBlocksKernel)(uint64_t acc[CHECKSUM_LANES], const uint8_t *data, uint64_t num_blocks);
+
+static ProcessBlocksKernel SelectKernel()
+{
+#if defined(PXSTREAM_X86_SIMD) && __BYTE_ORDER == __LITTLE_ENDIAN
+    // SIMD kernels load lanes in host byte order - only valid on little endian hosts
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return ProcessBlocksAvx2;
+    }
+    return ProcessBlocksSse2;
+#else
+    return ProcessBlocksScalar;
+#endif
+}
+
+uint64_t PxStream::ComputeChecksum(const void *data, uint64_t size)
+{
+    static ProcessBlocksKernel process_blocks = SelectKernel();
+
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(data);
+    uint64_t acc[CHECKSUM_LANES];
+    memcpy(acc, checksum_keys, sizeof(acc));
+
+    uint64_t num_blocks = size / CHECKSUM_BLOCK_SIZE;
+    process_blocks(acc, bytes, num_blocks);
+
+    // remaining whole stripes, then the zero padded final stripe
+    uint64_t offset = num_blocks * CHECKSUM_BLOCK_SIZE;
+    uint32_t num_stripes = (uint32_t)((size - offset) / CHECKSUM_STRIPE_SIZE);
+    AccumulateStripesScalar(acc, bytes + offset, num_stripes);
+    offset += num_stripes * CHECKSUM_STRIPE_SIZE;
+    if (offset < size)
+    {
+        uint8_t last[CHECKSUM_STRIPE_SIZE];
+        memset(last, 0, CHECKSUM_STRIPE_SIZE);
+        memcpy(last, bytes + offset, size - offset);
+        AccumulateStripesScalar(acc, last, 1);
+    }
+
+    uint64_t h = size * CHECKSUM_PRIME64;
+    int i;
+    for (i = 0; i < CHECKSUM_LANES; i++)
+    {
+        h = (h ^ Avalanche(acc[i] ^ checksum_keys[i])) * CHECKSUM_PRIME64;
+    }
+    return Avalanche(h);
+}
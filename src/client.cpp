@@ -1,8 +1,25 @@
 #include "pxstream/client.h"
 
 PxStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm) :
+    Client(host, port, comm, std::vector<std::string>())
+{
+}
+
+PxStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm, const std::vector<std::string>& channels, uint32_t frame_credits,
+                         TransportProfile profile) :
     _finished(0),
-    _back_buffer(0)
+    _num_subscribed(0),
+    _frame_credits(frame_credits),
+    _numa_node(-1),
+    _back_buffer(0),
+    _verify_checksums(false),
+    _frame_id(0),
+    _frame_latency(0.0),
+    _frame_valid(true),
+    _checksum_errors(0),
+    _selection_valid(true),
+    _redistribution_errors(0),
+    _regions_overlap(false)
 {
     MPI_Comm_dup(comm, &_comm);
     int rc = MPI_Comm_rank(_comm, &_rank);
@@ -33,84 +50,159 @@ PxStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm) :
     NetSocket::ClientOptions options = NetSocket::CreateClientOptions();
     options.secure = false;
     options.flags = NetSocket::GeneralFlags::TcpNoDelay;
-    //options.send_buf_size =  262144;
-    //options.recv_buf_size = 2097152;//16777216;
-    uint8_t *remote_ip_addresses;
-    uint16_t *remote_ports;
+    bool busy_poll = false;
+    switch (profile)
+    {
+        case TransportProfile::LowLatency:
+            // readers never back off, and (unless credits were given) the server stays at most one frame ahead
+            busy_poll = true;
+            _frame_credits = (_frame_credits == 0) ? 1 : _frame_credits;
+            break;
+        default:
+            break;
+    }
+    std::vector<NetSocket::Client::Event> events;
+    std::vector<uint8_t> server_info;
+
+    // Receive buffers are sized to the bandwidth-delay product, set on every socket before it connects (so the
+    // TCP window scale matches). The probe runs on rank 0's first connection, which is then replaced by one opened
+    // with the measured size - all server ranks are assumed to sit behind alike links, so that one measurement
+    // sizes every connection (PXSTREAM_RECV_BUFFER=<bytes> skips the probe, 0 leaves sizing to the OS)
+    int32_t recv_buffer = 0;
     if (_rank == 0)
     {
-        Connection conn = {new NetSocket::Client(host, port, options), 0, 0, 0, 0};
+        const char *env = getenv("PXSTREAM_RECV_BUFFER");
+        if (env != NULL)
+        {
+            recv_buffer = atoi(env);
+            options.recv_buf_size = recv_buffer;
+        }
+        Connection conn = {new NetSocket::Client(host, port, options), std::make_shared<std::mutex>(), 0};
         _connections.push_back(conn);
-        int server_info_count = 0;
-        PxStream::Endian remote_endianness;
-        while (server_info_count < 7)
+        AwaitConnectionEvents(0, 1, NetSocket::Client::EventType::ReceiveBinary, &events, "server info");
+        if (events[0].data_length < PXSTREAM_SERVER_INFO_HEADER_SIZE)
+        {
+            fprintf(stderr, "PxStream::Client> Error: server info message too short (%u bytes)\n", events[0].data_length);
+            MPI_Abort(_comm, 1);
+        }
+        server_info.assign((uint8_t*)events[0].binary_data, (uint8_t*)events[0].binary_data + events[0].data_length);
+        delete[] reinterpret_cast<uint8_t*>(events[0].binary_data);
+        if (env == NULL)
         {
-            NetSocket::Client::Event event = conn.client->WaitForNextEvent();
-            switch (event.type)
+            double rtt, bandwidth;
+            double bdp = ProbeLink(&rtt, &bandwidth);
+            recv_buffer = (int32_t)std::min(std::max(bdp, (double)PXSTREAM_MIN_SOCKET_BUFFER), (double)PXSTREAM_MAX_SOCKET_BUFFER);
+            if (profile == TransportProfile::HighThroughput)
             {
-                case NetSocket::Client::EventType::ReceiveBinary:
-                    switch (server_info_count)
-                    {
-                        case 0: // endianness
-                            remote_endianness = (PxStream::Endian)(*((uint8_t*)event.binary_data));
-                            if (remote_endianness != _endianness)
-                            {
-                                fprintf(stderr, "PxStream::Client> Warning: remote machine's endianness does not match\n");
-                            }
-                            delete[] reinterpret_cast<uint8_t*>(event.binary_data);
-                            server_info_count++;
-                            break;
-                        case 1: // ip addresses
-                            _num_remote_ranks = event.data_length / 4;
-                            remote_ip_addresses = (uint8_t*)event.binary_data;
-                            server_info_count++;
-                            break;
-                        case 2: // ports
-                            remote_ports = (uint16_t*)event.binary_data;
-                            for (i = 0; i<_num_remote_ranks; i++)
-                            {
-                                remote_ports[i] = ntohs(remote_ports[i]);
-                            }
-                            server_info_count++;
-                            break;
-                        case 3: // global image width
-                            _global_width = ntohl(*((uint32_t*)event.binary_data));
-                            server_info_count++;
-                            break;
-                        case 4: // global image height
-                            _global_height = ntohl(*((uint32_t*)event.binary_data));
-                            server_info_count++;
-                            break;
-                        case 5: // image format
-                            _px_format = (PixelFormat)(*((uint8_t*)event.binary_data));
-                            server_info_count++;
-                            break;
-                        case 6: // image data type
-                            _px_data_type = (PixelDataType)(*((uint8_t*)event.binary_data));
-                            server_info_count++;
-                            break;
-                    }
-                    break;
-                default:
-                    break;
+                recv_buffer = std::max(recv_buffer, PXSTREAM_HIGH_THROUGHPUT_SOCKET_BUFFER);
             }
+            printf("PxStream::Client> link probe: rtt %.3lf ms, %.1lf Mbit/s - receive buffers %d bytes\n", rtt * 1000.0,
+                   bandwidth * 8.0e-6, recv_buffer);
+            options.recv_buf_size = recv_buffer;
+
+            // reconnect with the sized buffer (server rank 0 sends its info again, which is already known)
+            delete _connections[0].client;
+            _connections[0].client = new NetSocket::Client(host, port, options);
+            AwaitConnectionEvents(0, 1, NetSocket::Client::EventType::ReceiveBinary, NULL, "server info");
         }
-        printf("PxStream::Client> Global Image Size: %ux%u\n", _global_width, _global_height);
+    }
+    MPI_Bcast(&recv_buffer, 1, MPI_INT32_T, 0, _comm);
+    options.recv_buf_size = recv_buffer;
+
+    // Share server info (ip/port list and image info) with other ranks as a single packed message
+    uint32_t server_info_size = server_info.size();
+    MPI_Bcast(&server_info_size, 1, MPI_UINT32_T, 0, _comm);
+    server_info.resize(server_info_size);
+    MPI_Bcast(server_info.data(), server_info_size, MPI_UINT8_T, 0, _comm);
+    uint32_t net_value;
+    PxStream::Endian remote_endianness = (PxStream::Endian)server_info[0];
+    int num_channels = server_info[3];
+    memcpy(&net_value, server_info.data() + 4, 4);
+    _global_width = ntohl(net_value);
+    memcpy(&net_value, server_info.data() + 8, 4);
+    _global_height = ntohl(net_value);
+    memcpy(&net_value, server_info.data() + 12, 4);
+    _num_remote_ranks = ntohl(net_value);
+    if (server_info_size < PXSTREAM_SERVER_INFO_HEADER_SIZE + 6 * _num_remote_ranks)
+    {
+        fprintf(stderr, "PxStream::Client> Error: server info size does not match server rank count\n");
+        MPI_Abort(_comm, 1);
+    }
+
+    // channel table: format, data type, name length, name (channel 0 is the primary image)
+    uint32_t pos = PXSTREAM_SERVER_INFO_HEADER_SIZE + 6 * _num_remote_ranks;
+    for (i = 0; i < num_channels; i++)
+    {
+        if (pos + 3 > server_info_size || pos + 3 + server_info[pos + 2] > server_info_size)
+        {
+            fprintf(stderr, "PxStream::Client> Error: server info channel table is truncated\n");
+            MPI_Abort(_comm, 1);
+        }
+        Channel channel;
+        channel.format = (PixelFormat)server_info[pos];
+        channel.data_type = (PixelDataType)server_info[pos + 1];
+        channel.name.assign((const char*)server_info.data() + pos + 3, server_info[pos + 2]);
+        channel.subscribed = false;
+        channel.pixel_list[0] = NULL;
+        channel.pixel_list[1] = NULL;
+        channel.buffer_size = 0;
+        _channels.push_back(channel);
+        pos += 3 + server_info[pos + 2];
+    }
+    if (_channels.empty())
+    {
+        fprintf(stderr, "PxStream::Client> Error: server does not publish any channels\n");
+        MPI_Abort(_comm, 1);
     }
 
-    // Share ip/port and image info with other ranks
-    MPI_Bcast(&_num_remote_ranks, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    if (_rank != 0)
+    // subscribe by name - only the primary image when no channels are requested
+    uint32_t subscription = channels.empty() ? 1 : 0;
+    for (auto& name : channels)
+    {
+        int idx = GetChannelIndex(name.c_str());
+        if (idx < 0)
+        {
+            if (_rank == 0)
+            {
+                fprintf(stderr, "PxStream::Client> Warning: server does not publish channel '%s'\n", name.c_str());
+            }
+            continue;
+        }
+        subscription |= 1u << idx;
+    }
+    for (i = 0; i < _channels.size(); i++)
+    {
+        _channels[i].subscribed = (subscription & (1u << i)) != 0;
+        _num_subscribed += _channels[i].subscribed ? 1 : 0;
+    }
+    uint8_t *remote_ip_addresses = server_info.data() + PXSTREAM_SERVER_INFO_HEADER_SIZE;
+    uint16_t *remote_ports = new uint16_t[_num_remote_ranks];
+    memcpy(remote_ports, server_info.data() + PXSTREAM_SERVER_INFO_HEADER_SIZE + 4 * _num_remote_ranks, 2 * _num_remote_ranks);
+    for (i = 0; i < _num_remote_ranks; i++)
     {
-        remote_ip_addresses = new uint8_t[4 * _num_remote_ranks];
-        remote_ports = new uint16_t[_num_remote_ranks];
+        remote_ports[i] = ntohs(remote_ports[i]);
+    }
+    if (_rank == 0)
+    {
+        if (remote_endianness != _endianness)
+        {
+            fprintf(stderr, "PxStream::Client> Warning: remote machine's endianness does not match\n");
+        }
+        printf("PxStream::Client> Global Image Size: %ux%u\n", _global_width, _global_height);
+    }
+    // compressed images are decoded on arrival, so those channels are presented as RGBA
+    for (auto& channel : _channels)
+    {
+        if (channel.format == PixelFormat::EncodedImage)
+        {
+            if (_rank == 0 && channel.subscribed && !PxStream::GetImageDecoder())
+            {
+                fprintf(stderr, "PxStream::Client> Warning: server sends encoded images but no image decoder is set\n");
+            }
+            channel.format = PixelFormat::RGBA;
+            channel.data_type = PixelDataType::Uint8;
+        }
     }
-    MPI_Bcast(remote_ip_addresses, 4 * _num_remote_ranks, MPI_UINT8_T, 0, MPI_COMM_WORLD);
-    MPI_Bcast(remote_ports, _num_remote_ranks, MPI_UINT16_T, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&_global_width, 1, MPI_UINT32_T, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&_global_height, 1, MPI_UINT32_T, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&_px_format, 1, MPI_UINT8_T, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&_px_data_type, 1, MPI_UINT8_T, 0, MPI_COMM_WORLD);
 
     // Determine which ranks connect to which
     int connections_per_rank = _num_remote_ranks / _num_ranks;
@@ -118,34 +210,37 @@ PxStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm) :
     int num_connections = connections_per_rank + (_rank < connections_extra ? 1 : 0);
     int connection_offset = _rank * connections_per_rank + std::min(_rank, connections_extra);
 
-    // Make connections
-    NetSocket::Client::Event event;
+    // Make connections - every connect is started up front and they complete concurrently
+    int first_new = _connections.size();
     for (i = std::max(connection_offset, 1); i < connection_offset + num_connections; i++)
     {
         struct in_addr addr = {*((in_addr_t*)(&(remote_ip_addresses[4*i])))};
-        Connection conn = {new NetSocket::Client(inet_ntoa(addr), remote_ports[i], options), 0, 0, 0, 0, NULL, 0};
-        do
-        {
-            event = conn.client->WaitForNextEvent();
-            if (event.type == NetSocket::Client::EventType::ReceiveBinary)
-            {
-                delete[] reinterpret_cast<uint8_t*>(event.binary_data);
-            }
-        } while (event.type != NetSocket::Client::EventType::Connect);
+        Connection conn = {new NetSocket::Client(inet_ntoa(addr), remote_ports[i], options), std::make_shared<std::mutex>(), (uint32_t)i};
         _connections.push_back(conn);
     }
+    AwaitConnectionEvents(first_new, _connections.size() - first_new, NetSocket::Client::EventType::Connect, NULL, "connect");
+    delete[] remote_ports;
 
-    // Create threads for handling reads
-    _begin_read = new uint8_t[_connections.size()];
-    memset(_begin_read, 0, _connections.size());
-    _read_threads = new std::thread[_connections.size()];
+    // Connections are read by the process-wide reader pool (shared with any other streams) - readers and
+    // receive buffers go on the NUMA node of the NIC the connections arrive on
+    if (_connections.size() > 0)
+    {
+        _numa_node = PxStream::GetAddressNumaNode(_connections[0].client->LocalIpAddress().c_str());
+    }
+    _reader_pool = PxStream::ReaderPool::GetInstance(_numa_node);
+    printf("PxStream::Client> [rank %d] %u %s\n", _rank, _reader_pool->GetThreadCount(),
+           PxStream::DescribeThreadAffinity(PxStream::ThreadRole::ReaderThreads, _reader_pool->GetNumaNode()).c_str());
     for (i = 0; i < _connections.size(); i++)
     {
-        _read_threads[i] = std::thread(&PxStream::Client::ConnectionRead, this, i);
+        _connections[i].reader_id = _reader_pool->Register(_connections[i].client, [this, i](NetSocket::Client::Event& event) {
+            return HandleReadEvent(i, event);
+        }, [this]() {
+            ReadFinished();
+        }, busy_poll);
     }
 
-    // Create and send handshake, and receive connection header (image dims, pixel format, ...)
-    uint8_t handshake[13];
+    // Create and send handshake (with channel subscription and frame credits), and receive connection header (image dims, ...)
+    uint8_t handshake[21];
     if (_rank == 0)
     {
         struct in_addr ip;
@@ -155,70 +250,227 @@ PxStream::Client::Client(const char *host, uint16_t port, MPI_Comm comm) :
         memcpy(handshake, &nrr, 4);
         memcpy(handshake + 4, &cid, 8);
     }
-    MPI_Bcast(handshake, 13, MPI_UINT8_T, 0, MPI_COMM_WORLD);
+    MPI_Bcast(handshake, 13, MPI_UINT8_T, 0, _comm);
     handshake[12] = _endianness;
-    uint64_t total_pixel_size = 0;
+    uint32_t net_subscription = htonl(subscription);
+    memcpy(handshake + 13, &net_subscription, 4);
+    uint32_t net_credits = htonl(_frame_credits);
+    memcpy(handshake + 17, &net_credits, 4);
     for (i = 0; i < num_connections; i++)
     {
-        _connections[i].client->Send(handshake, 13, NetSocket::CopyMode::MemCopy);
-        do
-        {
-            event = _connections[i].client->WaitForNextEvent();
-        } while (event.type != NetSocket::Client::EventType::ReceiveBinary);
-        uint32_t *header = reinterpret_cast<uint32_t*>(event.binary_data);
-        _connections[i].local_width = header[0];
-        _connections[i].local_height = header[1];
-        _connections[i].local_offset_x = header[2];
-        _connections[i].local_offset_y = header[3];
-        _connections[i].pixel_size = (uint32_t)(_connections[i].local_width * _connections[i].local_height * (double)PxStream::GetBitsPerPixel(_px_format, _px_data_type) / 8.0);
-        total_pixel_size += _connections[i].pixel_size;
-        delete[] reinterpret_cast<uint8_t*>(event.binary_data);
-        printf("PxStream::Client> [rank %d] connected (%ux%u +%u+%u)\n", _rank, _connections[i].local_width, _connections[i].local_height, _connections[i].local_offset_x, _connections[i].local_offset_y);
+        SendToServer(_connections[i], handshake, 21);
     }
-    _connection_pixel_list[0] = new uint8_t[total_pixel_size];
-    _connection_pixel_list[1] = new uint8_t[total_pixel_size];
-    uint64_t pixel_list_offset = 0;
+    AwaitConnectionEvents(0, num_connections, NetSocket::Client::EventType::ReceiveBinary, &events, "handshake");
     for (i = 0; i < num_connections; i++)
     {
-        _connections[i].pixels = (void*)(_connection_pixel_list[_back_buffer] + pixel_list_offset);
-        pixel_list_offset += _connections[i].pixel_size;
+        // connection header: region count, then width, height, offset x, offset y, priority per region
+        NetSocket::Client::Event& event = events[i];
+        if (!ParseRegions(reinterpret_cast<uint8_t*>(event.binary_data), event.data_length, _connections[i].regions))
+        {
+            fprintf(stderr, "PxStream::Client> Error: [rank %d] malformed connection header (%u bytes)\n", _rank, event.data_length);
+            MPI_Abort(_comm, 1);
+        }
+        for (auto& region : _connections[i].regions)
+        {
+            printf("PxStream::Client> [rank %d] connected (%dx%d +%d+%d, priority %d)\n", _rank, region.width, region.height, region.offset_x, region.offset_y, region.priority);
+        }
+        uint32_t num_regions = _connections[i].regions.size();
+        _connections[i].frame_format = _channels[0].format;
+        _connections[i].frame_data_type = _channels[0].data_type;
+        _connections[i].frame_id = 0;
+        _connections[i].frame_timestamp = 0;
+        _connections[i].receive_time = 0;
+        _connections[i].has_checksum = false;
+        _connections[i].checksum_valid = true;
+        _connections[i].layout_received = false;
+        _connections[i].server_finished = false;
+        delete[] reinterpret_cast<uint8_t*>(event.binary_data);
+        if (num_regions > 1 && _channels[0].subscribed && server_info[PXSTREAM_SERVER_INFO_HEADER_SIZE + 6 * _num_remote_ranks] == PixelFormat::EncodedImage)
+        {
+            fprintf(stderr, "PxStream::Client> Warning: [rank %d] encoded images are decoded as a single region\n", _rank);
+        }
+    }
+    ResolveRegionVisibility();
+    for (auto& channel : _channels)
+    {
+        if (channel.subscribed)
+        {
+            channel.buffer_size = ConnectionBufferOffset(_connections.size(), channel.format, channel.data_type);
+            AllocateChannelBuffers(channel);
+        }
     }
 
     // start async read of first frame
-    std::unique_lock<std::mutex> lock(_read_mutex);
-    _read_finished_count = 0;
-    memset(_begin_read, 1, _connections.size());
-    lock.unlock();
-    _read_condition.notify_all();
+    StartRead();
 }
 
 PxStream::Client::~Client()
 {
     //TODO: disconnect client
+    int i;
+    for (i = 0; i < _connections.size(); i++)
+    {
+        _reader_pool->Unregister(_connections[i].reader_id);
+    }
+    for (auto& channel : _channels)
+    {
+        PxStream::FreePixelBuffer(channel.pixel_list[0], channel.buffer_size);
+        PxStream::FreePixelBuffer(channel.pixel_list[1], channel.buffer_size);
+    }
 }
 
 void PxStream::Client::Read()
 {
     std::unique_lock<std::mutex> lock(_read_mutex);
-    while (_read_finished_count < _connections.size())
+    uint8_t frame_format[3];
+    while (true)
+    {
+        while (_read_finished_count < _connections.size())
+        {
+            _finished_condition.wait(lock);
+        }
+
+        // format may change at any frame boundary - all ranks agree on format of the completed frame.
+        // A new tile layout arrives on every connection between two frames, in place of a frame
+        uint8_t local_format[3] = {0, 0, 0};
+        if (_connections.size() > 0)
+        {
+            local_format[0] = _connections[0].frame_format;
+            local_format[1] = _connections[0].frame_data_type;
+        }
+        for (auto& conn : _connections)
+        {
+            local_format[2] |= conn.layout_received ? 1 : 0;
+        }
+        MPI_Allreduce(local_format, frame_format, 3, MPI_UINT8_T, MPI_MAX, _comm);
+        if (frame_format[2] == 0)
+        {
+            break;
+        }
+        lock.unlock();
+        ApplyLayout();
+        StartRead();
+        lock.lock();
+    }
+    _channels[0].format = (PixelFormat)frame_format[0];
+    _channels[0].data_type = (PixelDataType)frame_format[1];
+
+    // per-frame stats are captured before the readers start overwriting them with the next frame
+    _frame_latency = 0.0;
+    _frame_valid = true;
+    int i;
+    for (i = 0; i < _connections.size(); i++)
     {
-        _finished_condition.wait(lock);
+        if (i == 0) _frame_id = _connections[i].frame_id;
+        double latency = (double)((int64_t)_connections[i].receive_time - (int64_t)_connections[i].frame_timestamp) / 1000000.0;
+        _frame_latency = std::max(_frame_latency, latency);
+        if (!_connections[i].checksum_valid)
+        {
+            _frame_valid = false;
+            _checksum_errors++;
+        }
     }
-    _read_finished_count = 0;
-    memset(_begin_read, 1, _connections.size());
 
     _back_buffer = 1 - _back_buffer;
-    uint64_t pixel_list_offset = 0;
+    lock.unlock();
+
+    // start async read of next frame
+    StartRead();
+}
+
+void PxStream::Client::StartRead()
+{
+    std::unique_lock<std::mutex> lock(_read_mutex);
+    _read_finished_count = 0;
     int i;
     for (i = 0; i < _connections.size(); i++)
     {
-        _connections[i].pixels = (void*)(_connection_pixel_list[_back_buffer] + pixel_list_offset);
-        pixel_list_offset += _connections[i].pixel_size;
+        _connections[i].header_received = false;
+        _connections[i].is_encoded = false;
+        _connections[i].channels_received = 0;
+        _connections[i].checksum_valid = true;
+        _connections[i].read_offset = 0;
+        _connections[i].layout_received = false;
     }
     lock.unlock();
+    for (i = 0; i < _connections.size(); i++)
+    {
+        _reader_pool->Activate(_connections[i].reader_id);
+    }
+}
 
-    // start async read of next frame
-    _read_condition.notify_all();
+void PxStream::Client::ReadFinished()
+{
+    std::unique_lock<std::mutex> lock(_read_mutex);
+    _read_finished_count++;
+    lock.unlock();
+    _finished_condition.notify_one();
+}
+
+void PxStream::Client::SetVerifyChecksums(bool verify)
+{
+    // only frames sent by a server with SetFrameChecksums(true) carry a checksum
+    _verify_checksums = verify;
+}
+
+uint32_t PxStream::Client::GetFrameId()
+{
+    return _frame_id;
+}
+
+double PxStream::Client::GetFrameLatency()
+{
+    // seconds from server submit to the last local tile arriving - assumes synchronized clocks
+    return _frame_latency;
+}
+
+bool PxStream::Client::FrameChecksumValid()
+{
+    return _frame_valid;
+}
+
+uint64_t PxStream::Client::GetChecksumErrorCount()
+{
+    return _checksum_errors;
+}
+
+bool PxStream::Client::SelectionChecksumValid()
+{
+    return _selection_valid;
+}
+
+uint64_t PxStream::Client::GetRedistributionErrorCount()
+{
+    return _redistribution_errors;
+}
+
+uint8_t* PxStream::Client::GetFrameTiles(int channel, uint64_t *size)
+{
+    // last frame read, as received: this rank's tiles packed in connection order - valid until the next Read()
+    *size = ConnectionBufferOffset(_connections.size(), _channels[channel].format, _channels[channel].data_type);
+    return _channels[channel].pixel_list[1 - _back_buffer];
+}
+
+bool PxStream::Client::TileLayoutMatches(Client *other)
+{
+    // true if `other` receives exactly the same tiles on this rank, so their received tiles line up pixel for pixel
+    if (other->_connections.size() != _connections.size())
+    {
+        return false;
+    }
+    int i;
+    for (i = 0; i < _connections.size(); i++)
+    {
+        const std::vector<Region>& a = _connections[i].regions;
+        const std::vector<Region>& b = other->_connections[i].regions;
+        if (a.size() != b.size() || !std::equal(a.begin(), a.end(), b.begin(), [](const Region& r, const Region& s) {
+                return r.width == s.width && r.height == s.height && r.offset_x == s.offset_x && r.offset_y == s.offset_y;
+            }))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
 bool PxStream::Client::ServerFinished()
@@ -232,21 +484,88 @@ void PxStream::Client::GetGlobalDimensions(uint32_t *width, uint32_t *height)
     *height = _global_height;
 }
 
+int PxStream::Client::GetServerRankCount()
+{
+    return _num_remote_ranks;
+}
+
 PxStream::PixelFormat PxStream::Client::GetPixelFormat()
 {
-    return _px_format;
+    return _channels[0].format;
 }
 
 PxStream::PixelDataType PxStream::Client::GetPixelDataType()
 {
-    return _px_data_type;
+    return _channels[0].data_type;
+}
+
+int PxStream::Client::GetChannelCount()
+{
+    return _channels.size();
+}
+
+int PxStream::Client::GetChannelIndex(const char *name)
+{
+    int i;
+    for (i = 0; i < _channels.size(); i++)
+    {
+        if (_channels[i].name == name)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char* PxStream::Client::GetChannelName(int channel)
+{
+    return _channels[channel].name.c_str();
+}
+
+PxStream::PixelFormat PxStream::Client::GetChannelPixelFormat(int channel)
+{
+    return _channels[channel].format;
+}
+
+PxStream::PixelDataType PxStream::Client::GetChannelPixelDataType(int channel)
+{
+    return _channels[channel].data_type;
+}
+
+bool PxStream::Client::ChannelSubscribed(int channel)
+{
+    return channel >= 0 && channel < _channels.size() && _channels[channel].subscribed;
 }
 
 DDR_DataDescriptor* PxStream::Client::CreateGlobalPixelSelection(int32_t *sizes, int32_t *offsets)
+{
+    return CreateGlobalPixelSelection(0, sizes, offsets);
+}
+
+DDR_DataDescriptor* PxStream::Client::CreateGlobalPixelSelection(int channel, int32_t *sizes, int32_t *offsets)
+{
+    if (!ChannelSubscribed(channel))
+    {
+        fprintf(stderr, "PxStream::Client> Error: selection requested for channel %d, which is not subscribed\n", channel);
+        MPI_Abort(_comm, 1);
+    }
+    PixelFormat format = _channels[channel].format;
+    PixelDataType data_type = _channels[channel].data_type;
+    DDR_DataDescriptor *desc = CreatePixelSelection(sizes, offsets, format, data_type);
+    // remember requested region so the mapping can be rebuilt if the stream's format changes
+    Selection& selection = _selections[desc];
+    selection.channel = channel;
+    memcpy(selection.sizes, sizes, 2 * sizeof(int32_t));
+    memcpy(selection.offsets, offsets, 2 * sizeof(int32_t));
+    selection.descriptors[(format << 8) | data_type] = desc;
+    return desc;
+}
+
+DDR_DataDescriptor* PxStream::Client::CreatePixelSelection(int32_t *sizes, int32_t *offsets, PixelFormat format, PixelDataType data_type)
 {
     int problem_type = DDR_DATA_TYPE_REGULAR_GRID_2D;
     MPI_Datatype type;
-    switch (_px_data_type)
+    switch (data_type)
     {
         case PixelDataType::Uint8:
             type = MPI_UINT8_T;
@@ -279,76 +598,121 @@ DDR_DataDescriptor* PxStream::Client::CreateGlobalPixelSelection(int32_t *sizes,
             type = MPI_DOUBLE;
             break;
     }
-    DDR_DataDescriptor *desc = DDR_NewDataDescriptor(_num_ranks, problem_type, type, PxStream::GetDataTypeSize(_px_data_type));
+    DDR_DataDescriptor *desc = DDR_NewDataDescriptor(_num_ranks, problem_type, type, PxStream::GetDataTypeSize(data_type));
 
+    // local tiles (every region of every connection) in DDR units, plus the parts of them this rank is
+    // responsible for sending - a region hidden in part by a higher priority region only sends the rest
+    SelectionLayout& layout = _layouts[desc];
+    layout.element_size = PxStream::GetDataTypeSize(data_type);
+    std::vector<int> dims_own;
+    std::vector<int> offsets_own;
+    int32_t tile[4];
+    int32_t chunk[4];
+    uint64_t tile_offset = 0;
     int i, j;
-    int chunks_own = _connections.size();
-    int *dims_own = new int[chunks_own * 2];
-    int *offsets_own = new int[chunks_own * 2];
-    int32_t bpp = PxStream::GetBitsPerPixel(_px_format, _px_data_type);
-    for (i = 0; i < _connections.size(); i++)
+    for (auto& conn : _connections)
     {
-        switch (_px_format)
-        {
-            case PixelFormat::RGBA:
-            case PixelFormat::RGB:
-            case PixelFormat::GrayScale:
-                dims_own[i * 2 + 0] = _connections[i].local_width * bpp / 8;
-                dims_own[i * 2 + 1] = _connections[i].local_height;
-                offsets_own[i * 2 + 0] = _connections[i].local_offset_x * bpp / 8;
-                offsets_own[i * 2 + 1] = _connections[i].local_offset_y;
-                break;
-            case PixelFormat::YUV444:
-                break;
-            case PixelFormat::YUV422:
-                break;
-            case PixelFormat::YUV420:
-                break;
-            case PixelFormat::DXT1:
-                dims_own[i * 2 + 0] = _connections[i].local_width * 2;
-                dims_own[i * 2 + 1] = _connections[i].local_height / 4;
-                offsets_own[i * 2 + 0] = _connections[i].local_offset_x * 2;
-                offsets_own[i * 2 + 1] = (_global_height - _connections[i].local_offset_y - _connections[i].local_height) / 4; //_connections[i].local_offset_y / 4;
-                break;
-        }
-        printf("[rank %d] own: offset = %d %d, dim = %d x %d\n", _rank, offsets_own[i * 2 + 0], offsets_own[i * 2 + 1], dims_own[i * 2 + 0], dims_own[i * 2 + 1]);
-    }
-    int32_t px_sizes[2];
-    int32_t px_offsets[2];
-    switch (_px_format)
-    {
-        case PixelFormat::RGBA:
-        case PixelFormat::RGB:
-        case PixelFormat::GrayScale:
-            px_sizes[0] = sizes[0] * bpp / 8;
-            px_sizes[1] = sizes[1];
-            px_offsets[0] = offsets[0] * bpp / 8;
-            px_offsets[1] =  offsets[1];
-            break;
-        case PixelFormat::YUV444:
-            break;
-        case PixelFormat::YUV422:
-            break;
-        case PixelFormat::YUV420:
-            break;
-        case PixelFormat::DXT1:
-            px_sizes[0] = sizes[0] * 2;
-            px_sizes[1] = sizes[1] / 4;
-            px_offsets[0] = offsets[0] * 2;
-            px_offsets[1] =  (_global_height - offsets[1] - sizes[1]) / 4; //offsets[1] / 4; ORIGIN = BOTTOM_LEFT
-            break;
+        for (auto& region : conn.regions)
+        {
+            int32_t px_tile[4] = {region.width, region.height, region.offset_x, region.offset_y};
+            PixelRectToElements(px_tile, format, data_type, tile);
+            dims_own.insert(dims_own.end(), {tile[0], tile[1]});
+            offsets_own.insert(offsets_own.end(), {tile[2], tile[3]});
+            printf("[rank %d] own: offset = %d %d, dim = %d x %d\n", _rank, tile[2], tile[3], tile[0], tile[1]);
+            for (j = 0; j < region.visible.size(); j += 4)
+            {
+                PixelRectToElements(region.visible.data() + j, format, data_type, chunk);
+                layout.own_chunks.insert(layout.own_chunks.end(), chunk, chunk + 4);
+                layout.own_sources.insert(layout.own_sources.end(), {(int64_t)tile_offset, tile[0], tile[1], tile[2], tile[3]});
+            }
+            tile_offset += (uint64_t)tile[0] * tile[1] * layout.element_size;
+        }
+    }
+    int32_t px_need[4] = {sizes[0], sizes[1], offsets[0], offsets[1]};
+    int32_t need[4];
+    PixelRectToElements(px_need, format, data_type, need);
+
+    printf("[rank %d] need: offset = %d %d, dim = %d x %d\n", _rank, need[2], need[3], need[0], need[1]);
+
+    // overlapping tiles would reach DDR from several owners, so those streams use their own plan instead
+    if (!_regions_overlap)
+    {
+        DDR_SetupDataMapping(_rank, _num_ranks, dims_own.size() / 2, dims_own.data(), offsets_own.data(), need, need + 2, desc);
     }
 
-    printf("[rank %d] need: offset = %d %d, dim = %d x %d\n", _rank, px_offsets[0], px_offsets[1], px_sizes[0], px_sizes[1]);
+    // every rank's visible tile parts and selection, so data can be redistributed and verified region by region
+    int own_count = layout.own_chunks.size();
+    std::vector<int> counts(_num_ranks);
+    std::vector<int> displacements(_num_ranks);
+    MPI_Allgather(&own_count, 1, MPI_INT, counts.data(), 1, MPI_INT, _comm);
+    int total_count = 0;
+    for (i = 0; i < _num_ranks; i++)
+    {
+        displacements[i] = total_count;
+        total_count += counts[i];
+    }
+    layout.all_chunks.resize(total_count);
+    MPI_Allgatherv(layout.own_chunks.data(), own_count, MPI_INT32_T, layout.all_chunks.data(), counts.data(), displacements.data(), MPI_INT32_T, _comm);
+    layout.needs.resize(_num_ranks * 4);
+    MPI_Allgather(need, 4, MPI_INT32_T, layout.needs.data(), 4, MPI_INT32_T, _comm);
 
-    DDR_SetupDataMapping(_rank, _num_ranks, chunks_own, dims_own, offsets_own, px_sizes, px_offsets, desc);
+    if (_regions_overlap)
+    {
+        CreateRedistributionPlan(desc, type, counts, displacements);
+    }
 
     return desc;
 }
 
 void PxStream::Client::FillSelection(DDR_DataDescriptor *selection, void *data)
 {
-    DDR_ReorganizeData(_num_ranks, _connection_pixel_list[1 - _back_buffer], data, selection);
+    DDR_DataDescriptor *desc = selection;
+    int channel = 0;
+    auto it = _selections.find(selection);
+    if (it != _selections.end())
+    {
+        channel = it->second.channel;
+        PixelFormat format = _channels[channel].format;
+        PixelDataType data_type = _channels[channel].data_type;
+        uint16_t key = (format << 8) | data_type;
+        auto format_desc = it->second.descriptors.find(key);
+        if (format_desc == it->second.descriptors.end())
+        {
+            desc = CreatePixelSelection(it->second.sizes, it->second.offsets, format, data_type);
+            it->second.descriptors[key] = desc;
+        }
+        else
+        {
+            desc = format_desc->second;
+        }
+    }
+    uint8_t *tiles = _channels[channel].pixel_list[1 - _back_buffer];
+    auto plan = _plans.find(desc);
+    if (plan != _plans.end())
+    {
+        // overlapping tiles - visible parts move straight from the tile buffer into the selection
+        std::vector<MPI_Request> requests;
+        requests.reserve(plan->second.sends.size() + plan->second.receives.size());
+        for (auto& transfer : plan->second.receives)
+        {
+            requests.push_back(MPI_REQUEST_NULL);
+            MPI_Irecv((uint8_t*)data + transfer.offset, 1, transfer.type, transfer.rank, 0, _comm, &requests.back());
+        }
+        for (auto& transfer : plan->second.sends)
+        {
+            requests.push_back(MPI_REQUEST_NULL);
+            MPI_Isend(tiles + transfer.offset, 1, transfer.type, transfer.rank, 0, _comm, &requests.back());
+        }
+        MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+    }
+    else
+    {
+        DDR_ReorganizeData(_num_ranks, tiles, data, desc);
+    }
+    if (_verify_checksums)
+    {
+        VerifySelection(desc, tiles, reinterpret_cast<const uint8_t*>(data));
+    }
     /*int i, j, idx;
     MPI_Request *send_requests = new MPI_Request[selection->maxSendChunks * _num_ranks];
     MPI_Request *recv_requests = new MPI_Request[selection->maxSendChunks * _num_ranks];
@@ -402,68 +766,671 @@ void PxStream::Client::FillSelection(DDR_DataDescriptor *selection, void *data)
     }*/
 }
 
+bool PxStream::Client::SendMessage(const void *data, uint32_t length, int server_rank)
+{
+    // small client -> server message (e.g. camera / mouse input), read with Server::PollMessages() on
+    // `server_rank` - goes out on this rank's own connection to that server rank. The client -> server
+    // direction carries no pixel data, so messages never queue behind frames in flight
+    for (auto& conn : _connections)
+    {
+        if (conn.server_rank == server_rank)
+        {
+            std::vector<uint8_t> message(1 + length);
+            message[0] = 0xFE;
+            memcpy(message.data() + 1, data, length);
+            SendToServer(conn, message.data(), message.size());
+            return true;
+        }
+    }
+    fprintf(stderr, "PxStream::Client> Warning: [rank %d] not connected to server rank %d\n", _rank, server_rank);
+    return false;
+}
+
 
 // Private
-void PxStream::Client::ConnectionRead(int connection_idx)
+void PxStream::Client::SendToServer(Connection& conn, const void *data, uint32_t length)
 {
-    std::unique_lock<std::mutex> lock(_read_mutex, std::defer_lock);
-    int read_count;
-    bool read_finished;
-    bool conn_finished = false;
-    uint8_t frame_received_flag = 255;
-    while (!conn_finished)
+    // sends on a connection are serialized - NetSocket makes no thread safety guarantee
+    std::lock_guard<std::mutex> lock(*conn.send_mutex);
+    conn.client->Send(const_cast<void*>(data), length, NetSocket::CopyMode::MemCopy);
+}
+
+double PxStream::Client::ProbeLink(double *rtt, double *bandwidth)
+{
+    // best of three empty round trips gives the RTT (polling granularity overstates LAN RTTs, which only
+    // errs towards larger buffers), then the faster of two bulk replies the bandwidth - returns the BDP in bytes
+    std::vector<NetSocket::Client::Event> events;
+    uint8_t request[8] = {PXSTREAM_PROBE_FLAG, 0, 0, 0, 0, 0, 0, 0};
+    *rtt = 1.0e12;
+    *bandwidth = 0.0;
+    int i;
+    for (i = 0; i < 5; i++)
     {
-        lock.lock();
-        while (!_begin_read[connection_idx])
+        uint32_t size = (i < 3) ? 8 : PXSTREAM_PROBE_SIZE;
+        uint32_t net_size = htonl(size);
+        memcpy(request + 4, &net_size, 4);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        SendToServer(_connections[0], request, 8);
+        AwaitConnectionEvents(0, 1, NetSocket::Client::EventType::ReceiveBinary, &events, "link probe");
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        bool valid = events[0].data_length == size && reinterpret_cast<uint8_t*>(events[0].binary_data)[0] == PXSTREAM_PROBE_FLAG;
+        delete[] reinterpret_cast<uint8_t*>(events[0].binary_data);
+        if (!valid)
         {
-            _read_condition.wait(lock);
+            fprintf(stderr, "PxStream::Client> Error: unexpected link probe reply (%u bytes)\n", events[0].data_length);
+            MPI_Abort(_comm, 1);
         }
-        _begin_read[connection_idx] = 0;
-        lock.unlock();
+        if (i < 3)
+        {
+            *rtt = std::min(*rtt, elapsed);
+        }
+        else if (elapsed > *rtt)
+        {
+            *bandwidth = std::max(*bandwidth, size / (elapsed - *rtt));
+        }
+    }
+    return *bandwidth * *rtt;
+}
 
-        read_count = 0;
-        read_finished = false;
-        while (!read_finished)
+void PxStream::Client::AwaitConnectionEvents(int first, int count, NetSocket::Client::EventType type, std::vector<NetSocket::Client::Event> *events, const char *stage)
+{
+    // polls connections [first, first + count) together until each produced one event of `type`
+    // (binary data of other events is discarded) - aborts if the server does not respond in time
+    std::vector<bool> done(count, false);
+    if (events != NULL)
+    {
+        events->assign(count, NetSocket::Client::Event());
+    }
+    int remaining = count;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds((int64_t)(PXSTREAM_CONNECT_TIMEOUT * 1000.0));
+    int i;
+    while (remaining > 0)
+    {
+        bool idle = true;
+        for (i = 0; i < count; i++)
         {
-            NetSocket::Client::Event event;
-            do
+            if (done[i])
             {
-                event = _connections[connection_idx].client->WaitForNextEvent();
-            } while (event.type != NetSocket::Client::EventType::ReceiveBinary);
-
-            if (read_count == 0)
+                continue;
+            }
+            NetSocket::Client::Event event = _connections[first + i].client->PollForNextEvent();
+            if (event.type == NetSocket::Client::EventType::None)
             {
-                if (event.data_length == 1 && *((uint8_t*)event.binary_data) == 1) // next_frame_flag notification
+                continue;
+            }
+            idle = false;
+            if (event.type == type)
+            {
+                if (events != NULL)
                 {
-                    read_count++;
+                    (*events)[i] = event;
                 }
-                else if (event.data_length == 1 && *((uint8_t*)event.binary_data) == 2) // finished_flag notification
+                else if (event.type == NetSocket::Client::EventType::ReceiveBinary)
                 {
-                    _finished++;
-                    conn_finished = true;
-                    read_finished = true;
-                    //_connections[connection_idx].client->Send(&frame_received_flag, 1, NetSocket::CopyMode::MemCopy);
-                }
-                else {
-                    fprintf(stderr, "PxStream::Client> Warning: received unknown buffer\n");
+                    delete[] reinterpret_cast<uint8_t*>(event.binary_data);
                 }
+                done[i] = true;
+                remaining--;
+            }
+            else if (event.type == NetSocket::Client::EventType::ReceiveBinary)
+            {
+                delete[] reinterpret_cast<uint8_t*>(event.binary_data);
+            }
+            else if (event.type == NetSocket::Client::EventType::Disconnect)
+            {
+                fprintf(stderr, "PxStream::Client> Error: [rank %d] server connection closed during %s\n", _rank, stage);
+                MPI_Abort(_comm, 1);
+            }
+        }
+        if (idle)
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                fprintf(stderr, "PxStream::Client> Error: [rank %d] timed out during %s (%d of %d connections pending)\n", _rank, stage, remaining, count);
+                MPI_Abort(_comm, 1);
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+}
+
+bool PxStream::Client::HandleReadEvent(int connection_idx, NetSocket::Client::Event& event)
+{
+    // runs on a reader pool thread - returns true once this connection's part of the frame is complete
+    // (one payload for each subscribed channel)
+    Connection& conn = _connections[connection_idx];
+    bool read_finished = false;
+    bool conn_finished = false;
+    if (event.type == NetSocket::Client::EventType::Disconnect)
+    {
+        // server went away - the connection counts as finished (the partial frame is not completed)
+        std::lock_guard<std::mutex> lock(_read_mutex);
+        if (!conn.server_finished)
+        {
+            fprintf(stderr, "PxStream::Client> Warning: [rank %d] server rank %u disconnected\n", _rank, conn.server_rank);
+            conn.server_finished = true;
+            _finished++;
+        }
+        return true;
+    }
+    if (!conn.header_received)
+    {
+        if (event.data_length == PXSTREAM_FRAME_HEADER_SIZE && *((uint8_t*)event.binary_data) == 1) // frame header
+        {
+            PxStream::FrameHeader header;
+            PxStream::UnpackFrameHeader((uint8_t*)event.binary_data, &header);
+            conn.is_encoded = header.format == PixelFormat::EncodedImage;
+            if (conn.is_encoded)
+            {
+                // compressed bytes are staged, then decoded as RGBA into the frame buffer
+                header.format = PixelFormat::RGBA;
+                header.data_type = PixelDataType::Uint8;
+                conn.encoded.resize(header.payload_size);
+            }
+            if (header.channel >= _channels.size() || !_channels[header.channel].subscribed)
+            {
+                fprintf(stderr, "PxStream::Client> Warning: received frame for unsubscribed channel %u\n", header.channel);
+                header.channel = 0;
+                header.payload_size = 0;
+            }
+            Channel& channel = _channels[header.channel];
+            uint64_t offset = ConnectionBufferOffset(connection_idx, header.format, header.data_type);
+            if (!conn.is_encoded && offset + header.payload_size > channel.buffer_size)
+            {
+                fprintf(stderr, "PxStream::Client> Warning: frame payload (%u) exceeds receive buffer\n", header.payload_size);
+                header.payload_size = 0;
+            }
+            conn.channel = header.channel;
+            conn.pixels = (void*)(channel.pixel_list[_back_buffer] + offset);
+            conn.frame_size = header.payload_size;
+            if (header.channel == 0)
+            {
+                conn.frame_format = header.format;
+                conn.frame_data_type = header.data_type;
+            }
+            conn.frame_id = header.frame_id;
+            conn.frame_timestamp = header.timestamp;
+            conn.has_checksum = header.has_checksum;
+            conn.frame_checksum = header.checksum;
+            conn.header_received = true;
+            read_finished = header.payload_size == 0;
+        }
+        else if (event.data_length >= 4 && *((uint8_t*)event.binary_data) == 3) // new tile layout (load balancing)
+        {
+            // always ends this read (every connection gets the layout in place of a frame, changed or not) -
+            // the layout is applied by Read() once every connection has it
+            if (!ParseRegions((uint8_t*)event.binary_data + 4, event.data_length - 4, conn.next_regions))
+            {
+                fprintf(stderr, "PxStream::Client> Warning: received malformed tile layout\n");
+                conn.next_regions = conn.regions;
+            }
+            conn.layout_received = true;
+        }
+        else if (event.data_length == 1 && *((uint8_t*)event.binary_data) == 2) // finished_flag notification
+        {
+            conn.checksum_valid = true;
+            conn_finished = true;
+            read_finished = true;
+        }
+        else {
+            fprintf(stderr, "PxStream::Client> Warning: received unknown buffer\n");
+        }
+    }
+    else {
+        // frame may arrive in several chunks when the server paces its sends
+        if (conn.read_offset + event.data_length <= conn.frame_size)
+        {
+            uint8_t *dst = conn.is_encoded ? conn.encoded.data() : (uint8_t*)conn.pixels;
+            memcpy(dst + conn.read_offset, event.binary_data, event.data_length);
+            conn.read_offset += event.data_length;
+            read_finished = conn.read_offset == conn.frame_size;
+        }
+        else
+        {
+            fprintf(stderr, "PxStream::Client> Warning: read length (%u) does not match expected pixel length (%u)\n", conn.read_offset + event.data_length, conn.frame_size);
+            read_finished = true;
+        }
+    }
+    delete[] reinterpret_cast<uint8_t*>(event.binary_data);
+
+    if (conn_finished)
+    {
+        // acknowledge the finished flag so the server can shut down
+        uint8_t finished_flag = 2;
+        SendToServer(conn, &finished_flag, 1);
+        std::lock_guard<std::mutex> lock(_read_mutex);
+        if (!conn.server_finished)
+        {
+            conn.server_finished = true;
+            _finished++;
+        }
+        return true;
+    }
+    if (conn.layout_received)
+    {
+        return true;
+    }
+    if (read_finished)
+    {
+        // payload for one channel complete - the next header belongs to another channel of this frame
+        FinishTile(connection_idx, conn.is_encoded);
+        conn.channels_received++;
+        conn.header_received = false;
+        conn.is_encoded = false;
+        conn.read_offset = 0;
+        if (conn.channels_received >= _num_subscribed && _frame_credits > 0)
+        {
+            // frame complete - return its credit so the server may send another
+            uint8_t frame_received_flag = 255;
+            SendToServer(conn, &frame_received_flag, 1);
+        }
+    }
+    return conn.channels_received >= _num_subscribed;
+}
+
+uint64_t PxStream::Client::ConnectionBufferOffset(int connection_idx, PixelFormat format, PixelDataType type)
+{
+    // connection tiles are packed back to back (in connection order) for the given pixel format
+    uint64_t offset = 0;
+    int i;
+    for (i = 0; i < connection_idx; i++)
+    {
+        for (auto& region : _connections[i].regions)
+        {
+            offset += (uint64_t)((uint64_t)region.width * region.height * (double)PxStream::GetBitsPerPixel(format, type) / 8.0);
+        }
+    }
+    return offset;
+}
+
+void PxStream::Client::FinishTile(int connection_idx, bool is_encoded)
+{
+    // verify payload as received (before any decode), then decode encoded images
+    Connection& conn = _connections[connection_idx];
+    conn.receive_time = PxStream::GetTimestamp();
+    if (_verify_checksums && conn.has_checksum)
+    {
+        // frame is valid only if every channel's payload is
+        const void *payload = is_encoded ? (const void*)conn.encoded.data() : conn.pixels;
+        conn.checksum_valid = conn.checksum_valid && PxStream::ComputeChecksum(payload, conn.frame_size) == conn.frame_checksum;
+    }
+    if (is_encoded && conn.frame_size > 0)
+    {
+        DecodeTile(connection_idx);
+    }
+}
+
+void PxStream::Client::DecodeTile(int connection_idx)
+{
+    // runs on the connection's reader thread, so tiles from different connections decode in parallel
+    Connection& conn = _connections[connection_idx];
+    PxStream::ImageDecoder decoder = PxStream::GetImageDecoder();
+    if (!decoder || !decoder(conn.encoded.data(), conn.frame_size, (uint8_t*)conn.pixels, conn.regions[0].width, conn.regions[0].height))
+    {
+        fprintf(stderr, "PxStream::Client> Warning: could not decode %u byte encoded image\n", conn.frame_size);
+    }
+}
+
+static uint64_t RegionDigest(const uint8_t *base, uint64_t pitch, int32_t x, int32_t y, int32_t width, int32_t height,
+                             int32_t global_x, int32_t global_y, uint32_t element_size)
+{
+    // per-row hashes salted with the row's global position - summed so regions combine in any order
+    uint64_t digest = 0;
+    int32_t row;
+    for (row = 0; row < height; row++)
+    {
+        uint64_t h = PxStream::ComputeChecksum(base + (uint64_t)(y + row) * pitch + (uint64_t)x * element_size, (uint64_t)width * element_size);
+        h += (((uint64_t)(global_y + row) << 32) | (uint32_t)global_x) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 31;
+        h *= 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 29;
+        digest += h;
+    }
+    return digest;
+}
+
+static bool IntersectRegions(const int32_t *a, const int32_t *b, int32_t region[4])
+{
+    // regions are {dim x, dim y, offset x, offset y}
+    region[2] = std::max(a[2], b[2]);
+    region[3] = std::max(a[3], b[3]);
+    region[0] = std::min(a[2] + a[0], b[2] + b[0]) - region[2];
+    region[1] = std::min(a[3] + a[1], b[3] + b[1]) - region[3];
+    return region[0] > 0 && region[1] > 0;
+}
+
+void PxStream::Client::VerifySelection(DDR_DataDescriptor *desc, const uint8_t *tiles, const uint8_t *data)
+{
+    // each rank digests what it sent to every other rank (from its received tiles) and what it
+    // received (from the filled selection) - a reduce-scatter of the send digests must match
+    auto it = _layouts.find(desc);
+    if (it == _layouts.end())
+    {
+        return;
+    }
+    SelectionLayout& layout = it->second;
+    uint32_t es = layout.element_size;
+    std::vector<uint64_t> sent(_num_ranks, 0);
+    int32_t region[4];
+    int i, r;
+    for (i = 0; i < layout.own_chunks.size(); i += 4)
+    {
+        const int32_t *chunk = layout.own_chunks.data() + i;
+        const int64_t *source = layout.own_sources.data() + i / 4 * 5;
+        for (r = 0; r < _num_ranks; r++)
+        {
+            if (IntersectRegions(chunk, layout.needs.data() + r * 4, region))
+            {
+                sent[r] += RegionDigest(tiles + source[0], (uint64_t)source[1] * es, region[2] - source[3], region[3] - source[4],
+                                        region[0], region[1], region[2], region[3], es);
             }
-            else {
-                if (event.data_length == _connections[connection_idx].pixel_size)
+        }
+    }
+
+    const int32_t *need = layout.needs.data() + _rank * 4;
+    uint64_t received = 0;
+    for (i = 0; i < layout.all_chunks.size(); i += 4)
+    {
+        if (IntersectRegions(layout.all_chunks.data() + i, need, region))
+        {
+            received += RegionDigest(data, (uint64_t)need[0] * es, region[2] - need[2], region[3] - need[3],
+                                     region[0], region[1], region[2], region[3], es);
+        }
+    }
+
+    uint64_t expected;
+    MPI_Reduce_scatter_block(sent.data(), &expected, 1, MPI_UINT64_T, MPI_SUM, _comm);
+    _selection_valid = expected == received;
+    if (!_selection_valid)
+    {
+        _redistribution_errors++;
+        fprintf(stderr, "PxStream::Client> Warning: [rank %d] selection does not match received tiles after redistribution (frame %u)\n", _rank, _frame_id);
+    }
+}
+
+void PxStream::Client::AllocateChannelBuffers(Channel& channel)
+{
+    channel.pixel_list[0] = reinterpret_cast<uint8_t*>(PxStream::AllocatePixelBuffer(channel.buffer_size, _numa_node));
+    channel.pixel_list[1] = reinterpret_cast<uint8_t*>(PxStream::AllocatePixelBuffer(channel.buffer_size, _numa_node));
+    if (channel.pixel_list[0] == NULL || channel.pixel_list[1] == NULL)
+    {
+        fprintf(stderr, "PxStream::Client> Error: could not allocate receive buffers for channel '%s'\n", channel.name.c_str());
+        MPI_Abort(_comm, 1);
+    }
+}
+
+bool PxStream::Client::ParseRegions(const uint8_t *data, uint32_t length, std::vector<Region>& regions)
+{
+    // region count, then width, height, offset x, offset y, priority per region (network order)
+    uint32_t net_value;
+    uint32_t num_regions = 0;
+    if (length >= 4)
+    {
+        memcpy(&net_value, data, 4);
+        num_regions = ntohl(net_value);
+    }
+    if (num_regions == 0 || length != 4 + 20 * num_regions)
+    {
+        return false;
+    }
+    regions.clear();
+    int i, j;
+    for (i = 0; i < num_regions; i++)
+    {
+        int32_t values[5];
+        for (j = 0; j < 5; j++)
+        {
+            memcpy(&net_value, data + 4 + 20 * i + 4 * j, 4);
+            values[j] = (int32_t)ntohl(net_value);
+        }
+        regions.push_back({values[0], values[1], values[2], values[3], values[4]});
+    }
+    return true;
+}
+
+void PxStream::Client::ApplyLayout()
+{
+    // collective - swaps in the announced tiles, then rebuilds receive buffers and (lazily) every selection
+    // (nothing to rebuild if no rank's tiles changed)
+    int local_changed = 0;
+    for (auto& conn : _connections)
+    {
+        if (conn.layout_received && (conn.next_regions.size() != conn.regions.size()
+            || !std::equal(conn.next_regions.begin(), conn.next_regions.end(), conn.regions.begin(), [](const Region& a, const Region& b) {
+                   return a.width == b.width && a.height == b.height && a.offset_x == b.offset_x && a.offset_y == b.offset_y && a.priority == b.priority;
+               })))
+        {
+            local_changed = 1;
+        }
+    }
+    int changed;
+    MPI_Allreduce(&local_changed, &changed, 1, MPI_INT, MPI_MAX, _comm);
+    if (!changed)
+    {
+        return;
+    }
+    uint64_t num_pixels;
+    for (auto& conn : _connections)
+    {
+        if (conn.layout_received)
+        {
+            conn.regions = conn.next_regions;
+        }
+        num_pixels = 0;
+        for (auto& region : conn.regions)
+        {
+            num_pixels += (uint64_t)region.width * region.height;
+        }
+        conn.pixel_size = (uint32_t)(num_pixels * (double)PxStream::GetBitsPerPixel(_channels[0].format, _channels[0].data_type) / 8.0);
+    }
+    ResolveRegionVisibility();
+    for (auto& channel : _channels)
+    {
+        if (channel.subscribed)
+        {
+            PxStream::FreePixelBuffer(channel.pixel_list[0], channel.buffer_size);
+            PxStream::FreePixelBuffer(channel.pixel_list[1], channel.buffer_size);
+            channel.buffer_size = ConnectionBufferOffset(_connections.size(), channel.format, channel.data_type);
+            AllocateChannelBuffers(channel);
+        }
+    }
+    for (auto& selection : _selections)
+    {
+        for (auto& format_desc : selection.second.descriptors)
+        {
+            auto plan = _plans.find(format_desc.second);
+            if (plan != _plans.end())
+            {
+                for (auto& transfer : plan->second.sends)
                 {
-                    memcpy(_connections[connection_idx].pixels, event.binary_data, event.data_length);
+                    MPI_Type_free(&transfer.type);
                 }
-                else
+                for (auto& transfer : plan->second.receives)
                 {
-                    fprintf(stderr, "PxStream::Client> Warning: read length (%u) does not match expected pixel length (%u)\n", event.data_length, _connections[connection_idx].pixel_size);
+                    MPI_Type_free(&transfer.type);
                 }
-                //_connections[connection_idx].client->Send(&frame_received_flag, 1, NetSocket::CopyMode::MemCopy);
-                read_finished = true;
+                _plans.erase(plan);
+            }
+            _layouts.erase(format_desc.second);
+            // the application's handle (the selection's key) stays allocated - it is only ever used for lookup
+            if (format_desc.second != selection.first)
+            {
+                DDR_FreeDataDescriptor(format_desc.second);
+            }
+        }
+        selection.second.descriptors.clear();
+    }
+    if (_rank == 0)
+    {
+        printf("PxStream::Client> server tiles changed - selections will be remapped\n");
+    }
+}
+
+static void SubtractRegion(std::vector<int32_t>& rects, const int32_t *cut)
+{
+    // splits every rect {dim x, dim y, offset x, offset y} around `cut` - the pieces above and below
+    // span the full width, the pieces left and right only the rows of the cut
+    std::vector<int32_t> result;
+    int32_t overlap[4];
+    int i;
+    for (i = 0; i < rects.size(); i += 4)
+    {
+        const int32_t *r = rects.data() + i;
+        if (!IntersectRegions(r, cut, overlap))
+        {
+            result.insert(result.end(), r, r + 4);
+            continue;
+        }
+        if (overlap[3] > r[3])
+        {
+            result.insert(result.end(), {r[0], overlap[3] - r[3], r[2], r[3]});
+        }
+        if (overlap[3] + overlap[1] < r[3] + r[1])
+        {
+            result.insert(result.end(), {r[0], r[3] + r[1] - overlap[3] - overlap[1], r[2], overlap[3] + overlap[1]});
+        }
+        if (overlap[2] > r[2])
+        {
+            result.insert(result.end(), {overlap[2] - r[2], overlap[1], r[2], overlap[3]});
+        }
+        if (overlap[2] + overlap[0] < r[2] + r[0])
+        {
+            result.insert(result.end(), {r[2] + r[0] - overlap[2] - overlap[0], overlap[1], overlap[2] + overlap[0], overlap[3]});
+        }
+    }
+    rects.swap(result);
+}
+
+void PxStream::Client::ResolveRegionVisibility()
+{
+    // every rank learns every server region: dims[2], offsets[2], priority, server rank, region index
+    std::vector<int32_t> own;
+    _regions_overlap = false;
+    for (auto& conn : _connections)
+    {
+        int j;
+        for (j = 0; j < conn.regions.size(); j++)
+        {
+            Region& region = conn.regions[j];
+            region.visible = {region.width, region.height, region.offset_x, region.offset_y};
+            own.insert(own.end(), {region.width, region.height, region.offset_x, region.offset_y, region.priority, (int32_t)conn.server_rank, j});
+        }
+    }
+    int own_count = own.size();
+    std::vector<int> counts(_num_ranks);
+    std::vector<int> displacements(_num_ranks);
+    MPI_Allgather(&own_count, 1, MPI_INT, counts.data(), 1, MPI_INT, _comm);
+    int total_count = 0;
+    int i, k;
+    for (i = 0; i < _num_ranks; i++)
+    {
+        displacements[i] = total_count;
+        total_count += counts[i];
+    }
+    std::vector<int32_t> all(total_count);
+    MPI_Allgatherv(own.data(), own_count, MPI_INT32_T, all.data(), counts.data(), displacements.data(), MPI_INT32_T, _comm);
+
+    // where regions overlap the highest priority wins, then the lowest server rank, then the region sent first
+    int32_t overlap[4];
+    for (i = 0; i < all.size(); i += 7)
+    {
+        for (k = i + 7; k < all.size(); k += 7)
+        {
+            _regions_overlap = _regions_overlap || IntersectRegions(all.data() + i, all.data() + k, overlap);
+        }
+    }
+    if (!_regions_overlap)
+    {
+        return;
+    }
+    for (auto& conn : _connections)
+    {
+        int j;
+        for (j = 0; j < conn.regions.size(); j++)
+        {
+            Region& region = conn.regions[j];
+            for (k = 0; k < all.size(); k += 7)
+            {
+                const int32_t *other = all.data() + k;
+                bool precedes = other[4] > region.priority || (other[4] == region.priority &&
+                                (other[5] < conn.server_rank || (other[5] == conn.server_rank && other[6] < j)));
+                if (precedes)
+                {
+                    SubtractRegion(region.visible, other);
+                }
+            }
+        }
+    }
+    if (_rank == 0)
+    {
+        printf("PxStream::Client> Server regions overlap - overlaps are resolved by region priority\n");
+    }
+}
+
+void PxStream::Client::PixelRectToElements(const int32_t *rect, PixelFormat format, PixelDataType type, int32_t *elements)
+{
+    // DDR works in data type elements along x and rows along y - DXT1 works in bytes along x and rows of
+    // 4x4 blocks along y, with a bottom left origin
+    int32_t bpp = PxStream::GetBitsPerPixel(format, type);
+    int32_t element_bits = 8 * PxStream::GetDataTypeSize(type);
+    switch (format)
+    {
+        case PixelFormat::DXT1:
+            elements[0] = rect[0] * 2;
+            elements[1] = rect[1] / 4;
+            elements[2] = rect[2] * 2;
+            elements[3] = ((int32_t)_global_height - rect[3] - rect[1]) / 4;
+            break;
+        default:
+            elements[0] = rect[0] * bpp / element_bits;
+            elements[1] = rect[1];
+            elements[2] = rect[2] * bpp / element_bits;
+            elements[3] = rect[3];
+            break;
+    }
+}
+
+void PxStream::Client::CreateRedistributionPlan(DDR_DataDescriptor *desc, MPI_Datatype type, const std::vector<int>& counts, const std::vector<int>& displacements)
+{
+    // one subarray datatype per (visible chunk, rank) pair - sends describe the chunk within its tile and
+    // receives the same part within the selection, so nothing is staged. Both sides enumerate chunks in
+    // the sender's order, which keeps the single tag matched
+    SelectionLayout& layout = _layouts[desc];
+    RedistributionPlan& plan = _plans[desc];
+    const int32_t *need = layout.needs.data() + _rank * 4;
+    int32_t region[4];
+    int i, r;
+    for (i = 0; i < layout.own_chunks.size(); i += 4)
+    {
+        const int64_t *source = layout.own_sources.data() + i / 4 * 5;
+        for (r = 0; r < _num_ranks; r++)
+        {
+            if (IntersectRegions(layout.own_chunks.data() + i, layout.needs.data() + r * 4, region))
+            {
+                int array_sizes[2] = {(int)source[2], (int)source[1]};
+                int sub_sizes[2] = {region[1], region[0]};
+                int starts[2] = {region[3] - (int)source[4], region[2] - (int)source[3]};
+                Transfer transfer = {r, (uint64_t)source[0]};
+                MPI_Type_create_subarray(2, array_sizes, sub_sizes, starts, MPI_ORDER_C, type, &transfer.type);
+                MPI_Type_commit(&transfer.type);
+                plan.sends.push_back(transfer);
+            }
+        }
+    }
+    for (r = 0; r < _num_ranks; r++)
+    {
+        for (i = displacements[r]; i < displacements[r] + counts[r]; i += 4)
+        {
+            if (IntersectRegions(layout.all_chunks.data() + i, need, region))
+            {
+                int array_sizes[2] = {need[1], need[0]};
+                int sub_sizes[2] = {region[1], region[0]};
+                int starts[2] = {region[3] - need[3], region[2] - need[2]};
+                Transfer transfer = {r, 0};
+                MPI_Type_create_subarray(2, array_sizes, sub_sizes, starts, MPI_ORDER_C, type, &transfer.type);
+                MPI_Type_commit(&transfer.type);
+                plan.receives.push_back(transfer);
             }
         }
-        lock.lock();
-        _read_finished_count++;
-        lock.unlock();
-        _finished_condition.notify_one();
     }
 }
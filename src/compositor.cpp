@@ -0,0 +1,300 @@
+#include <algorithm>
+#include "pxstream/compositor.h"
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define PXSTREAM_X86_SIMD
+#endif
+
+PxStream::DepthCompositor::DepthCompositor(const std::vector<std::string>& hosts, const std::vector<uint16_t>& ports, MPI_Comm comm, const char *depth_channel) :
+    _tiles_composited(false)
+{
+    MPI_Comm_dup(comm, &_comm);
+    MPI_Comm_rank(_comm, &_rank);
+    if (hosts.empty() || hosts.size() != ports.size())
+    {
+        fprintf(stderr, "PxStream::DepthCompositor> Error: expected one port per source host\n");
+        MPI_Abort(_comm, 1);
+    }
+
+    // every source is an independent stream (own connections and communicator) subscribed to color + depth
+    int i;
+    std::vector<std::string> channels = {PXSTREAM_PRIMARY_CHANNEL_NAME, depth_channel};
+    for (i = 0; i < hosts.size(); i++)
+    {
+        Client *source = new Client(hosts[i].c_str(), ports[i], _comm, channels);
+        int depth = source->GetChannelIndex(depth_channel);
+        if (!source->ChannelSubscribed(depth) || source->GetChannelPixelFormat(depth) != PixelFormat::GrayScale
+            || source->GetChannelPixelDataType(depth) != PixelDataType::Float)
+        {
+            fprintf(stderr, "PxStream::DepthCompositor> Error: source %d does not publish a GrayScale/Float '%s' channel\n", i, depth_channel);
+            MPI_Abort(_comm, 1);
+        }
+        uint32_t width, height;
+        source->GetGlobalDimensions(&width, &height);
+        if (i == 0)
+        {
+            _global_width = width;
+            _global_height = height;
+        }
+        else if (width != _global_width || height != _global_height || source->GetPixelFormat() != _sources[0]->GetPixelFormat()
+                 || source->GetPixelDataType() != _sources[0]->GetPixelDataType())
+        {
+            fprintf(stderr, "PxStream::DepthCompositor> Error: source %d image size or format does not match source 0\n", i);
+            MPI_Abort(_comm, 1);
+        }
+        _sources.push_back(source);
+        _depth_channels.push_back(depth);
+    }
+    if (_sources[0]->GetPixelFormat() == PixelFormat::DXT1)
+    {
+        fprintf(stderr, "PxStream::DepthCompositor> Error: compressed (DXT1) color cannot be composited per pixel\n");
+        MPI_Abort(_comm, 1);
+    }
+}
+
+PxStream::DepthCompositor::~DepthCompositor()
+{
+    for (auto source : _sources)
+    {
+        delete source;
+    }
+}
+
+void PxStream::DepthCompositor::Read()
+{
+    // each source reads asynchronously in the shared reader pool - this just waits for all of them
+    for (auto source : _sources)
+    {
+        source->Read();
+    }
+
+    // sources tiled alike are composited as received, before redistribution - all ranks must agree,
+    // since it decides which sources FillSelection() redistributes
+    int i;
+    int local_match = 1;
+    for (i = 1; i < _sources.size(); i++)
+    {
+        local_match &= _sources[i]->TileLayoutMatches(_sources[0]) ? 1 : 0;
+    }
+    int all_match;
+    MPI_Allreduce(&local_match, &all_match, 1, MPI_INT, MPI_MIN, _comm);
+    _tiles_composited = _sources.size() > 1 && all_match != 0;
+    if (_tiles_composited)
+    {
+        CompositeFrameTiles();
+    }
+}
+
+bool PxStream::DepthCompositor::ServerFinished()
+{
+    // a composite needs every layer - stop as soon as any source has finished
+    for (auto source : _sources)
+    {
+        if (source->ServerFinished())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PxStream::DepthCompositor::GetGlobalDimensions(uint32_t *width, uint32_t *height)
+{
+    *width = _global_width;
+    *height = _global_height;
+}
+
+PxStream::PixelFormat PxStream::DepthCompositor::GetPixelFormat()
+{
+    return _sources[0]->GetPixelFormat();
+}
+
+PxStream::PixelDataType PxStream::DepthCompositor::GetPixelDataType()
+{
+    return _sources[0]->GetPixelDataType();
+}
+
+int PxStream::DepthCompositor::GetSourceCount()
+{
+    return _sources.size();
+}
+
+PxStream::Client* PxStream::DepthCompositor::GetSource(int source)
+{
+    return _sources[source];
+}
+
+DDR_DataDescriptor* PxStream::DepthCompositor::CreateGlobalPixelSelection(int32_t *sizes, int32_t *offsets)
+{
+    // source 0's color selection doubles as the handle for the whole set
+    Selection selection;
+    selection.num_pixels = (uint64_t)sizes[0] * sizes[1];
+    int i;
+    for (i = 0; i < _sources.size(); i++)
+    {
+        SourceSelection source;
+        source.color = _sources[i]->CreateGlobalPixelSelection(0, sizes, offsets);
+        source.depth = _sources[i]->CreateGlobalPixelSelection(_depth_channels[i], sizes, offsets);
+        selection.sources.push_back(source);
+    }
+    if (_sources.size() > 1)
+    {
+        uint32_t pixel_size = PxStream::GetBitsPerPixel(GetPixelFormat(), GetPixelDataType()) / 8;
+        selection.color_scratch.resize(selection.num_pixels * pixel_size);
+        selection.depth_scratch.resize(selection.num_pixels);
+    }
+    DDR_DataDescriptor *handle = selection.sources[0].color;
+    _selections[handle] = std::move(selection);
+    return handle;
+}
+
+void PxStream::DepthCompositor::FillSelection(DDR_DataDescriptor *selection, void *color, float *depth)
+{
+    // `depth` may be NULL if the caller only wants the composited color
+    auto it = _selections.find(selection);
+    if (it == _selections.end())
+    {
+        fprintf(stderr, "PxStream::DepthCompositor> Warning: unknown selection\n");
+        return;
+    }
+    Selection& s = it->second;
+    std::vector<float> own_depth;
+    if (depth == NULL)
+    {
+        own_depth.resize(s.num_pixels);
+        depth = own_depth.data();
+    }
+    uint32_t pixel_size = PxStream::GetBitsPerPixel(GetPixelFormat(), GetPixelDataType()) / 8;
+
+    // source 0 fills the output directly (already composited if Read() merged the tiles), every other
+    // source is redistributed to scratch and merged in
+    _sources[0]->FillSelection(s.sources[0].color, color);
+    _sources[0]->FillSelection(s.sources[0].depth, depth);
+    if (_tiles_composited)
+    {
+        return;
+    }
+    int i;
+    for (i = 1; i < _sources.size(); i++)
+    {
+        _sources[i]->FillSelection(s.sources[i].color, s.color_scratch.data());
+        _sources[i]->FillSelection(s.sources[i].depth, s.depth_scratch.data());
+        PxStream::CompositeDepth(s.color_scratch.data(), s.depth_scratch.data(), reinterpret_cast<uint8_t*>(color), depth, s.num_pixels, pixel_size);
+    }
+}
+
+
+// Private
+void PxStream::DepthCompositor::CompositeFrameTiles()
+{
+    // merges every source's received tiles into source 0's, in place
+    uint32_t pixel_size = PxStream::GetBitsPerPixel(GetPixelFormat(), GetPixelDataType()) / 8;
+    uint64_t color_size, depth_size;
+    uint8_t *color = _sources[0]->GetFrameTiles(0, &color_size);
+    float *depth = reinterpret_cast<float*>(_sources[0]->GetFrameTiles(_depth_channels[0], &depth_size));
+    int i;
+    for (i = 1; i < _sources.size(); i++)
+    {
+        uint8_t *src_color = _sources[i]->GetFrameTiles(0, &color_size);
+        float *src_depth = reinterpret_cast<float*>(_sources[i]->GetFrameTiles(_depth_channels[i], &depth_size));
+        PxStream::CompositeDepth(src_color, src_depth, color, depth, depth_size / sizeof(float), pixel_size);
+    }
+}
+
+
+// Compositing kernels
+static void CompositeDepthScalar(const uint8_t *src_color, const float *src_depth, uint8_t *dst_color, float *dst_depth, uint64_t begin, uint64_t end, uint32_t pixel_size)
+{
+    uint64_t i;
+    for (i = begin; i < end; i++)
+    {
+        if (src_depth[i] < dst_depth[i])
+        {
+            dst_depth[i] = src_depth[i];
+            memcpy(dst_color + i * pixel_size, src_color + i * pixel_size, pixel_size);
+        }
+    }
+}
+
+#ifdef PXSTREAM_X86_SIMD
+static uint64_t CompositeDepth32Sse2(const uint8_t *src_color, const float *src_depth, uint8_t *dst_color, float *dst_depth, uint64_t num_pixels)
+{
+    // 4 pixels per step - the depth comparison mask selects whole 32-bit pixels
+    uint64_t i;
+    for (i = 0; i + 4 <= num_pixels; i += 4)
+    {
+        __m128 src_d = _mm_loadu_ps(src_depth + i);
+        __m128 dst_d = _mm_loadu_ps(dst_depth + i);
+        __m128 closer = _mm_cmplt_ps(src_d, dst_d);
+        __m128i mask = _mm_castps_si128(closer);
+        __m128i src_c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_color + i * 4));
+        __m128i dst_c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst_color + i * 4));
+        _mm_storeu_ps(dst_depth + i, _mm_or_ps(_mm_and_ps(closer, src_d), _mm_andnot_ps(closer, dst_d)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst_color + i * 4), _mm_or_si128(_mm_and_si128(mask, src_c), _mm_andnot_si128(mask, dst_c)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static uint64_t CompositeDepth32Avx2(const uint8_t *src_color, const float *src_depth, uint8_t *dst_color, float *dst_depth, uint64_t num_pixels)
+{
+    // 8 pixels per step
+    uint64_t i;
+    for (i = 0; i + 8 <= num_pixels; i += 8)
+    {
+        __m256 src_d = _mm256_loadu_ps(src_depth + i);
+        __m256 dst_d = _mm256_loadu_ps(dst_depth + i);
+        __m256 closer = _mm256_cmp_ps(src_d, dst_d, _CMP_LT_OQ);
+        __m256i src_c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src_color + i * 4));
+        __m256i dst_c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst_color + i * 4));
+        _mm256_storeu_ps(dst_depth + i, _mm256_blendv_ps(dst_d, src_d, closer));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst_color + i * 4), _mm256_blendv_epi8(dst_c, src_c, _mm256_castps_si256(closer)));
+    }
+    return i;
+}
+#endif
+
+typedef uint64_t (*CompositeDepth32Kernel)(const uint8_t *src_color, const float *src_depth, uint8_t *dst_color, float *dst_depth, uint64_t num_pixels);
+
+static CompositeDepth32Kernel SelectKernel()
+{
+#ifdef PXSTREAM_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return CompositeDepth32Avx2;
+    }
+    return CompositeDepth32Sse2;
+#else
+    return NULL;
+#endif
+}
+
+void PxStream::CompositeDepth(const uint8_t *src_color, const float *src_depth, uint8_t *dst_color, float *dst_depth, uint64_t num_pixels, uint32_t pixel_size)
+{
+    static CompositeDepth32Kernel composite_32 = SelectKernel();
+
+    // SIMD kernels handle 32-bit pixels (e.g. Uint8 RGBA) - the remainder and other pixel sizes are scalar
+    uint64_t done = 0;
+    if (pixel_size == 4 && composite_32 != NULL)
+    {
+        done = composite_32(src_color, src_depth, dst_color, dst_depth, num_pixels);
+    }
+    CompositeDepthScalar(src_color, src_depth, dst_color, dst_depth, done, num_pixels, pixel_size);
+}
+
+void PxStream::CompositeOver(const uint8_t *front, const uint8_t *back, uint8_t *dst, uint64_t num_pixels)
+{
+    // premultiplied Uint8 RGBA: dst = front + back * (1 - front alpha) - dst may alias front or back
+    uint64_t i;
+    int c;
+    for (i = 0; i < num_pixels; i++)
+    {
+        uint32_t transparency = 255 - front[i * 4 + 3];
+        for (c = 0; c < 4; c++)
+        {
+            uint32_t value = front[i * 4 + c] + (back[i * 4 + c] * transparency + 127) / 255;
+            dst[i * 4 + c] = (uint8_t)std::min(value, 255u);
+        }
+    }
+}
@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cstring>
+#include "pxstream/mappedstream.h"
+
+PxStream::MappedStream::MappedStream(const char *filename) :
+    _fd(-1),
+    _map(NULL),
+    _map_size(0),
+    _is_recording(false),
+    _index(NULL),
+    _d1v_frame_size(0),
+    _fps(0.0)
+{
+    memset(&_header, 0, sizeof(RecordingHeader));
+    _fd = open(filename, O_RDONLY);
+    if (_fd < 0)
+    {
+        fprintf(stderr, "PxStream::MappedStream> Error: cannot open %s\n", filename);
+        return;
+    }
+    struct stat info;
+    if (fstat(_fd, &info) != 0)
+    {
+        fprintf(stderr, "PxStream::MappedStream> Error: cannot stat %s\n", filename);
+        close(_fd);
+        _fd = -1;
+        return;
+    }
+    _map_size = info.st_size;
+    if (_map_size >= sizeof(uint32_t))
+    {
+        void *map = mmap(NULL, _map_size, PROT_READ, MAP_SHARED, _fd, 0);
+        _map = (map == MAP_FAILED) ? NULL : reinterpret_cast<uint8_t*>(map);
+    }
+    if (_map == NULL)
+    {
+        fprintf(stderr, "PxStream::MappedStream> Error: cannot map %s\n", filename);
+        close(_fd);
+        _fd = -1;
+        return;
+    }
+    // frames are read mostly in order - let the kernel read ahead aggressively
+    madvise(_map, _map_size, MADV_SEQUENTIAL);
+
+    uint32_t magic;
+    memcpy(&magic, _map, sizeof(uint32_t));
+    bool valid = false;
+    if (magic == PXSTREAM_RECORDING_MAGIC)
+    {
+        valid = OpenRecording();
+    }
+    else if (ntohl(magic) == PXSTREAM_D1V_MAGIC)
+    {
+        valid = OpenD1v();
+    }
+    if (!valid)
+    {
+        fprintf(stderr, "PxStream::MappedStream> Error: %s is not a valid recording or D1V video\n", filename);
+        munmap(_map, _map_size);
+        close(_fd);
+        _map = NULL;
+        _fd = -1;
+        memset(&_header, 0, sizeof(RecordingHeader));
+    }
+}
+
+PxStream::MappedStream::~MappedStream()
+{
+    if (_map != NULL)
+    {
+        munmap(_map, _map_size);
+    }
+    if (_fd >= 0)
+    {
+        close(_fd);
+    }
+}
+
+bool PxStream::MappedStream::IsOpen()
+{
+    return _map != NULL;
+}
+
+uint64_t PxStream::MappedStream::GetFrameCount()
+{
+    return _header.frame_count;
+}
+
+const PxStream::RecordingHeader& PxStream::MappedStream::GetHeader()
+{
+    return _header;
+}
+
+double PxStream::MappedStream::GetFramesPerSecond()
+{
+    return _fps;
+}
+
+void* PxStream::MappedStream::GetFrame(uint64_t index, uint32_t *size, PixelFormat *format, PixelDataType *type)
+{
+    if (index >= _header.frame_count)
+    {
+        return NULL;
+    }
+    if (_is_recording)
+    {
+        *size = _index[index].size;
+        *format = _index[index].format;
+        *type = _index[index].data_type;
+        return _map + _index[index].offset;
+    }
+    *size = _d1v_frame_size;
+    *format = PixelFormat::DXT1;
+    *type = PixelDataType::Uint8;
+    return _map + PXSTREAM_D1V_HEADER_SIZE + index * _d1v_frame_size;
+}
+
+void PxStream::MappedStream::Prefetch(uint64_t index, uint64_t count)
+{
+    AdviseFrames(index, count, MADV_WILLNEED);
+}
+
+void PxStream::MappedStream::Evict(uint64_t index, uint64_t count)
+{
+    // drops pages from this process' mapping (they stay in the page cache)
+    AdviseFrames(index, count, MADV_DONTNEED);
+}
+
+// Private
+bool PxStream::MappedStream::OpenRecording()
+{
+    if (_map_size < sizeof(RecordingHeader))
+    {
+        return false;
+    }
+    memcpy(&_header, _map, sizeof(RecordingHeader));
+    if (_header.version != PXSTREAM_RECORDING_VERSION || _header.index_offset == 0 || _header.index_offset > _map_size
+        || _header.frame_count > (_map_size - _header.index_offset) / sizeof(RecordingIndexEntry))
+    {
+        return false;
+    }
+    const RecordingIndexEntry *index = reinterpret_cast<const RecordingIndexEntry*>(_map + _header.index_offset);
+    // every frame must lie inside the mapping (before the index) - frames are handed out zero-copy
+    uint64_t i;
+    for (i = 0; i < _header.frame_count; i++)
+    {
+        if (index[i].offset > _header.index_offset || index[i].size > _header.index_offset - index[i].offset)
+        {
+            fprintf(stderr, "PxStream::MappedStream> Error: index entry %lu lies outside the recording\n", (unsigned long)i);
+            return false;
+        }
+    }
+    _is_recording = true;
+    _index = index;
+    if (_header.frame_count > 1)
+    {
+        double duration = (double)(_index[_header.frame_count - 1].timestamp - _index[0].timestamp) / 1000000.0;
+        _fps = (duration > 0.0) ? (double)(_header.frame_count - 1) / duration : 0.0;
+    }
+    return true;
+}
+
+bool PxStream::MappedStream::OpenD1v()
+{
+    if (_map_size < PXSTREAM_D1V_HEADER_SIZE)
+    {
+        return false;
+    }
+    // .d1v header: magic (big endian), width, height, frame count (little endian uint32), fps (little endian uint16)
+    uint32_t width = _map[4] | (_map[5] << 8) | (_map[6] << 16) | ((uint32_t)_map[7] << 24);
+    uint32_t height = _map[8] | (_map[9] << 8) | (_map[10] << 16) | ((uint32_t)_map[11] << 24);
+    uint32_t frames = _map[12] | (_map[13] << 8) | (_map[14] << 16) | ((uint32_t)_map[15] << 24);
+    uint16_t fps = _map[16] | (_map[17] << 8);
+    _d1v_frame_size = width * height / 2;
+    if (PXSTREAM_D1V_HEADER_SIZE + (uint64_t)frames * _d1v_frame_size > _map_size)
+    {
+        return false;
+    }
+    _header.magic = PXSTREAM_D1V_MAGIC;
+    _header.local_width = width;
+    _header.local_height = height;
+    _header.format = PixelFormat::DXT1;
+    _header.data_type = PixelDataType::Uint8;
+    _header.frame_count = frames;
+    _fps = (double)fps;
+    return true;
+}
+
+void PxStream::MappedStream::AdviseFrames(uint64_t index, uint64_t count, int advice)
+{
+    if (index >= _header.frame_count || count == 0)
+    {
+        return;
+    }
+    uint64_t last = std::min(index + count, _header.frame_count) - 1;
+    uint32_t size;
+    PixelFormat format;
+    PixelDataType type;
+    uint8_t *start = reinterpret_cast<uint8_t*>(GetFrame(index, &size, &format, &type));
+    uint8_t *end = reinterpret_cast<uint8_t*>(GetFrame(last, &size, &format, &type)) + size;
+    // madvise needs a page-aligned start address
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint8_t *aligned_start = _map + ((start - _map) / page_size) * page_size;
+    madvise(aligned_start, end - aligned_start, advice);
+}
@@ -1,5 +1,58 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include <dirent.h>
+#include <ifaddrs.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include "pxstream.h"
 
+#define PXSTREAM_MPOL_PREFERRED 1
+#define PXSTREAM_DXT1_BAND_ROWS 16
+
+static PxStream::ImageDecoder image_decoder = nullptr;
+static void* AllocateDefaultBuffer(uint64_t size, int numa_node);
+static void FreeDefaultBuffer(void *buffer, uint64_t size);
+static PxStream::PixelAllocateFunction pixel_allocate = AllocateDefaultBuffer;
+static PxStream::PixelReleaseFunction pixel_release = FreeDefaultBuffer;
+static std::mutex pixel_mutex;
+static std::map<void*, PxStream::PixelReleaseFunction> pixel_buffers; // outstanding buffers -> their release function
+static std::mutex affinity_mutex;
+static std::string thread_affinity[3];
+static bool thread_affinity_set[3] = {false, false, false};
+static const char *thread_affinity_env[3] = {"PXSTREAM_READER_CPUS", "PXSTREAM_SENDER_CPUS", "PXSTREAM_ENCODER_CPUS"};
+static const char *thread_role_name[3] = {"reader", "sender", "encoder"};
+static int nic_numa_node = -1;
+
+// DXT1 encoder pool - one image at a time, split into bands of block rows
+typedef struct EncoderJob {
+    const uint8_t *rgba;
+    uint32_t width;
+    uint32_t height;
+    uint8_t *dxt1;
+    uint32_t block_rows;
+    uint32_t next_row;
+    uint32_t rows_done;
+} EncoderJob;
+typedef struct EncoderPool {
+    std::mutex mutex;
+    std::mutex job_mutex;
+    std::condition_variable condition;
+    std::condition_variable finished_condition;
+    EncoderJob job;
+} EncoderPool;
+static EncoderPool *encoder_pool = NULL; // never destroyed - its detached threads wait on it until exit
+static std::once_flag encoder_pool_flag;
+
 uint32_t PxStream::GetDataTypeSize(PixelDataType type)
 {
     uint32_t size = 0;
@@ -50,6 +103,8 @@ uint32_t PxStream::GetBitsPerPixel(PixelFormat format, PixelDataType type)
         case PixelFormat::DXT1:
             size = GetDataTypeSize(type) * 8 / 2;
             break;
+        case PixelFormat::EncodedImage: // variable size - decoded to RGBA by client
+            break;
     }
     return size;
 }
@@ -96,3 +151,571 @@ uint64_t PxStream::NToHLL(uint64_t val)
 #endif
 }
 
+
+void PxStream::PackFrameHeader(const FrameHeader& header, uint8_t buffer[PXSTREAM_FRAME_HEADER_SIZE])
+{
+    uint32_t net_payload_size = htonl(header.payload_size);
+    uint32_t net_frame_id = htonl(header.frame_id);
+    uint64_t net_timestamp = HToNLL(header.timestamp);
+    uint64_t net_checksum = HToNLL(header.checksum);
+    buffer[0] = header.flag;
+    buffer[1] = header.format;
+    buffer[2] = header.data_type;
+    buffer[3] = header.has_checksum ? 1 : 0;
+    memcpy(buffer + 4, &net_payload_size, 4);
+    memcpy(buffer + 8, &net_frame_id, 4);
+    buffer[12] = header.channel;
+    memset(buffer + 13, 0, 3);
+    memcpy(buffer + 16, &net_timestamp, 8);
+    memcpy(buffer + 24, &net_checksum, 8);
+}
+
+void PxStream::UnpackFrameHeader(const uint8_t buffer[PXSTREAM_FRAME_HEADER_SIZE], FrameHeader *header)
+{
+    uint32_t net_payload_size, net_frame_id;
+    uint64_t net_timestamp, net_checksum;
+    memcpy(&net_payload_size, buffer + 4, 4);
+    memcpy(&net_frame_id, buffer + 8, 4);
+    memcpy(&net_timestamp, buffer + 16, 8);
+    memcpy(&net_checksum, buffer + 24, 8);
+    header->flag = buffer[0];
+    header->format = (PixelFormat)buffer[1];
+    header->data_type = (PixelDataType)buffer[2];
+    header->has_checksum = (buffer[3] & 1) != 0;
+    header->channel = buffer[12];
+    header->payload_size = ntohl(net_payload_size);
+    header->frame_id = ntohl(net_frame_id);
+    header->checksum = NToHLL(net_checksum);
+    header->timestamp = NToHLL(net_timestamp);
+}
+
+uint64_t PxStream::GetTimestamp()
+{
+    // wall clock so server and client stamps are comparable (assumes synchronized hosts)
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void PxStream::SetImageDecoder(ImageDecoder decoder)
+{
+    image_decoder = decoder;
+}
+
+PxStream::ImageDecoder PxStream::GetImageDecoder()
+{
+    return image_decoder;
+}
+
+static uint16_t PackRgb565(const int color[3])
+{
+    return (uint16_t)(((color[0] >> 3) << 11) | ((color[1] >> 2) << 5) | (color[2] >> 3));
+}
+
+static void UnpackRgb565(uint16_t packed, int color[3])
+{
+    color[0] = ((packed >> 11) & 0x1F) * 255 / 31;
+    color[1] = ((packed >>  5) & 0x3F) * 255 / 63;
+    color[2] = ( packed        & 0x1F) * 255 / 31;
+}
+
+static void EncodeDxt1Block(const uint8_t *block_px[4], uint8_t *out)
+{
+    int i, j, k;
+    int min_color[3] = {255, 255, 255};
+    int max_color[3] = {0, 0, 0};
+    for (i = 0; i < 4; i++)
+    {
+        for (j = 0; j < 4; j++)
+        {
+            for (k = 0; k < 3; k++)
+            {
+                min_color[k] = std::min(min_color[k], (int)block_px[i][j * 4 + k]);
+                max_color[k] = std::max(max_color[k], (int)block_px[i][j * 4 + k]);
+            }
+        }
+    }
+    uint16_t c0 = PackRgb565(max_color);
+    uint16_t c1 = PackRgb565(min_color);
+    uint32_t indices = 0;
+    if (c0 < c1)
+    {
+        std::swap(c0, c1);
+    }
+    if (c0 != c1)
+    {
+        // 4-color mode (c0 > c1): p0, p1, 2/3 p0 + 1/3 p1, 1/3 p0 + 2/3 p1
+        int palette[4][3];
+        UnpackRgb565(c0, palette[0]);
+        UnpackRgb565(c1, palette[1]);
+        for (k = 0; k < 3; k++)
+        {
+            palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+            palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+        }
+        for (i = 0; i < 4; i++)
+        {
+            for (j = 0; j < 4; j++)
+            {
+                int best = 0;
+                int best_dist = INT32_MAX;
+                int p;
+                for (p = 0; p < 4; p++)
+                {
+                    int dist = 0;
+                    for (k = 0; k < 3; k++)
+                    {
+                        int d = (int)block_px[i][j * 4 + k] - palette[p][k];
+                        dist += d * d;
+                    }
+                    if (dist < best_dist)
+                    {
+                        best = p;
+                        best_dist = dist;
+                    }
+                }
+                indices |= (uint32_t)best << (2 * (4 * i + j));
+            }
+        }
+    }
+    out[0] = c0 & 0xFF;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xFF;
+    out[3] = c1 >> 8;
+    out[4] = indices & 0xFF;
+    out[5] = (indices >> 8) & 0xFF;
+    out[6] = (indices >> 16) & 0xFF;
+    out[7] = indices >> 24;
+}
+
+static void EncodeDxt1Rows(const uint8_t *rgba, uint32_t width, uint32_t height, uint8_t *dxt1, uint32_t block_row_start, uint32_t block_row_end)
+{
+    uint32_t bx, by, r;
+    const uint8_t *block_px[4];
+    for (by = block_row_start; by < block_row_end; by++)
+    {
+        for (bx = 0; bx < width / 4; bx++)
+        {
+            // output uses a bottom-left origin (same as .d1v video), so flip rows of the top-left RGBA image
+            for (r = 0; r < 4; r++)
+            {
+                block_px[r] = rgba + ((uint64_t)(height - 1 - (by * 4 + r)) * width + bx * 4) * 4;
+            }
+            EncodeDxt1Block(block_px, dxt1 + ((uint64_t)by * (width / 4) + bx) * 8);
+        }
+    }
+}
+
+static bool EncodeNextDxt1Band(std::unique_lock<std::mutex>& lock)
+{
+    // claims the next band of the current image (encoded outside the lock) - false once all are claimed
+    EncoderJob& current = encoder_pool->job;
+    if (current.next_row >= current.block_rows)
+    {
+        return false;
+    }
+    EncoderJob job = current;
+    uint32_t end = std::min(job.next_row + PXSTREAM_DXT1_BAND_ROWS, job.block_rows);
+    current.next_row = end;
+    lock.unlock();
+    EncodeDxt1Rows(job.rgba, job.width, job.height, job.dxt1, job.next_row, end);
+    lock.lock();
+    current.rows_done += end - job.next_row;
+    if (current.rows_done == current.block_rows)
+    {
+        encoder_pool->finished_condition.notify_all();
+    }
+    return true;
+}
+
+static void EncoderLoop()
+{
+    PxStream::ApplyThreadAffinity(PxStream::ThreadRole::EncoderThreads, -1);
+    std::unique_lock<std::mutex> lock(encoder_pool->mutex);
+    while (true)
+    {
+        if (!EncodeNextDxt1Band(lock))
+        {
+            encoder_pool->condition.wait(lock);
+        }
+    }
+}
+
+void PxStream::StartEncoderThreads()
+{
+    // process-wide and started once - the thread calling EncodeDxt1() works alongside the pool
+    std::call_once(encoder_pool_flag, []() {
+        encoder_pool = new EncoderPool();
+        encoder_pool->job = {NULL, 0, 0, NULL, 0, 0, 0};
+        uint32_t i;
+        for (i = 1; i < std::thread::hardware_concurrency(); i++)
+        {
+            std::thread(EncoderLoop).detach();
+        }
+    });
+}
+
+void PxStream::EncodeDxt1(const uint8_t *rgba, uint32_t width, uint32_t height, uint8_t *dxt1)
+{
+    StartEncoderThreads();
+    std::lock_guard<std::mutex> job_lock(encoder_pool->job_mutex);
+    std::unique_lock<std::mutex> lock(encoder_pool->mutex);
+    encoder_pool->job = {rgba, width, height, dxt1, height / 4, 0, 0};
+    encoder_pool->condition.notify_all();
+    while (EncodeNextDxt1Band(lock))
+    {
+    }
+    while (encoder_pool->job.rows_done < encoder_pool->job.block_rows)
+    {
+        encoder_pool->finished_condition.wait(lock);
+    }
+}
+
+void PxStream::SetPixelAllocator(PixelAllocateFunction allocate, PixelReleaseFunction release)
+{
+    // used for every frame pool, encode and receive buffer allocated afterwards (NULL restores the default) -
+    // buffers that are already allocated keep the release function they were allocated with
+    std::lock_guard<std::mutex> lock(pixel_mutex);
+    pixel_allocate = allocate ? allocate : PixelAllocateFunction(AllocateDefaultBuffer);
+    pixel_release = release ? release : PixelReleaseFunction(FreeDefaultBuffer);
+}
+
+void* PxStream::AllocatePixelBuffer(uint64_t size, int numa_node)
+{
+    std::unique_lock<std::mutex> lock(pixel_mutex);
+    PixelAllocateFunction allocate = pixel_allocate;
+    PixelReleaseFunction release = pixel_release;
+    lock.unlock();
+    void *buffer = allocate(size, numa_node);
+    if (buffer != NULL)
+    {
+        lock.lock();
+        pixel_buffers[buffer] = release;
+    }
+    return buffer;
+}
+
+void PxStream::FreePixelBuffer(void *buffer, uint64_t size)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(pixel_mutex);
+    auto it = pixel_buffers.find(buffer);
+    if (it == pixel_buffers.end())
+    {
+        fprintf(stderr, "PxStream> Warning: buffer was not allocated with AllocatePixelBuffer - not released\n");
+        return;
+    }
+    PixelReleaseFunction release = it->second;
+    pixel_buffers.erase(it);
+    lock.unlock();
+    release(buffer, size);
+}
+
+static void* AllocateDefaultBuffer(uint64_t size, int numa_node)
+{
+    // huge pages only for large buffers (frames, receive tiles) - small ones (e.g. recorder staging, small
+    // encode buffers) come from the heap, page aligned for O_DIRECT, zeroed by the calling thread
+    if (size >= PXSTREAM_HUGEPAGE_THRESHOLD)
+    {
+        return PxStream::AllocateHugePageBuffer(size, numa_node);
+    }
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, PXSTREAM_BUFFER_ALIGNMENT, std::max(size, (uint64_t)1)) != 0)
+    {
+        return NULL;
+    }
+    memset(buffer, 0, size);
+    return buffer;
+}
+
+static void FreeDefaultBuffer(void *buffer, uint64_t size)
+{
+    if (size >= PXSTREAM_HUGEPAGE_THRESHOLD)
+    {
+        PxStream::FreeHugePageBuffer(buffer, size);
+    }
+    else
+    {
+        free(buffer);
+    }
+}
+
+static uint64_t HugePageMapSize(uint64_t size)
+{
+    // round to huge page size so either mapping type can be released the same way
+    return std::max((size + PXSTREAM_HUGEPAGE_SIZE - 1) & ~(PXSTREAM_HUGEPAGE_SIZE - 1), PXSTREAM_HUGEPAGE_SIZE);
+}
+
+void* PxStream::AllocateHugePageBuffer(uint64_t size, int numa_node)
+{
+    // explicit huge pages if the system has any reserved, otherwise transparent huge pages (the default
+    // allocator's choice for large buffers)
+    uint64_t map_size = HugePageMapSize(size);
+    void *buffer = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    buffer = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (buffer == MAP_FAILED)
+    {
+        buffer = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+        {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(buffer, map_size, MADV_HUGEPAGE);
+#endif
+    }
+#ifdef SYS_mbind
+    if (numa_node >= 0 && numa_node < 1024)
+    {
+        // pages are placed on the node when first touched, whichever thread touches them
+        unsigned long node_mask[1024 / (8 * sizeof(unsigned long))] = {0};
+        node_mask[numa_node / (8 * sizeof(unsigned long))] = 1UL << (numa_node % (8 * sizeof(unsigned long)));
+        syscall(SYS_mbind, buffer, map_size, PXSTREAM_MPOL_PREFERRED, node_mask, 1024, 0);
+    }
+#endif
+    // without a node, first touch from the calling thread places pages on its NUMA node
+    memset(buffer, 0, size);
+    return buffer;
+}
+
+void PxStream::FreeHugePageBuffer(void *buffer, uint64_t size)
+{
+    munmap(buffer, HugePageMapSize(size));
+}
+
+int PxStream::GetNumaNodeCount()
+{
+    int count = 0;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir != NULL)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4]))
+            {
+                count++;
+            }
+        }
+        closedir(dir);
+    }
+    return std::max(count, 1);
+}
+
+int PxStream::GetInterfaceNumaNode(const char *iface)
+{
+    // -1 if unknown (virtual interfaces, single node machines, non-Linux systems)
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", iface);
+    FILE *file = fopen(path, "r");
+    int node = -1;
+    if (file != NULL)
+    {
+        if (fscanf(file, "%d", &node) != 1)
+        {
+            node = -1;
+        }
+        fclose(file);
+    }
+    return node;
+}
+
+int PxStream::GetAddressNumaNode(const char *ip_address)
+{
+    // NUMA node of the NIC that owns a local IPv4 address
+    struct in_addr address;
+    if (inet_aton(ip_address, &address) == 0)
+    {
+        return -1;
+    }
+    int node = -1;
+    struct ifaddrs *interfaces = NULL;
+    if (getifaddrs(&interfaces) == 0)
+    {
+        struct ifaddrs *temp_addr;
+        for (temp_addr = interfaces; temp_addr != NULL; temp_addr = temp_addr->ifa_next)
+        {
+            if (temp_addr->ifa_addr != NULL && temp_addr->ifa_addr->sa_family == AF_INET
+                && ((struct sockaddr_in*)temp_addr->ifa_addr)->sin_addr.s_addr == address.s_addr)
+            {
+                node = GetInterfaceNumaNode(temp_addr->ifa_name);
+                break;
+            }
+        }
+        freeifaddrs(interfaces);
+    }
+    return node;
+}
+
+static bool ParseCpuList(const char *list, cpu_set_t *cpus)
+{
+    // cpulist format, e.g. "0-7,16-23" - false if malformed or empty
+    CPU_ZERO(cpus);
+    const char *pos = list;
+    while (*pos != '\0' && *pos != '\n')
+    {
+        char *end;
+        long first = strtol(pos, &end, 10);
+        long last = first;
+        if (end == pos || first < 0)
+        {
+            return false;
+        }
+        pos = end;
+        if (*pos == '-')
+        {
+            last = strtol(pos + 1, &end, 10);
+            if (end == pos + 1 || last < first)
+            {
+                return false;
+            }
+            pos = end;
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++)
+        {
+            CPU_SET(first, cpus);
+        }
+        if (*pos == ',')
+        {
+            pos++;
+        }
+        else if (*pos != '\0' && *pos != '\n')
+        {
+            return false;
+        }
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+static std::string FormatCpuList(const cpu_set_t *cpus)
+{
+    std::string list;
+    int cpu = 0;
+    while (cpu < CPU_SETSIZE)
+    {
+        if (!CPU_ISSET(cpu, cpus))
+        {
+            cpu++;
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus))
+        {
+            last++;
+        }
+        list += (list.empty() ? "" : ",") + std::to_string(cpu) + ((last > cpu) ? "-" + std::to_string(last) : "");
+        cpu = last + 1;
+    }
+    return list;
+}
+
+static bool GetNumaNodeCpus(int numa_node, cpu_set_t *cpus)
+{
+    if (numa_node < 0)
+    {
+        return false;
+    }
+    char path[256];
+    char list[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", numa_node);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return false;
+    }
+    bool valid = fgets(list, sizeof(list), file) != NULL && ParseCpuList(list, cpus);
+    fclose(file);
+    return valid;
+}
+
+bool PxStream::BindThreadToNumaNode(int numa_node)
+{
+    // restricts the calling thread to the CPUs of `numa_node`
+    cpu_set_t cpus;
+    return GetNumaNodeCpus(numa_node, &cpus) && pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) == 0;
+}
+
+void PxStream::SetThreadAffinity(ThreadRole role, const char *cpus)
+{
+    // `cpus` is a cpulist ("2-3,6"), "nic" for the CPUs of the NIC's NUMA node, or "" to leave threads
+    // unpinned - overrides the environment, and applies to threads started afterwards
+    std::lock_guard<std::mutex> lock(affinity_mutex);
+    thread_affinity[role] = (cpus != NULL) ? cpus : "";
+    thread_affinity_set[role] = true;
+}
+
+std::string PxStream::GetThreadAffinity(ThreadRole role)
+{
+    std::lock_guard<std::mutex> lock(affinity_mutex);
+    if (!thread_affinity_set[role])
+    {
+        const char *env = getenv(thread_affinity_env[role]);
+        thread_affinity[role] = (env != NULL) ? env : "";
+        thread_affinity_set[role] = true;
+    }
+    return thread_affinity[role];
+}
+
+static bool ResolveThreadAffinity(PxStream::ThreadRole role, int numa_node, cpu_set_t *cpus)
+{
+    // readers default to the NIC's node, other threads are only pinned when asked to
+    std::string config = PxStream::GetThreadAffinity(role);
+    std::lock_guard<std::mutex> lock(affinity_mutex);
+    if (numa_node >= 0)
+    {
+        nic_numa_node = numa_node;
+    }
+    if (config == "nic" || (config.empty() && role == PxStream::ThreadRole::ReaderThreads))
+    {
+        return GetNumaNodeCpus(nic_numa_node, cpus);
+    }
+    if (!config.empty() && !ParseCpuList(config.c_str(), cpus))
+    {
+        fprintf(stderr, "PxStream> Warning: invalid %s CPU list '%s'\n", thread_role_name[role], config.c_str());
+        return false;
+    }
+    return !config.empty();
+}
+
+std::string PxStream::DescribeThreadAffinity(ThreadRole role, int numa_node)
+{
+    // e.g. "reader threads: cpus 0-7 (NIC node 0), main thread: cpus 0-63"
+    cpu_set_t cpus;
+    std::string description = std::string(thread_role_name[role]) + " threads: ";
+    if (ResolveThreadAffinity(role, numa_node, &cpus))
+    {
+        description += "cpus " + FormatCpuList(&cpus);
+    }
+    else
+    {
+        description += "unpinned";
+    }
+    if (numa_node >= 0)
+    {
+        description += " (NIC node " + std::to_string(numa_node) + ")";
+    }
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) == 0)
+    {
+        description += ", main thread: cpus " + FormatCpuList(&cpus);
+    }
+    return description;
+}
+
+bool PxStream::ApplyThreadAffinity(ThreadRole role, int numa_node)
+{
+    // called by library threads as they start - false if the thread stays unpinned
+    cpu_set_t cpus;
+    if (!ResolveThreadAffinity(role, numa_node, &cpus))
+    {
+        return false;
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0)
+    {
+        fprintf(stderr, "PxStream> Warning: could not pin %s thread to cpus %s\n", thread_role_name[role], FormatCpuList(&cpus).c_str());
+        return false;
+    }
+    return true;
+}
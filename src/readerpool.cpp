@@ -0,0 +1,246 @@
+#include "pxstream/readerpool.h"
+
+uint32_t PxStream::ReaderPool::_requested_threads = 0;
+int PxStream::ReaderPool::_requested_numa_node = -1;
+PxStream::ReaderPool* PxStream::ReaderPool::_instance = NULL;
+std::mutex PxStream::ReaderPool::_instance_mutex;
+
+PxStream::ReaderPool::ReaderPool(uint32_t num_threads, int numa_node) :
+    _next_id(0)
+{
+    uint32_t i;
+    for (i = 0; i < num_threads; i++)
+    {
+        Reader *reader = new Reader();
+        reader->num_connections = 0;
+        reader->numa_node = numa_node;
+        reader->stopping = false;
+        // readers sleep whenever nothing is active
+        reader->thread = std::thread(&PxStream::ReaderPool::ReadLoop, this, reader);
+        _readers.push_back(reader);
+    }
+}
+
+PxStream::ReaderPool::~ReaderPool()
+{
+    for (auto reader : _readers)
+    {
+        std::unique_lock<std::mutex> lock(reader->mutex);
+        reader->stopping = true;
+        lock.unlock();
+        reader->condition.notify_all();
+        reader->thread.join();
+        delete reader;
+    }
+}
+
+PxStream::ReaderPool* PxStream::ReaderPool::GetInstance(int numa_node)
+{
+    // `numa_node` (e.g. the NIC's node, from the first Client) places the readers unless SetNumaNode() was called
+    std::lock_guard<std::mutex> lock(_instance_mutex);
+    if (_instance == NULL)
+    {
+        uint32_t num_threads = _requested_threads;
+        if (num_threads == 0)
+        {
+            num_threads = std::max(1u, std::min(std::thread::hardware_concurrency() / 2, 8u));
+        }
+        _instance = new ReaderPool(num_threads, (_requested_numa_node >= 0) ? _requested_numa_node : numa_node);
+    }
+    return _instance;
+}
+
+bool PxStream::ReaderPool::Shutdown()
+{
+    // stops and joins the reader threads - only once every Client is destroyed (a later Client starts a new pool)
+    std::lock_guard<std::mutex> lock(_instance_mutex);
+    if (_instance == NULL)
+    {
+        return true;
+    }
+    std::unique_lock<std::mutex> pool_lock(_instance->_mutex);
+    if (!_instance->_registrations.empty())
+    {
+        fprintf(stderr, "PxStream::ReaderPool> Warning: cannot shut down while connections are registered\n");
+        return false;
+    }
+    pool_lock.unlock();
+    delete _instance;
+    _instance = NULL;
+    return true;
+}
+
+void PxStream::ReaderPool::SetThreadCount(uint32_t count)
+{
+    // only takes effect if called before the first Client is created
+    _requested_threads = count;
+}
+
+void PxStream::ReaderPool::SetNumaNode(int numa_node)
+{
+    // only takes effect if called before the first Client is created
+    _requested_numa_node = numa_node;
+}
+
+uint32_t PxStream::ReaderPool::GetThreadCount()
+{
+    return _readers.size();
+}
+
+int PxStream::ReaderPool::GetNumaNode()
+{
+    return _readers.empty() ? -1 : _readers[0]->numa_node;
+}
+
+int PxStream::ReaderPool::Register(NetSocket::Client *client, EventHandler handler, CompletionHandler complete, bool busy_poll)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::shared_ptr<Registration> registration = std::make_shared<Registration>();
+    registration->client = client;
+    registration->handler = handler;
+    registration->complete = complete;
+    registration->busy_poll = busy_poll;
+    registration->active = false;
+    registration->removed = false;
+    registration->closed = false;
+    // connections go to the least loaded reader
+    int i;
+    registration->reader = 0;
+    for (i = 1; i < _readers.size(); i++)
+    {
+        if (_readers[i]->num_connections < _readers[registration->reader]->num_connections)
+        {
+            registration->reader = i;
+        }
+    }
+    _readers[registration->reader]->num_connections++;
+    int id = _next_id++;
+    _registrations[id] = registration;
+    return id;
+}
+
+void PxStream::ReaderPool::Unregister(int id)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto it = _registrations.find(id);
+    if (it == _registrations.end())
+    {
+        return;
+    }
+    std::shared_ptr<Registration> registration = it->second;
+    _registrations.erase(it);
+    Reader *reader = _readers[registration->reader];
+    reader->num_connections--;
+    lock.unlock();
+
+    // once removed is set (under the registration's lock) no handler is running or will run again
+    std::lock_guard<std::mutex> registration_lock(registration->mutex);
+    registration->removed = true;
+    Deactivate(reader, registration);
+}
+
+void PxStream::ReaderPool::Activate(int id)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto it = _registrations.find(id);
+    if (it == _registrations.end())
+    {
+        return;
+    }
+    std::shared_ptr<Registration> registration = it->second;
+    Reader *reader = _readers[registration->reader];
+    lock.unlock();
+
+    std::unique_lock<std::mutex> registration_lock(registration->mutex);
+    if (registration->closed)
+    {
+        // the server is gone - nothing more will arrive
+        registration_lock.unlock();
+        registration->complete();
+        return;
+    }
+    std::lock_guard<std::mutex> reader_lock(reader->mutex);
+    if (!registration->active)
+    {
+        registration->active = true;
+        reader->active.push_back(registration);
+        reader->condition.notify_one();
+    }
+}
+
+void PxStream::ReaderPool::Deactivate(Reader *reader, const std::shared_ptr<Registration>& registration)
+{
+    std::lock_guard<std::mutex> reader_lock(reader->mutex);
+    if (registration->active)
+    {
+        registration->active = false;
+        reader->active.erase(std::find(reader->active.begin(), reader->active.end(), registration));
+    }
+}
+
+void PxStream::ReaderPool::ReadLoop(Reader *reader)
+{
+    std::vector<std::shared_ptr<Registration>> active;
+    uint32_t idle_passes = 0;
+    PxStream::ApplyThreadAffinity(PxStream::ThreadRole::ReaderThreads, reader->numa_node);
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(reader->mutex);
+        reader->condition.wait(lock, [reader]() { return !reader->active.empty() || reader->stopping; });
+        if (reader->stopping)
+        {
+            break;
+        }
+        active = reader->active;
+        lock.unlock();
+
+        bool progress = false;
+        bool busy_poll = false;
+        for (auto& registration : active)
+        {
+            bool complete = false;
+            busy_poll = busy_poll || registration->busy_poll;
+            std::unique_lock<std::mutex> registration_lock(registration->mutex);
+            // drain whatever has already arrived on this connection
+            while (!registration->removed && !complete)
+            {
+                NetSocket::Client::Event event = registration->client->PollForNextEvent();
+                if (event.type == NetSocket::Client::EventType::None)
+                {
+                    break;
+                }
+                progress = true;
+                if (event.type == NetSocket::Client::EventType::ReceiveBinary)
+                {
+                    complete = registration->handler(event);
+                }
+                else if (event.type == NetSocket::Client::EventType::Disconnect)
+                {
+                    registration->closed = true;
+                    registration->handler(event);
+                    complete = true;
+                }
+            }
+            if (complete)
+            {
+                // deactivate before reporting completion, so the owner can immediately request the next read
+                Deactivate(reader, registration);
+                registration_lock.unlock();
+                registration->complete();
+            }
+        }
+        active.clear();
+
+        // spin briefly for low latency, then back off so idle streams do not burn a core
+        // (unless a low latency stream is waiting on this reader)
+        idle_passes = progress ? 0 : idle_passes + 1;
+        if (idle_passes > PXSTREAM_READER_SPIN_PASSES && !busy_poll)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(PXSTREAM_READER_IDLE_SLEEP_US));
+        }
+        else if (idle_passes > 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+}
@@ -0,0 +1,246 @@
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include "pxstream/recorder.h"
+
+static uint64_t AlignUp(uint64_t value)
+{
+    return (value + PXSTREAM_RECORDING_ALIGNMENT - 1) & ~((uint64_t)PXSTREAM_RECORDING_ALIGNMENT - 1);
+}
+
+PxStream::Recorder::Recorder(const char *filename, const RecordingHeader& header) :
+    _fd(-1),
+    _direct_io(false),
+    _header(header),
+    _write_offset(PXSTREAM_RECORDING_ALIGNMENT),
+    _staging(NULL),
+    _staging_size(0),
+    _dropped_frames(0),
+    _closing(false),
+    _staging_done(false)
+{
+    _header.magic = PXSTREAM_RECORDING_MAGIC;
+    _header.version = PXSTREAM_RECORDING_VERSION;
+    _header.frame_count = 0;
+    _header.index_offset = 0;
+
+    // prefer O_DIRECT (bypasses page cache), fall back to buffered I/O where unsupported (e.g. tmpfs)
+#ifdef O_DIRECT
+    _fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    _direct_io = _fd >= 0;
+#endif
+    if (_fd < 0)
+    {
+        _fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (_fd < 0)
+    {
+        fprintf(stderr, "PxStream::Recorder> Warning: cannot open %s for recording (%s)\n", filename, strerror(errno));
+        return;
+    }
+    int i;
+    for (i = 0; i < PXSTREAM_RECORDING_STAGING_SLOTS; i++)
+    {
+        _slots[i].buffer = NULL;
+        _slots[i].size = 0;
+        _free_slots.push_back(i);
+    }
+    _io_thread = std::thread(&PxStream::Recorder::IoLoop, this);
+    _write_thread = std::thread(&PxStream::Recorder::WriteLoop, this);
+}
+
+PxStream::Recorder::~Recorder()
+{
+    Close();
+    if (_staging != NULL)
+    {
+        PxStream::FreePixelBuffer(_staging, _staging_size);
+    }
+    int i;
+    for (i = 0; i < PXSTREAM_RECORDING_STAGING_SLOTS; i++)
+    {
+        PxStream::FreePixelBuffer(_slots[i].buffer, _slots[i].size);
+    }
+}
+
+bool PxStream::Recorder::IsOpen()
+{
+    return _fd >= 0;
+}
+
+void PxStream::Recorder::Record(const void *data, uint32_t size, PixelFormat format, PixelDataType type, uint64_t frame_id, ReleaseCallback release_callback)
+{
+    uint64_t timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    PendingRecord record = {data, {0, size, format, type, 0, frame_id, timestamp}, release_callback};
+    std::unique_lock<std::mutex> lock(_queue_mutex);
+    if (_fd < 0 || _closing)
+    {
+        lock.unlock();
+        release_callback(data);
+        return;
+    }
+    _queue.push_back(record);
+    lock.unlock();
+    _queue_condition.notify_all();
+}
+
+void PxStream::Recorder::Close()
+{
+    std::unique_lock<std::mutex> lock(_queue_mutex);
+    if (_fd < 0 || _closing)
+    {
+        return;
+    }
+    _closing = true;
+    lock.unlock();
+    _queue_condition.notify_all();
+    _io_thread.join();
+    _write_thread.join();
+    if (_dropped_frames > 0)
+    {
+        fprintf(stderr, "PxStream::Recorder> Warning: %llu frames were not recorded (disk could not keep up)\n", (unsigned long long)_dropped_frames);
+    }
+
+    // index goes after the last frame, then the header is rewritten with its location
+    uint64_t index_size = _index.size() * sizeof(RecordingIndexEntry);
+    uint8_t *staging = StagingBuffer(AlignUp(std::max(index_size, (uint64_t)sizeof(RecordingHeader))));
+    memset(staging, 0, AlignUp(index_size));
+    memcpy(staging, _index.data(), index_size);
+    _header.frame_count = _index.size();
+    _header.index_offset = _write_offset;
+    bool success = WriteAligned(staging, AlignUp(index_size), _write_offset);
+    memset(staging, 0, PXSTREAM_RECORDING_ALIGNMENT);
+    memcpy(staging, &_header, sizeof(RecordingHeader));
+    success = success && WriteAligned(staging, PXSTREAM_RECORDING_ALIGNMENT, 0);
+    if (!success)
+    {
+        fprintf(stderr, "PxStream::Recorder> Warning: failed to write recording index (%s)\n", strerror(errno));
+    }
+    close(_fd);
+    _fd = -1;
+}
+
+// Private
+void PxStream::Recorder::IoLoop()
+{
+    std::unique_lock<std::mutex> lock(_queue_mutex);
+    while (true)
+    {
+        while (_queue.empty() && !_closing)
+        {
+            _queue_condition.wait(lock);
+        }
+        if (_queue.empty())
+        {
+            break;
+        }
+        PendingRecord record = _queue.front();
+        _queue.pop_front();
+        if (_free_slots.empty())
+        {
+            // writer is a full ring behind - drop the frame rather than hold it until a slot frees up
+            _dropped_frames++;
+            lock.unlock();
+            record.release_callback(record.data);
+            lock.lock();
+            continue;
+        }
+        int slot = _free_slots.front();
+        _free_slots.pop_front();
+        lock.unlock();
+
+        // stage into an aligned slot so the frame can be handed back before the (slow) write
+        StagingSlot& staging = _slots[slot];
+        uint64_t padded_size = AlignUp(record.entry.size);
+        if (padded_size > staging.size)
+        {
+            PxStream::FreePixelBuffer(staging.buffer, staging.size);
+            staging.size = padded_size;
+            staging.buffer = reinterpret_cast<uint8_t*>(PxStream::AllocatePixelBuffer(staging.size));
+        }
+        memcpy(staging.buffer, record.data, record.entry.size);
+        memset(staging.buffer + record.entry.size, 0, padded_size - record.entry.size);
+        record.release_callback(record.data);
+        staging.entry = record.entry;
+
+        lock.lock();
+        _staged_slots.push_back(slot);
+        _write_condition.notify_all();
+    }
+    _staging_done = true;
+    _write_condition.notify_all();
+}
+
+void PxStream::Recorder::WriteLoop()
+{
+    // writes staged slots in order - the index only lists frames that reached the disk
+    std::unique_lock<std::mutex> lock(_queue_mutex);
+    while (true)
+    {
+        while (_staged_slots.empty() && !_staging_done)
+        {
+            _write_condition.wait(lock);
+        }
+        if (_staged_slots.empty())
+        {
+            break;
+        }
+        int slot = _staged_slots.front();
+        _staged_slots.pop_front();
+        lock.unlock();
+
+        StagingSlot& staging = _slots[slot];
+        uint64_t padded_size = AlignUp(staging.entry.size);
+        staging.entry.offset = _write_offset;
+        if (WriteAligned(staging.buffer, padded_size, _write_offset))
+        {
+            _index.push_back(staging.entry);
+            _write_offset += padded_size;
+        }
+        else
+        {
+            fprintf(stderr, "PxStream::Recorder> Warning: failed to write frame %llu (%s)\n", (unsigned long long)staging.entry.frame_id, strerror(errno));
+        }
+
+        lock.lock();
+        _free_slots.push_back(slot);
+    }
+}
+
+uint8_t* PxStream::Recorder::StagingBuffer(uint64_t size)
+{
+    if (size > _staging_size)
+    {
+        if (_staging != NULL)
+        {
+            PxStream::FreePixelBuffer(_staging, _staging_size);
+        }
+        _staging_size = size;
+        _staging = reinterpret_cast<uint8_t*>(PxStream::AllocatePixelBuffer(_staging_size));
+    }
+    return _staging;
+}
+
+bool PxStream::Recorder::WriteAligned(const void *data, uint64_t size, uint64_t offset)
+{
+    uint64_t written = 0;
+    while (written < size)
+    {
+        ssize_t rc = pwrite(_fd, reinterpret_cast<const uint8_t*>(data) + written, size - written, offset + written);
+        if (rc < 0 && errno == EINVAL && _direct_io)
+        {
+            // file system accepted O_DIRECT at open but not for this write - continue buffered
+#ifdef O_DIRECT
+            fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) & ~O_DIRECT);
+#endif
+            _direct_io = false;
+            continue;
+        }
+        if (rc <= 0)
+        {
+            return false;
+        }
+        written += rc;
+    }
+    return true;
+}
@@ -1,6 +1,7 @@
+#include <climits>
 #include "pxstream/server.h"
 
-PxStream::Server::Server(const char *iface, uint16_t port_min, uint16_t port_max, MPI_Comm comm) :
+PxStream::Server::Server(const char *iface, uint16_t port_min, uint16_t port_max, MPI_Comm comm, TransportProfile profile) :
     _num_connections(0),
     _ip_address_list(NULL),
     _port_list(NULL),
@@ -12,7 +13,34 @@ PxStream::Server::Server(const char *iface, uint16_t port_min, uint16_t port_max
     _local_offset_x(0),
     _local_offset_y(0),
     _px_format(PixelFormat::RGBA),
-    _px_data_type(PixelDataType::Uint8)
+    _px_data_type(PixelDataType::Uint8),
+    _finalizing(false),
+    _event_stop(false),
+    _finished_count(0),
+    _numa_node(-1),
+    _frame_pool_size(3),
+    _frame_pool_slot_size(0),
+    _frame_interval(0.0),
+    _bit_rate(0),
+    _connection_bit_rate(0),
+    _send_chunk_size(0),
+    _send_busy(false),
+    _send_done(false),
+    _adaptive_interval(0.0),
+    _adaptive_level(0),
+    _degrade_count(0),
+    _upgrade_count(0),
+    _frame_latency(0.0),
+    _balance_interval(0),
+    _render_time(0.0),
+    _composite_op(CompositeOperator::NoComposite),
+    _composite_vrank(0),
+    _composite_vranks(1),
+    _composite_row_type(MPI_DATATYPE_NULL),
+    _composite_depth_row_type(MPI_DATATYPE_NULL),
+    _frame_id(0),
+    _frame_checksums(false),
+    _recorder(NULL)
 {
     MPI_Comm_dup(comm, &_comm);
     int rc = MPI_Comm_rank(_comm, &_rank);
@@ -22,11 +50,32 @@ PxStream::Server::Server(const char *iface, uint16_t port_min, uint16_t port_max
         MPI_Abort(_comm, 1);
     }
 
-    // Initialize NetSocket server options 
+    // Initialize NetSocket server options and send pipeline for the transport profile
+    // (SetSendChunkSize / SetFramePoolSize still override the profile's choices)
     NetSocket::ServerOptions options = NetSocket::CreateServerOptions();
     options.flags = NetSocket::GeneralFlags::TcpNoDelay;
-    //options.send_buf_size = 2097152;//16777216;
-    //options.recv_buf_size =  262144;
+    switch (profile)
+    {
+        case TransportProfile::LowLatency:
+            _send_chunk_size = PXSTREAM_LOW_LATENCY_CHUNK_SIZE;
+            _frame_pool_size = 1;
+            break;
+        case TransportProfile::HighThroughput:
+            // header and payload may share segments
+            options.flags = NetSocket::GeneralFlags::None;
+            options.send_buf_size = PXSTREAM_HIGH_THROUGHPUT_SOCKET_BUFFER;
+            _frame_pool_size = PXSTREAM_HIGH_THROUGHPUT_PIPELINE_DEPTH;
+            break;
+        default:
+            break;
+    }
+    // clients size their receive buffers to the measured bandwidth-delay product - the send side is
+    // left to the OS unless given explicitly (PXSTREAM_SEND_BUFFER=<bytes>)
+    const char *send_buffer = getenv("PXSTREAM_SEND_BUFFER");
+    if (send_buffer != NULL)
+    {
+        options.send_buf_size = atoi(send_buffer);
+    }
     // Pick a random open port between `port_min` and `port_max`
     int i;
     int num_ports = port_max - port_min + 1;
@@ -59,6 +108,8 @@ PxStream::Server::Server(const char *iface, uint16_t port_min, uint16_t port_max
     // Gather IP address and port information for each rank on rank 0
     uint8_t ip_address[4];
     GetIpAddress(iface, ip_address);
+    // frame buffers are placed on the NIC's NUMA node
+    _numa_node = PxStream::GetInterfaceNumaNode(iface);
     uint16_t net_port = htons(_port);
     if (_rank == 0)
     {
@@ -83,11 +134,48 @@ PxStream::Server::Server(const char *iface, uint16_t port_min, uint16_t port_max
     {
         fprintf(stderr, "PxStream::Server> Warning: machine does not appear to use IEEE 754 floating point format\n");
     }
+
+    // Pipe used to signal released frame buffers (read end is pollable by the application)
+    if (pipe(_release_fd) != 0)
+    {
+        fprintf(stderr, "PxStream::Server> Error: could not create frame release notification pipe\n");
+        MPI_Abort(_comm, 1);
+    }
+    fcntl(_release_fd[0], F_SETFL, fcntl(_release_fd[0], F_GETFL) | O_NONBLOCK);
+
+    // Pipe used to signal client messages (e.g. input events)
+    if (pipe(_message_fd) != 0)
+    {
+        fprintf(stderr, "PxStream::Server> Error: could not create client message notification pipe\n");
+        MPI_Abort(_comm, 1);
+    }
+    fcntl(_message_fd[0], F_SETFL, fcntl(_message_fd[0], F_GETFL) | O_NONBLOCK);
 }
 
 PxStream::Server::~Server()
 {
-    // TODO: stop server
+    // without Finalize() - queued frames are dropped, and the threads are stopped before anything they use goes away
+    StopRecording();
+    StopSendThread(false);
+    StopEventThread();
+    for (auto frame : _frame_pool)
+    {
+        PxStream::FreePixelBuffer(frame, _frame_pool_slot_size);
+    }
+    for (auto buffer : _encode_pool)
+    {
+        PxStream::FreePixelBuffer(buffer, _local_width * _local_height / 2);
+    }
+    int finalized;
+    MPI_Finalized(&finalized);
+    if (!finalized && _composite_row_type != MPI_DATATYPE_NULL)
+    {
+        MPI_Type_free(&_composite_row_type);
+    }
+    if (!finalized && _composite_depth_row_type != MPI_DATATYPE_NULL)
+    {
+        MPI_Type_free(&_composite_depth_row_type);
+    }
 }
 
 void PxStream::Server::GetMasterIpAddress(char *addr)
@@ -118,11 +206,85 @@ void PxStream::Server::GetMasterPort(uint16_t *port)
 void PxStream::Server::Listen(StreamBehavior behavior, uint32_t initial_wait_count)
 {
     _stream_behavior = behavior;
-    _pixel_size = (uint32_t)(_local_width * _local_height * (double)PxStream::GetBitsPerPixel(_px_format, _px_data_type) / 8.0);
-    memcpy(_connect_header +  0, &_local_width,    4);
-    memcpy(_connect_header +  4, &_local_height,   4);
-    memcpy(_connect_header +  8, &_local_offset_x, 4);
-    memcpy(_connect_header + 12, &_local_offset_y, 4);
+    if (_composite_op != CompositeOperator::NoComposite)
+    {
+        SetupCompositing();
+        _regions.clear();
+    }
+    if (_regions.empty())
+    {
+        // SetLocalImageSize / SetLocalImageOffset describe a single region
+        _regions.push_back({_local_width, _local_height, _local_offset_x, _local_offset_y, 0});
+    }
+    if (_regions.size() == 1)
+    {
+        _local_width = _regions[0].width;
+        _local_height = _regions[0].height;
+        _local_offset_x = _regions[0].offset_x;
+        _local_offset_y = _regions[0].offset_y;
+    }
+    else if (_adaptive_interval > 0.0)
+    {
+        fprintf(stderr, "PxStream::Server> Warning: adaptive format requires a single local image region\n");
+        _adaptive_interval = 0.0;
+    }
+    if (_balance_interval > 0 && (_regions.size() > 1 || _composite_op != CompositeOperator::NoComposite))
+    {
+        fprintf(stderr, "PxStream::Server> Warning: load balancing requires a single local image region (and no compositing)\n");
+        _balance_interval = 0;
+    }
+    if (_balance_interval > 0 && _adaptive_interval > 0.0)
+    {
+        fprintf(stderr, "PxStream::Server> Warning: adaptive format is not supported with load balancing\n");
+        _adaptive_interval = 0.0;
+    }
+    if (_adaptive_interval > 0.0)
+    {
+        // only uncompressed 8-bit RGBA can currently fall back to DXT1 - all ranks must agree, since the level is voted on
+        int local_ok = (_px_format == PixelFormat::RGBA && _px_data_type == PixelDataType::Uint8 && _local_width % 4 == 0 && _local_height % 4 == 0) ? 1 : 0;
+        int all_ok;
+        MPI_Allreduce(&local_ok, &all_ok, 1, MPI_INT, MPI_MIN, _comm);
+        if (!all_ok)
+        {
+            if (_rank == 0)
+            {
+                fprintf(stderr, "PxStream::Server> Warning: adaptive format requires Uint8 RGBA images with dimensions divisible by 4\n");
+            }
+            _adaptive_interval = 0.0;
+        }
+        else
+        {
+            PxStream::StartEncoderThreads();
+        }
+    }
+    BuildConnectHeader();
+    if (_rank == 0)
+    {
+        // everything a client needs to start is sent as one message:
+        // endianness, format, data type, channel count, global width, global height, rank count, ip addresses, ports,
+        // then for each channel: format, data type, name length, name
+        uint32_t net_global_w = htonl(_global_width);
+        uint32_t net_global_h = htonl(_global_height);
+        uint32_t net_num_ranks = htonl(_num_ranks);
+        _server_info.resize(PXSTREAM_SERVER_INFO_HEADER_SIZE + _num_ranks * 6);
+        _server_info[0] = _endianness;
+        _server_info[1] = _px_format;
+        _server_info[2] = _px_data_type;
+        _server_info[3] = 1 + _channels.size();
+        memcpy(_server_info.data() + 4, &net_global_w, 4);
+        memcpy(_server_info.data() + 8, &net_global_h, 4);
+        memcpy(_server_info.data() + 12, &net_num_ranks, 4);
+        memcpy(_server_info.data() + PXSTREAM_SERVER_INFO_HEADER_SIZE, _ip_address_list, 4 * _num_ranks);
+        memcpy(_server_info.data() + PXSTREAM_SERVER_INFO_HEADER_SIZE + 4 * _num_ranks, _port_list, 2 * _num_ranks);
+        std::string primary_name = PXSTREAM_PRIMARY_CHANNEL_NAME;
+        _server_info.insert(_server_info.end(), {(uint8_t)_px_format, (uint8_t)_px_data_type, (uint8_t)primary_name.size()});
+        _server_info.insert(_server_info.end(), primary_name.begin(), primary_name.end());
+        for (auto& channel : _channels)
+        {
+            _server_info.insert(_server_info.end(), {(uint8_t)channel.format, (uint8_t)channel.data_type, (uint8_t)channel.name.size()});
+            _server_info.insert(_server_info.end(), channel.name.begin(), channel.name.end());
+        }
+    }
     while (_num_connections < initial_wait_count)
     {
         NetSocket::Server::Event event = _server->WaitForNextEvent();
@@ -139,6 +301,14 @@ void PxStream::Server::Listen(StreamBehavior behavior, uint32_t initial_wait_cou
             }
         }
     }
+
+    // all further events (late connections, send completions, acks) are handled asynchronously
+    printf("PxStream::Server> [rank %d] %s\n", _rank, PxStream::DescribeThreadAffinity(PxStream::ThreadRole::SenderThreads, _numa_node).c_str());
+    if (!PxStream::GetThreadAffinity(PxStream::ThreadRole::EncoderThreads).empty())
+    {
+        printf("PxStream::Server> [rank %d] %s\n", _rank, PxStream::DescribeThreadAffinity(PxStream::ThreadRole::EncoderThreads, _numa_node).c_str());
+    }
+    _event_thread = std::thread(&PxStream::Server::EventLoop, this);
 }
 
 void PxStream::Server::SetImageFormat(PixelFormat format, PixelDataType type)
@@ -165,185 +335,1446 @@ void PxStream::Server::SetLocalImageOffset(uint32_t x, uint32_t y)
     _local_offset_y = y;
 }
 
+void PxStream::Server::AddLocalImageRegion(uint32_t width, uint32_t height, uint32_t x, uint32_t y, int32_t priority)
+{
+    // a rank may own any number of regions of any size - frames hold them back to back in the order added.
+    // Where regions (of any ranks) overlap, clients take the pixels from the highest priority region
+    // (equal priorities: lowest server rank, then the region added first)
+    _regions.push_back({width, height, x, y, priority});
+}
+
+void PxStream::Server::GetLocalImageSize(uint32_t *width, uint32_t *height)
+{
+    *width = _local_width;
+    *height = _local_height;
+}
+
+void PxStream::Server::GetLocalImageOffset(uint32_t *x, uint32_t *y)
+{
+    *x = _local_offset_x;
+    *y = _local_offset_y;
+}
+
 void PxStream::Server::SetFrameImage(void *data)
 {
     _pixels = data;
 }
 
-void PxStream::Server::Write()
+int PxStream::Server::AddChannel(const char *name, PixelFormat format, PixelDataType type)
+{
+    // must be called before Listen() - clients subscribe by name during the handshake
+    if (1 + _channels.size() >= PXSTREAM_MAX_CHANNELS || strlen(name) > 255)
+    {
+        fprintf(stderr, "PxStream::Server> Warning: cannot add channel '%s'\n", name);
+        return -1;
+    }
+    _channels.push_back({std::string(name), format, type, 0, NULL});
+    return _channels.size();
+}
+
+int PxStream::Server::GetChannelCount()
+{
+    return 1 + _channels.size();
+}
+
+void PxStream::Server::SetChannelImage(int channel, void *data)
+{
+    if (channel == 0)
+    {
+        _pixels = data;
+    }
+    else if (channel > 0 && channel <= _channels.size())
+    {
+        _channels[channel - 1].pixels = data;
+    }
+}
+
+void PxStream::Server::SetFrameRateLimit(double fps)
+{
+    _frame_interval = (fps > 0.0) ? 1.0 / fps : 0.0;
+}
+
+void PxStream::Server::SetBitRateLimit(uint64_t bits_per_second)
 {
-    uint8_t next_frame_flag = 1;
+    std::lock_guard<std::mutex> lock(_event_mutex);
+    _bit_rate = bits_per_second;
+    InitTokenBucket(_send_bucket, _bit_rate);
+}
+
+void PxStream::Server::SetConnectionBitRateLimit(uint64_t bits_per_second)
+{
+    std::lock_guard<std::mutex> lock(_event_mutex);
+    _connection_bit_rate = bits_per_second;
     for (auto& c : _connections)
     {
-        c.second.client->Send(&next_frame_flag, 1, NetSocket::CopyMode::MemCopy);
-        c.second.client->Send(_pixels, _pixel_size, NetSocket::CopyMode::ZeroCopy);
-        c.second.ready_to_advance = false;
+        InitTokenBucket(*(c.second.bucket), _connection_bit_rate);
     }
 }
 
-void PxStream::Server::AdvanceToNextFrame()
+void PxStream::Server::SetSendChunkSize(uint32_t bytes)
 {
-    if (_stream_behavior == StreamBehavior::WaitForAll)
+    _send_chunk_size = bytes;
+}
+
+void PxStream::Server::SetFrameChecksums(bool enable)
+{
+    // clients can verify each payload end-to-end (costs one pass over every frame on submit)
+    _frame_checksums = enable;
+}
+
+void PxStream::Server::SetCompositing(CompositeOperator op)
+{
+    // every rank renders the full global image - CompositeFrame() merges them and each rank streams one
+    // horizontal strip (local image size / offset are assigned in Listen)
+    _composite_op = op;
+}
+
+void PxStream::Server::SetLoadBalancing(uint32_t interval_frames)
+{
+    // every `interval_frames` frames, SubmitFrame() re-tiles the global image into full-width strips that
+    // equalize each rank's render + send time (0 disables). The local image size / offset may then change
+    // after any SubmitFrame() - the application renders the next frame into the new tile
+    _balance_interval = interval_frames;
+}
+
+void PxStream::Server::SetFrameRenderTime(double seconds)
+{
+    // time this rank spent rendering the frame about to be submitted
+    _render_time = (_render_time == 0.0) ? seconds : 0.8 * _render_time + 0.2 * seconds;
+}
+
+void PxStream::Server::SetAdaptiveFormat(double target_fps)
+{
+    // image format and size are checked in Listen()
+    _adaptive_interval = (target_fps > 0.0) ? 1.0 / target_fps : 0.0;
+    _adaptive_level = 0;
+    _degrade_count = 0;
+    _upgrade_count = 0;
+}
+
+bool PxStream::Server::StartRecording(const char *filename)
+{
+    // each rank writes its own segment: <base>_r<rank><ext> (same naming as .d1v input)
+    std::string name = std::string(filename);
+    size_t pos = name.rfind(".");
+    std::string base = (pos == std::string::npos) ? name : name.substr(0, pos);
+    std::string extension = (pos == std::string::npos) ? ".pxr" : name.substr(pos);
+    char segment_name[512];
+    snprintf(segment_name, 512, "%s_r%02d%s", base.c_str(), _rank, extension.c_str());
+
+    if (_regions.size() > 1 || _balance_interval > 0)
+    {
+        fprintf(stderr, "PxStream::Server> Warning: recordings support a single, fixed local image region\n");
+        return false;
+    }
+    StopRecording();
+    RecordingHeader header;
+    memset(&header, 0, sizeof(RecordingHeader));
+    header.global_width = _global_width;
+    header.global_height = _global_height;
+    ImageRegion region = _regions.empty() ? ImageRegion({_local_width, _local_height, _local_offset_x, _local_offset_y, 0}) : _regions[0];
+    header.local_width = region.width;
+    header.local_height = region.height;
+    header.local_offset_x = region.offset_x;
+    header.local_offset_y = region.offset_y;
+    header.rank = _rank;
+    header.num_ranks = _num_ranks;
+    header.format = _px_format;
+    header.data_type = _px_data_type;
+    header.endianness = _endianness;
+    Recorder *recorder = new Recorder(segment_name, header);
+    if (!recorder->IsOpen())
+    {
+        delete recorder;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(_event_mutex);
+    _recorder = recorder;
+    return true;
+}
+
+void PxStream::Server::StopRecording()
+{
+    std::unique_lock<std::mutex> lock(_event_mutex);
+    Recorder *recorder = _recorder;
+    _recorder = NULL;
+    lock.unlock();
+    if (recorder != NULL)
+    {
+        // flushes queued frames (releasing them) and writes the index
+        recorder->Close();
+        delete recorder;
+    }
+}
+
+void PxStream::Server::Write()
+{
+    // auxiliary channels go first - the primary image completes the frame
+    int i;
+    for (i = 0; i < _channels.size(); i++)
+    {
+        SubmitChannelFrame(i + 1, _channels[i].pixels, [](void *buffer) {});
+    }
+    SubmitFrame(_pixels, [](void *buffer) {});
+}
+
+void PxStream::Server::SubmitFrame(void *buffer, ReleaseCallback release_callback)
+{
+    if (_adaptive_interval > 0.0)
     {
-        uint32_t ready_count = 0;
-        std::string event_client_id;
-        while (ready_count < _connections.size())
+        UpdateAdaptiveLevel();
+        if (_adaptive_level > 0)
         {
-            NetSocket::Server::Event event = _server->WaitForNextEvent();
-            if (event.type != NetSocket::Server::EventType::None)
+            // encode into a library-owned buffer - caller's buffer is free as soon as encoding is done
+            uint8_t *encoded = reinterpret_cast<uint8_t*>(AcquireEncodeBuffer());
+            PxStream::EncodeDxt1(reinterpret_cast<uint8_t*>(buffer), _local_width, _local_height, encoded);
+            std::unique_lock<std::mutex> lock(_event_mutex);
+            InFlightFrame& frame = _in_flight_frames[buffer];
+            frame.callbacks.push_back(release_callback);
+            if (frame.pending_sends == 0)
             {
-                event_client_id = event.client->Endpoint();
-            }
-            if (!HandleNewConnection(event))
-            {
-                switch (event.type)
-                {
-                    //case NetSocket::Server::EventType::ReceiveBinary:
-                    //    if (_connections[event_client_id].state == ClientState::Streaming
-                    //        && event.data_length == 1
-                    //        && reinterpret_cast<uint8_t*>(event.binary_data)[0] == 255)
-                    case NetSocket::Server::EventType::SendFinished:
-                        if (event.binary_data == _pixels)
-                        {
-                            ready_count++;
-                        }
-                    //    delete[] reinterpret_cast<uint8_t*>(event.binary_data);
-                        break;
-                    default:
-                        break;
-                }
+                ReleaseFrame(buffer, lock);
             }
+            lock.unlock();
+            SendFrame(encoded, 0, PixelFormat::DXT1, PixelDataType::Uint8, _local_width * _local_height / 2, [this](void *b) {
+                std::lock_guard<std::mutex> lock(_event_mutex);
+                _free_encode_buffers.push_back(b);
+                _release_condition.notify_all();
+            });
+            return;
         }
     }
+    SendFrame(buffer, 0, _px_format, _px_data_type, _pixel_size, release_callback);
+    if (_balance_interval > 0 && _frame_id % _balance_interval == 0)
+    {
+        RebalanceTiles();
+    }
 }
 
-void PxStream::Server::Finalize()
+void PxStream::Server::SubmitFrame(void *buffer, uint32_t size, PixelFormat format, PixelDataType type, ReleaseCallback release_callback)
 {
-    uint8_t finished_flag = 2;
-    for (auto& c : _connections)
+    // pre-encoded payload (e.g. replayed from a recording) - sent as-is, never re-encoded
+    SendFrame(buffer, 0, format, type, size, release_callback);
+}
+
+void PxStream::Server::SubmitChannelFrame(int channel, void *buffer, ReleaseCallback release_callback)
+{
+    // every channel is sent once per frame, before the primary image (SubmitFrame) that completes it -
+    // sends on a connection are serialized, so all layers of frame N arrive before any of frame N+1
+    if (channel < 1 || channel > _channels.size())
     {
-        c.second.client->Send(&finished_flag, 1, NetSocket::CopyMode::MemCopy);
+        fprintf(stderr, "PxStream::Server> Warning: no channel %d\n", channel);
+        return;
     }
+    Channel& c = _channels[channel - 1];
+    SendFrame(buffer, channel, c.format, c.data_type, c.pixel_size, release_callback);
+}
 
-    uint32_t ready_count = 0;
-    std::string event_client_id;
-    while (ready_count < _connections.size())
+void PxStream::Server::SetFramePoolSize(uint32_t count)
+{
+    _frame_pool_size = std::max(count, 1u);
+}
+
+void* PxStream::Server::AcquireFrame()
+{
+    std::unique_lock<std::mutex> lock(_event_mutex);
+    // pool is allocated up front on first use so steady-state streaming never allocates
+    if (_frame_pool.empty())
     {
-        NetSocket::Server::Event event = _server->WaitForNextEvent();
-        if (event.type != NetSocket::Server::EventType::None)
+        // a load balanced tile may grow up to the whole image
+        _frame_pool_slot_size = _pixel_size;
+        if (_balance_interval > 0)
         {
-            event_client_id = event.client->Endpoint();
+            _frame_pool_slot_size = (uint32_t)((uint64_t)_global_width * _global_height * (double)PxStream::GetBitsPerPixel(_px_format, _px_data_type) / 8.0);
         }
-        if (!HandleNewConnection(event))
+        for (uint32_t i = 0; i < _frame_pool_size; i++)
         {
-            switch (event.type)
+            void *frame = PxStream::AllocatePixelBuffer(_frame_pool_slot_size, _numa_node);
+            if (frame == NULL)
             {
-                case NetSocket::Server::EventType::ReceiveBinary:
-                    if (_connections[event_client_id].state == ClientState::Streaming
-                        && event.data_length == 1
-                        && reinterpret_cast<uint8_t*>(event.binary_data)[0] == 255)
-                    {
-                        ready_count++;
-                    }
-                    delete[] reinterpret_cast<uint8_t*>(event.binary_data);
-                    break;
-                default:
-                    break;
+                fprintf(stderr, "PxStream::Server> Error: could not allocate frame pool\n");
+                MPI_Abort(_comm, 1);
             }
+            _frame_pool.push_back(frame);
+            _free_frames.push_back(frame);
         }
     }
-    MPI_Barrier(_comm);
+    while (_free_frames.empty())
+    {
+        _release_condition.wait(lock);
+    }
+    void *frame = _free_frames.front();
+    _free_frames.pop_front();
+    return frame;
 }
 
-// Private
-void PxStream::Server::GetIpAddress(const char *iface, uint8_t ip_address[4])
+void PxStream::Server::SubmitFrame(void *frame)
 {
-    struct ifaddrs *interfaces = NULL;
-    int success = getifaddrs(&interfaces);
-    if (success == 0)
+    SubmitFrame(frame, [this](void *buffer) {
+        std::lock_guard<std::mutex> lock(_event_mutex);
+        _free_frames.push_back(buffer);
+        _release_condition.notify_all();
+    });
+}
+
+void PxStream::Server::CompositeFrame(const void *color, const float *depth)
+{
+    // collective over the server communicator - `color` (and `depth` for DepthTest) are full global
+    // images and may be reused as soon as this returns
+    uint32_t pixel_bytes = PxStream::GetBitsPerPixel(_px_format, _px_data_type) / 8;
+    uint64_t row_bytes = (uint64_t)_global_width * pixel_bytes;
+    bool use_depth = _composite_op == CompositeOperator::DepthTest;
+    const uint8_t *current_color = reinterpret_cast<const uint8_t*>(color);
+    const float *current_depth = depth;
+    int extra = _num_ranks - _composite_vranks;
+
+    // ranks outside the power-of-two group fold their image into their lower neighbour (keeps rank order)
+    if (_rank < 2 * extra)
     {
-        struct ifaddrs *temp_addr = interfaces;
-        while (temp_addr != NULL)
+        if (_composite_vrank < 0)
         {
-            if(temp_addr->ifa_addr->sa_family == AF_INET)
+            MPI_Send(color, _global_height, _composite_row_type, _rank - 1, 0, _comm);
+            if (use_depth) MPI_Send(depth, _global_height, _composite_depth_row_type, _rank - 1, 0, _comm);
+        }
+        else
+        {
+            MPI_Recv(_composite_recv_color.data(), _global_height, _composite_row_type, _rank + 1, 0, _comm, MPI_STATUS_IGNORE);
+            if (use_depth) MPI_Recv(_composite_recv_depth.data(), _global_height, _composite_depth_row_type, _rank + 1, 0, _comm, MPI_STATUS_IGNORE);
+            CompositeRows(current_color, current_depth, 0, _global_height, false);
+            current_color = _composite_color.data();
+            current_depth = _composite_depth.data();
+        }
+    }
+
+    // binary swap - each round exchanges half of the current strip range with the partner and keeps the other
+    // half (lowest bit first, so every rank holds a contiguous range of ranks and "over" stays in order)
+    if (_composite_vrank >= 0)
+    {
+        uint32_t s0 = 0;
+        uint32_t s1 = _composite_vranks;
+        int m;
+        for (m = 1; m < _composite_vranks; m *= 2)
+        {
+            int partner = CompositeActualRank(_composite_vrank ^ m);
+            uint32_t mid = (s0 + s1) / 2;
+            bool keep_upper = (_composite_vrank & m) != 0;
+            uint32_t keep_row = (uint64_t)(keep_upper ? mid : s0) * _global_height / _composite_vranks;
+            uint32_t keep_end = (uint64_t)(keep_upper ? s1 : mid) * _global_height / _composite_vranks;
+            uint32_t send_row = (uint64_t)(keep_upper ? s0 : mid) * _global_height / _composite_vranks;
+            uint32_t send_end = (uint64_t)(keep_upper ? mid : s1) * _global_height / _composite_vranks;
+            MPI_Sendrecv(current_color + send_row * row_bytes, send_end - send_row, _composite_row_type, partner, 1,
+                         _composite_recv_color.data(), keep_end - keep_row, _composite_row_type, partner, 1, _comm, MPI_STATUS_IGNORE);
+            if (use_depth)
             {
-                if (strcmp(temp_addr->ifa_name, iface) == 0)
-                {
-                    memcpy(ip_address, &(((struct sockaddr_in*)temp_addr->ifa_addr)->sin_addr), 4);
-                    break;
-                }
+                MPI_Sendrecv(current_depth + (uint64_t)send_row * _global_width, send_end - send_row, _composite_depth_row_type, partner, 2,
+                             _composite_recv_depth.data(), keep_end - keep_row, _composite_depth_row_type, partner, 2, _comm, MPI_STATUS_IGNORE);
             }
-            temp_addr = temp_addr->ifa_next;
+            // the partner holds the ranks below ours when we keep the upper half
+            CompositeRows(current_color, current_depth, keep_row, keep_end - keep_row, keep_upper);
+            current_color = _composite_color.data();
+            current_depth = _composite_depth.data();
+            s0 = keep_upper ? mid : s0;
+            s1 = keep_upper ? s1 : mid;
         }
     }
-    freeifaddrs(interfaces);
-}
 
-bool PxStream::Server::HandleNewConnection(NetSocket::Server::Event& event)
-{
-    bool new_connection_event = false;
-    std::string event_client_id;
-    uint8_t *data;
-    if (event.type != NetSocket::Server::EventType::None)
+    // stream the strip - when ranks were folded, strips are first spread evenly over every rank
+    uint8_t *frame = reinterpret_cast<uint8_t*>(AcquireFrame());
+    uint32_t strip_row, strip_rows;
+    if (extra == 0)
     {
-        event_client_id = event.client->Endpoint();
+        CompositeStrip(_composite_vrank, &strip_row, &strip_rows);
+        memcpy(frame, current_color + strip_row * row_bytes, strip_rows * row_bytes);
     }
-    switch (event.type)
+    else
     {
-        case NetSocket::Server::EventType::Connect:
-            _connections[event_client_id] = {0, ClientState::Connecting, event.client, true, false, false};
-            if (_rank == 0) // initial connection - send server ip addressas and ports for all ranks
+        // counts and displacements are in rows
+        std::vector<int> send_counts(_num_ranks, 0), send_displacements(_num_ranks, 0);
+        std::vector<int> recv_counts(_num_ranks, 0), recv_displacements(_num_ranks, 0);
+        int r;
+        for (r = 0; r < _num_ranks; r++)
+        {
+            uint32_t tile_row = (uint64_t)r * _global_height / _num_ranks;
+            uint32_t tile_end = (uint64_t)(r + 1) * _global_height / _num_ranks;
+            uint32_t row, rows;
+            if (_composite_vrank >= 0)
             {
-                uint32_t net_global_w = htonl(_global_width);
-                uint32_t net_global_h = htonl(_global_height);
-                event.client->Send(&_endianness, sizeof(uint8_t), NetSocket::CopyMode::ZeroCopy);
-                event.client->Send(_ip_address_list, 4 * _num_ranks, NetSocket::CopyMode::ZeroCopy);
-                event.client->Send(_port_list, _num_ranks * sizeof(uint16_t), NetSocket::CopyMode::ZeroCopy);
-                event.client->Send(&net_global_w, sizeof(uint32_t), NetSocket::CopyMode::MemCopy);
-                event.client->Send(&net_global_h, sizeof(uint32_t), NetSocket::CopyMode::MemCopy);
-                event.client->Send(&_px_format, sizeof(uint8_t), NetSocket::CopyMode::ZeroCopy);
-                event.client->Send(&_px_data_type, sizeof(uint8_t), NetSocket::CopyMode::ZeroCopy);
+                CompositeStrip(_composite_vrank, &row, &rows);
+                uint32_t first = std::max(row, tile_row);
+                uint32_t last = std::min(row + rows, tile_end);
+                send_counts[r] = (last > first) ? last - first : 0;
+                send_displacements[r] = (last > first) ? first - row : 0;
             }
-            // mark as valid event for new connection
-            new_connection_event = true;
-            break;
-        case NetSocket::Server::EventType::ReceiveBinary:
-            if (_connections[event_client_id].state == ClientState::Connecting)
+            int strip_vrank = (r < 2 * extra) ? ((r % 2 == 0) ? r / 2 : -1) : r - extra;
+            if (strip_vrank >= 0)
             {
-                _connections[event_client_id].state = ClientState::Handshake;
-                // verify client handshake data is as expected
-                data = reinterpret_cast<uint8_t*>(event.binary_data);
-                if (event.data_length == 13 && ntohl(*((uint32_t*)data)) == _num_ranks)
-                {
-                    // store client data
-                    _connections[event_client_id].id = PxStream::NToHLL(*((uint64_t*)(data + 4)));
-                    _connections[event_client_id].has_same_endianness = data[12] == _endianness;
-                    // send connection header
-                    event.client->Send(_connect_header, 16, NetSocket::CopyMode::ZeroCopy);
-                }
-                else // unexpected handshake data
-                {
-                    fprintf(stderr, "PxStream::Server> Warning: expected handshake (13 byte), received %d bytes instead\n", event.data_length);
-                    // TODO: terminate connection
-                }
-                delete[] reinterpret_cast<uint8_t*>(event.binary_data);
-                // mark as valid event for new connection
-                new_connection_event = true;
+                CompositeStrip(strip_vrank, &row, &rows);
+                uint32_t first = std::max(row, _local_offset_y);
+                uint32_t last = std::min(row + rows, _local_offset_y + _local_height);
+                recv_counts[r] = (last > first) ? last - first : 0;
+                recv_displacements[r] = (last > first) ? first - _local_offset_y : 0;
             }
-            break;
-        case NetSocket::Server::EventType::SendFinished:
-            // once connection header is sent, increment verified connections
-            if (event.binary_data == _connect_header)
+        }
+        const uint8_t *strip = current_color;
+        if (_composite_vrank >= 0)
+        {
+            CompositeStrip(_composite_vrank, &strip_row, &strip_rows);
+            strip += strip_row * row_bytes;
+        }
+        MPI_Alltoallv(strip, send_counts.data(), send_displacements.data(), _composite_row_type,
+                      frame, recv_counts.data(), recv_displacements.data(), _composite_row_type, _comm);
+    }
+    SubmitFrame(frame);
+}
+
+int PxStream::Server::GetReleaseFd()
+{
+    return _release_fd[0];
+}
+
+bool PxStream::Server::GetReleasedFrame(void **buffer)
+{
+    std::lock_guard<std::mutex> lock(_event_mutex);
+    if (_released_frames.empty())
+    {
+        return false;
+    }
+    uint8_t signal;
+    *buffer = _released_frames.front();
+    _released_frames.pop_front();
+    read(_release_fd[0], &signal, 1);
+    return true;
+}
+
+int PxStream::Server::GetMessageFd()
+{
+    return _message_fd[0];
+}
+
+uint32_t PxStream::Server::PollMessages(std::vector<ClientMessage>& messages)
+{
+    // non-blocking - appends every message received on this rank's connections since the last call
+    std::lock_guard<std::mutex> lock(_event_mutex);
+    uint32_t count = _messages.size();
+    uint8_t signal[64];
+    while (!_messages.empty())
+    {
+        messages.push_back(std::move(_messages.front()));
+        _messages.pop_front();
+    }
+    while (read(_message_fd[0], signal, sizeof(signal)) > 0)
+    {
+    }
+    return count;
+}
+
+void PxStream::Server::AdvanceToNextFrame()
+{
+    if (_stream_behavior == StreamBehavior::WaitForAll)
+    {
+        std::unique_lock<std::mutex> lock(_event_mutex);
+        while (_in_flight_frames.find(_pixels) != _in_flight_frames.end())
+        {
+            _release_condition.wait(lock);
+        }
+        for (auto& channel : _channels)
+        {
+            while (_in_flight_frames.find(channel.pixels) != _in_flight_frames.end())
             {
-                _connections[event_client_id].state = ClientState::Streaming;
-                _connections[event_client_id].ready_to_advance = true;
-                printf("PxStream::Server> [rank %d] client %d (%s) connected and verified\n", _rank, _num_connections, event_client_id.c_str());
-                _num_connections++;
-                // mark as valid event for new connection
-                new_connection_event = true;
+                _release_condition.wait(lock);
             }
-        default:
-            break;
+        }
+    }
+}
+
+void PxStream::Server::Finalize()
+{
+    uint8_t finished_flag = 2;
+    uint32_t streaming_count = 0;
+    // the recorder's release callbacks take the event lock - close it first
+    StopRecording();
+    std::unique_lock<std::mutex> lock(_event_mutex);
+
+    // paced frames still queued must go out before the finished flag
+    lock.unlock();
+    StopSendThread(true);
+    lock.lock();
+    _finalizing = true;
+    for (auto& c : _connections)
+    {
+        if (c.second.state == ClientState::Streaming)
+        {
+            c.second.client->Send(&finished_flag, 1, NetSocket::CopyMode::MemCopy);
+            streaming_count++;
+        }
+    }
+    lock.unlock();
+
+    // event thread exits once every streaming client has acknowledged the finished flag
+    if (streaming_count > 0)
+    {
+        _event_thread.join();
+    }
+    else
+    {
+        StopEventThread();
+    }
+    MPI_Barrier(_comm);
+}
+
+// Private
+void PxStream::Server::SendFrame(void *buffer, uint8_t channel, PixelFormat format, PixelDataType type, uint32_t payload_size, ReleaseCallback release_callback)
+{
+    FrameHeader header = {1, format, type, payload_size};
+    header.frame_id = (uint32_t)_frame_id;
+    header.channel = channel;
+    header.timestamp = PxStream::GetTimestamp();
+    header.has_checksum = _frame_checksums;
+    header.checksum = _frame_checksums ? PxStream::ComputeChecksum(buffer, payload_size) : 0;
+    uint8_t header_data[PXSTREAM_FRAME_HEADER_SIZE];
+    PxStream::PackFrameHeader(header, header_data);
+    bool paced = PacingEnabled();
+    uint32_t chunk_size = payload_size;
+    if (paced && payload_size > 0)
+    {
+        chunk_size = std::min(payload_size, (_send_chunk_size > 0) ? _send_chunk_size : PXSTREAM_DEFAULT_CHUNK_SIZE);
+    }
+    // an empty payload (e.g. a zero-area tile) is sent as the header alone
+    uint32_t num_chunks = (payload_size > 0) ? (payload_size + chunk_size - 1) / chunk_size : 0;
+    void *last_chunk = reinterpret_cast<uint8_t*>(buffer) + ((num_chunks > 0) ? (num_chunks - 1) * chunk_size : 0);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(_event_mutex);
+    if (_stream_behavior == StreamBehavior::WaitForAll)
+    {
+        // backpressure - a frame is not started on a connection until its client has granted a credit
+        while (!_finalizing && std::any_of(_connections.begin(), _connections.end(), [channel](const std::pair<const std::string, Connection>& c) {
+                   return c.second.state == ClientState::Streaming && (c.second.channels & (1u << channel))
+                       && c.second.credit_window > 0 && c.second.credits == 0 && !c.second.frame_started;
+               }))
+        {
+            _release_condition.wait(lock);
+        }
+    }
+    InFlightFrame& frame = _in_flight_frames[buffer];
+    if (frame.pending_sends == 0)
+    {
+        frame.submit_time = now;
+    }
+    frame.callbacks.push_back(release_callback);
+    if (_recorder != NULL && channel == 0)
+    {
+        // recorder holds a reference until its I/O thread has staged the frame (only the primary image is recorded)
+        // (an installed recorder is always open, so Record() never calls back while the lock is held)
+        frame.pending_sends++;
+        _recorder->Record(buffer, payload_size, format, type, _frame_id, [this](const void *b) {
+            RecordingFinished(b);
+        });
+    }
+    if (channel == 0)
+    {
+        _frame_id++;
+    }
+    PacedFrame paced_frame = {buffer, header, chunk_size};
+    for (auto& c : _connections)
+    {
+        if (c.second.state == ClientState::Streaming && (c.second.channels & (1u << channel)) && !c.second.frame_started)
+        {
+            // the whole frame (every channel) is either sent or skipped - DropFrames skips while out of credits
+            c.second.frame_started = true;
+            c.second.skip_frame = c.second.credit_window > 0 && c.second.credits == 0;
+            if (c.second.credit_window > 0 && !c.second.skip_frame)
+            {
+                c.second.credits--;
+            }
+        }
+        if (channel == 0)
+        {
+            // the primary image completes the frame
+            bool skip = c.second.skip_frame;
+            c.second.frame_started = false;
+            c.second.skip_frame = false;
+            if (skip)
+            {
+                continue;
+            }
+        }
+        else if (c.second.skip_frame)
+        {
+            continue;
+        }
+        if (c.second.state == ClientState::Streaming && (c.second.channels & (1u << channel)))
+        {
+            if (paced)
+            {
+                paced_frame.connection_ids.push_back(c.first);
+            }
+            else
+            {
+                c.second.client->Send(header_data, PXSTREAM_FRAME_HEADER_SIZE, NetSocket::CopyMode::MemCopy);
+                if (payload_size > 0)
+                {
+                    c.second.client->Send(buffer, payload_size, NetSocket::CopyMode::ZeroCopy);
+                }
+            }
+            if (payload_size > 0)
+            {
+                c.second.pending_sends.push_back({buffer, last_chunk, payload_size, now});
+                c.second.ready_to_advance = false;
+                frame.pending_sends++;
+            }
+        }
+    }
+    // no connections to send to (or nothing but headers) - buffer can be released right away
+    if (frame.pending_sends == 0)
+    {
+        ReleaseFrame(buffer, lock);
+    }
+    if (paced && !paced_frame.connection_ids.empty())
+    {
+        if (!_send_thread.joinable())
+        {
+            _send_thread = std::thread(&PxStream::Server::SendLoop, this);
+        }
+        _send_queue.push_back(paced_frame);
+        _send_condition.notify_all();
+    }
+}
+
+void PxStream::Server::UpdateAdaptiveLevel()
+{
+    // vote based on slowest connection's throughput and recent frame latency
+    double required_rate = (double)_pixel_size / _adaptive_interval;
+    double min_throughput = 0.0;
+    std::unique_lock<std::mutex> lock(_event_mutex);
+    for (auto& c : _connections)
+    {
+        if (c.second.state == ClientState::Streaming && c.second.throughput > 0.0)
+        {
+            min_throughput = (min_throughput == 0.0) ? c.second.throughput : std::min(min_throughput, c.second.throughput);
+        }
+    }
+    double latency = _frame_latency;
+    lock.unlock();
+
+    int vote = _adaptive_level;
+    if (min_throughput > 0.0)
+    {
+        bool struggling = min_throughput < required_rate || latency > _adaptive_interval;
+        bool headroom = min_throughput > PXSTREAM_ADAPTIVE_HEADROOM * required_rate && latency < 0.5 * _adaptive_interval;
+        _degrade_count = (_adaptive_level == 0 && struggling) ? _degrade_count + 1 : 0;
+        _upgrade_count = (_adaptive_level > 0 && headroom) ? _upgrade_count + 1 : 0;
+        if (_degrade_count >= PXSTREAM_ADAPTIVE_DEGRADE_FRAMES)
+        {
+            vote = 1;
+        }
+        else if (_upgrade_count >= PXSTREAM_ADAPTIVE_UPGRADE_FRAMES)
+        {
+            vote = 0;
+        }
+    }
+
+    // all ranks must send the same format - degrade if any rank wants to, upgrade only if all do
+    int level;
+    MPI_Allreduce(&vote, &level, 1, MPI_INT, MPI_MAX, _comm);
+    if (level != _adaptive_level)
+    {
+        _adaptive_level = level;
+        _degrade_count = 0;
+        _upgrade_count = 0;
+        if (_rank == 0)
+        {
+            printf("PxStream::Server> adaptive format: switching to %s\n", (level > 0) ? "DXT1" : "RGBA");
+        }
+    }
+}
+
+void* PxStream::Server::AcquireEncodeBuffer()
+{
+    std::unique_lock<std::mutex> lock(_event_mutex);
+    if (_free_encode_buffers.empty() && _encode_pool.size() < _frame_pool_size)
+    {
+        void *buffer = PxStream::AllocatePixelBuffer(_local_width * _local_height / 2, _numa_node);
+        if (buffer == NULL)
+        {
+            fprintf(stderr, "PxStream::Server> Error: could not allocate encode buffer\n");
+            MPI_Abort(_comm, 1);
+        }
+        _encode_pool.push_back(buffer);
+        return buffer;
+    }
+    while (_free_encode_buffers.empty())
+    {
+        _release_condition.wait(lock);
+    }
+    void *buffer = _free_encode_buffers.front();
+    _free_encode_buffers.pop_front();
+    return buffer;
+}
+
+void PxStream::Server::GetIpAddress(const char *iface, uint8_t ip_address[4])
+{
+    struct ifaddrs *interfaces = NULL;
+    int success = getifaddrs(&interfaces);
+    if (success == 0)
+    {
+        struct ifaddrs *temp_addr = interfaces;
+        while (temp_addr != NULL)
+        {
+            if(temp_addr->ifa_addr->sa_family == AF_INET)
+            {
+                if (strcmp(temp_addr->ifa_name, iface) == 0)
+                {
+                    memcpy(ip_address, &(((struct sockaddr_in*)temp_addr->ifa_addr)->sin_addr), 4);
+                    break;
+                }
+            }
+            temp_addr = temp_addr->ifa_next;
+        }
+    }
+    freeifaddrs(interfaces);
+}
+
+bool PxStream::Server::HandleNewConnection(NetSocket::Server::Event& event)
+{
+    bool new_connection_event = false;
+    std::string event_client_id;
+    uint8_t *data;
+    std::map<std::string, Connection>::iterator it;
+    if (event.type == NetSocket::Server::EventType::None)
+    {
+        return false;
+    }
+    event_client_id = event.client->Endpoint();
+    if (event.type == NetSocket::Server::EventType::Connect)
+    {
+        _connections[event_client_id] = {0, ClientState::Connecting, event.client, true, false, false};
+        it = _connections.find(event_client_id);
+    }
+    else
+    {
+        // events of a connection that is already gone (e.g. a late send completion) are not for us
+        it = _connections.find(event_client_id);
+        if (it == _connections.end())
+        {
+            return false;
+        }
+    }
+    Connection& connection = it->second;
+    switch (event.type)
+    {
+        case NetSocket::Server::EventType::Connect:
+            connection.channels = 1;
+            connection.credit_window = 0;
+            connection.credits = 0;
+            connection.frame_started = false;
+            connection.skip_frame = false;
+            connection.throughput = 0.0;
+            connection.bucket = std::make_shared<TokenBucket>();
+            InitTokenBucket(*(connection.bucket), _connection_bit_rate);
+            if (_rank == 0) // initial connection - send server ip addresses and ports for all ranks
+            {
+                event.client->Send(_server_info.data(), _server_info.size(), NetSocket::CopyMode::ZeroCopy);
+            }
+            // mark as valid event for new connection
+            new_connection_event = true;
+            break;
+        case NetSocket::Server::EventType::ReceiveBinary:
+            data = reinterpret_cast<uint8_t*>(event.binary_data);
+            if (connection.state == ClientState::Connecting && event.data_length == 8 && data[0] == PXSTREAM_PROBE_FLAG)
+            {
+                // link probe ahead of the handshake - reply with the requested number of bytes
+                uint32_t net_size;
+                memcpy(&net_size, data + 4, 4);
+                uint32_t size = std::min(std::max(ntohl(net_size), (uint32_t)8), (uint32_t)PXSTREAM_PROBE_MAX_SIZE);
+                std::vector<uint8_t> reply(size, 0);
+                reply[0] = PXSTREAM_PROBE_FLAG;
+                event.client->Send(reply.data(), size, NetSocket::CopyMode::MemCopy);
+                delete[] data;
+                new_connection_event = true;
+            }
+            else if (connection.state == ClientState::Connecting)
+            {
+                connection.state = ClientState::Handshake;
+                // verify client handshake data is as expected
+                if ((event.data_length == 13 || event.data_length == 17 || event.data_length == 21) && ntohl(*((uint32_t*)data)) == _num_ranks)
+                {
+                    // store client data
+                    connection.id = PxStream::NToHLL(*((uint64_t*)(data + 4)));
+                    connection.has_same_endianness = data[12] == _endianness;
+                    if (event.data_length >= 17) // channel subscription mask (a 13 byte handshake receives the primary image only)
+                    {
+                        uint32_t net_channels;
+                        memcpy(&net_channels, data + 13, 4);
+                        connection.channels = ntohl(net_channels);
+                    }
+                    if (event.data_length >= 21) // frame credits granted by the client
+                    {
+                        uint32_t net_credits;
+                        memcpy(&net_credits, data + 17, 4);
+                        connection.credit_window = ntohl(net_credits);
+                        connection.credits = ntohl(net_credits);
+                    }
+                    // send connection header
+                    // the connection keeps the header alive until sent, even if re-tiling replaces it meanwhile
+                    connection.connect_header = _connect_header;
+                    event.client->Send(_connect_header->data(), _connect_header->size(), NetSocket::CopyMode::ZeroCopy);
+                }
+                else // unexpected handshake data
+                {
+                    fprintf(stderr, "PxStream::Server> Warning: expected handshake (13, 17 or 21 bytes), received %d bytes instead\n", event.data_length);
+                    // TODO: terminate connection
+                }
+                delete[] reinterpret_cast<uint8_t*>(event.binary_data);
+                // mark as valid event for new connection
+                new_connection_event = true;
+            }
+            break;
+        case NetSocket::Server::EventType::SendFinished:
+            // once connection header is sent, increment verified connections
+            if (connection.connect_header && event.binary_data == connection.connect_header->data())
+            {
+                connection.connect_header.reset();
+                connection.state = ClientState::Streaming;
+                connection.ready_to_advance = true;
+                printf("PxStream::Server> [rank %d] client %d (%s) connected and verified\n", _rank, _num_connections, event_client_id.c_str());
+                _num_connections++;
+                // mark as valid event for new connection
+                new_connection_event = true;
+            }
+            break;
+        case NetSocket::Server::EventType::Disconnect:
+            // closed before its handshake (e.g. a client's link probe connection) - nothing in flight to release
+            if (connection.state == ClientState::Connecting)
+            {
+                _connections.erase(it);
+                new_connection_event = true;
+            }
+            break;
+        default:
+            break;
+    }
+    return new_connection_event;
+}
+
+void PxStream::Server::EventLoop()
+{
+    std::unique_lock<std::mutex> lock(_event_mutex, std::defer_lock);
+    std::string event_client_id;
+    std::map<std::string, Connection>::iterator it;
+    uint32_t streaming_count;
+    bool done = false;
+    PxStream::ApplyThreadAffinity(PxStream::ThreadRole::SenderThreads, _numa_node);
+    while (!done)
+    {
+        NetSocket::Server::Event event = _server->WaitForNextEvent();
+        lock.lock();
+        if (!HandleNewConnection(event))
+        {
+            if (event.type != NetSocket::Server::EventType::None)
+            {
+                event_client_id = event.client->Endpoint();
+            }
+            switch (event.type)
+            {
+                case NetSocket::Server::EventType::SendFinished:
+                    it = _connections.find(event_client_id);
+                    if (it != _connections.end())
+                    {
+                        CompleteSend(it->second, event.binary_data, lock);
+                    }
+                    break;
+                case NetSocket::Server::EventType::ReceiveBinary:
+                    it = _connections.find(event_client_id);
+                    if (it != _connections.end() && it->second.state != ClientState::Connecting
+                        && event.data_length >= 1 && reinterpret_cast<uint8_t*>(event.binary_data)[0] == 0xFE)
+                    {
+                        // client message - queued right away (independent of pixel traffic) and signaled on the message fd
+                        uint8_t *data = reinterpret_cast<uint8_t*>(event.binary_data);
+                        uint8_t signal = 1;
+                        _messages.push_back({it->second.id, std::vector<uint8_t>(data + 1, data + event.data_length)});
+                        write(_message_fd[1], &signal, 1);
+                    }
+                    else if (_finalizing
+                        && it != _connections.end() && it->second.state == ClientState::Streaming
+                        && event.data_length == 1
+                        && (reinterpret_cast<uint8_t*>(event.binary_data)[0] == 2
+                            || (reinterpret_cast<uint8_t*>(event.binary_data)[0] == 255 && it->second.credit_window == 0)))
+                    {
+                        // client acknowledged the finished flag (clients without flow control, i.e. 13 / 17 byte
+                        // handshakes, acknowledge it with 255)
+                        _finished_count++;
+                    }
+                    else if (it != _connections.end() && event.data_length == 1 && reinterpret_cast<uint8_t*>(event.binary_data)[0] == 255)
+                    {
+                        // frame_received_flag - returns one credit
+                        if (it->second.credits < it->second.credit_window)
+                        {
+                            it->second.credits++;
+                            _release_condition.notify_all();
+                        }
+                    }
+                    delete[] reinterpret_cast<uint8_t*>(event.binary_data);
+                    break;
+                case NetSocket::Server::EventType::Disconnect:
+                    it = _connections.find(event_client_id);
+                    if (it != _connections.end())
+                    {
+                        // sends to a closed connection will never finish - drop their references
+                        while (!it->second.pending_sends.empty())
+                        {
+                            CompleteSend(it->second, it->second.pending_sends.front().last_chunk, lock);
+                        }
+                        if (it->second.state == ClientState::Streaming)
+                        {
+                            _num_connections--;
+                        }
+                        printf("PxStream::Server> [rank %d] client (%s) disconnected\n", _rank, event_client_id.c_str());
+                        _connections.erase(it);
+                        _release_condition.notify_all();
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        streaming_count = 0;
+        for (auto& c : _connections)
+        {
+            if (c.second.state == ClientState::Streaming)
+            {
+                streaming_count++;
+            }
+        }
+        done = _event_stop || (_finalizing && _finished_count >= streaming_count);
+        lock.unlock();
+    }
+}
+
+void PxStream::Server::StopEventThread()
+{
+    if (!_event_thread.joinable())
+    {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(_event_mutex);
+    _event_stop = true;
+    lock.unlock();
+
+    // the event thread blocks until the next network event - a loopback connection produces one
+    NetSocket::Client *wake = NULL;
+    try {
+        NetSocket::ClientOptions options = NetSocket::CreateClientOptions();
+        options.secure = false;
+        wake = new NetSocket::Client("127.0.0.1", _port, options);
+    }
+    catch (std::exception& e)
+    {
+        fprintf(stderr, "PxStream::Server> Warning: could not wake event thread (%s)\n", e.what());
+    }
+    _event_thread.join();
+    delete wake;
+}
+
+void PxStream::Server::StopSendThread(bool drain)
+{
+    if (!_send_thread.joinable())
+    {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(_event_mutex);
+    if (drain)
+    {
+        while (!_send_queue.empty() || _send_busy)
+        {
+            _release_condition.wait(lock);
+        }
+    }
+    _send_queue.clear();
+    _send_done = true;
+    _send_condition.notify_all();
+    lock.unlock();
+    _send_thread.join();
+}
+
+void PxStream::Server::CompleteSend(Connection& connection, void *data, std::unique_lock<std::mutex>& lock)
+{
+    // chunks of a frame finish in order, so only completion of the last chunk matters
+    auto pending = std::find_if(connection.pending_sends.begin(), connection.pending_sends.end(), [data](const PendingSend& p) {
+        return p.last_chunk == data;
+    });
+    if (pending == connection.pending_sends.end())
+    {
+        return;
+    }
+    void *buffer = pending->frame;
+
+    // sends on a connection are serialized - time each one from when the previous one finished
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - std::max(pending->submit_time, connection.last_completion)).count();
+    if (elapsed > 0.0)
+    {
+        double sample = (double)pending->payload_size / elapsed;
+        connection.throughput = (connection.throughput == 0.0) ? sample : 0.8 * connection.throughput + 0.2 * sample;
+    }
+    connection.last_completion = now;
+    connection.pending_sends.erase(pending);
+    if (connection.pending_sends.empty())
+    {
+        connection.ready_to_advance = true;
+    }
+    auto frame = _in_flight_frames.find(buffer);
+    if (frame != _in_flight_frames.end())
+    {
+        frame->second.pending_sends--;
+        if (frame->second.pending_sends == 0)
+        {
+            ReleaseFrame(buffer, lock);
+        }
+    }
+}
+
+void PxStream::Server::ReleaseFrame(void *buffer, std::unique_lock<std::mutex>& lock)
+{
+    InFlightFrame& frame = _in_flight_frames[buffer];
+    std::vector<ReleaseCallback> callbacks = std::move(frame.callbacks);
+    if (frame.pending_sends == 0 && frame.submit_time.time_since_epoch().count() > 0)
+    {
+        double latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - frame.submit_time).count();
+        _frame_latency = (_frame_latency == 0.0) ? latency : 0.8 * _frame_latency + 0.2 * latency;
+    }
+    _in_flight_frames.erase(buffer);
+
+    // submissions without a callback are reported through the release queue / pollable fd
+    uint8_t signal = 1;
+    for (auto& callback : callbacks)
+    {
+        if (!callback)
+        {
+            _released_frames.push_back(buffer);
+            write(_release_fd[1], &signal, 1);
+        }
+    }
+    _release_condition.notify_all();
+
+    // callbacks run without the lock held so they may submit new frames
+    lock.unlock();
+    for (auto& callback : callbacks)
+    {
+        if (callback)
+        {
+            callback(buffer);
+        }
+    }
+    lock.lock();
+}
+
+bool PxStream::Server::PacingEnabled()
+{
+    return _frame_interval > 0.0 || _bit_rate > 0 || _connection_bit_rate > 0 || _send_chunk_size > 0;
+}
+
+void PxStream::Server::SendLoop()
+{
+    uint8_t header_data[PXSTREAM_FRAME_HEADER_SIZE];
+    PxStream::ApplyThreadAffinity(PxStream::ThreadRole::SenderThreads, _numa_node);
+    std::unique_lock<std::mutex> lock(_event_mutex);
+    while (true)
+    {
+        while (_send_queue.empty() && !_send_done)
+        {
+            _send_condition.wait(lock);
+        }
+        if (_send_queue.empty())
+        {
+            break;
+        }
+        PacedFrame frame = _send_queue.front();
+        _send_queue.pop_front();
+        if (frame.message)
+        {
+            // control message - keeps its place behind the frames queued before it, but is not paced
+            for (auto& id : frame.connection_ids)
+            {
+                auto it = _connections.find(id);
+                if (it != _connections.end())
+                {
+                    it->second.client->Send(frame.message->data(), frame.message->size(), NetSocket::CopyMode::MemCopy);
+                }
+            }
+            continue;
+        }
+        _send_busy = true;
+        lock.unlock();
+
+        // frame rate limit - frames start no closer together than the frame interval
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point frame_start = std::max(now, _next_frame_time);
+        std::chrono::duration<double> interval(_frame_interval);
+        std::this_thread::sleep_until(frame_start);
+        _next_frame_time = frame_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+
+        // chunks are spread evenly over the frame interval and throttled by the token buckets
+        uint32_t payload_size = frame.header.payload_size;
+        uint32_t num_chunks = (payload_size > 0) ? (payload_size + frame.chunk_size - 1) / frame.chunk_size : 0;
+        uint32_t i;
+        PxStream::PackFrameHeader(frame.header, header_data);
+        if (num_chunks == 0)
+        {
+            // header-only frame
+            lock.lock();
+            for (auto& id : frame.connection_ids)
+            {
+                auto it = _connections.find(id);
+                if (it != _connections.end())
+                {
+                    it->second.client->Send(header_data, PXSTREAM_FRAME_HEADER_SIZE, NetSocket::CopyMode::MemCopy);
+                }
+            }
+            lock.unlock();
+        }
+        for (i = 0; i < num_chunks; i++)
+        {
+            uint8_t *chunk = reinterpret_cast<uint8_t*>(frame.buffer) + i * frame.chunk_size;
+            uint32_t length = std::min(frame.chunk_size, payload_size - i * frame.chunk_size);
+            if (_frame_interval > 0.0)
+            {
+                std::this_thread::sleep_until(frame_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval * ((double)i / (double)num_chunks)));
+            }
+            for (auto& id : frame.connection_ids)
+            {
+                if (_bit_rate > 0)
+                {
+                    AcquireTokens(_send_bucket, length);
+                }
+                lock.lock();
+                auto it = _connections.find(id);
+                if (it != _connections.end())
+                {
+                    std::shared_ptr<TokenBucket> bucket = (_connection_bit_rate > 0) ? it->second.bucket : nullptr;
+                    lock.unlock();
+                    if (bucket)
+                    {
+                        AcquireTokens(*bucket, length);
+                    }
+                    lock.lock();
+                    it = _connections.find(id);
+                    if (it != _connections.end())
+                    {
+                        if (i == 0)
+                        {
+                            it->second.client->Send(header_data, PXSTREAM_FRAME_HEADER_SIZE, NetSocket::CopyMode::MemCopy);
+                        }
+                        it->second.client->Send(chunk, length, NetSocket::CopyMode::ZeroCopy);
+                    }
+                }
+                lock.unlock();
+            }
+        }
+
+        lock.lock();
+        _send_busy = false;
+        _release_condition.notify_all();
+    }
+}
+
+void PxStream::Server::InitTokenBucket(TokenBucket& bucket, uint64_t bits_per_second)
+{
+    // allow bursts of up to 10ms worth of data (but at least one chunk)
+    bucket.rate = (double)bits_per_second / 8.0;
+    bucket.capacity = std::max(bucket.rate / 100.0, (double)((_send_chunk_size > 0) ? _send_chunk_size : PXSTREAM_DEFAULT_CHUNK_SIZE));
+    bucket.tokens = bucket.capacity;
+    bucket.last_update = std::chrono::steady_clock::now();
+}
+
+void PxStream::Server::AcquireTokens(TokenBucket& bucket, uint64_t bytes)
+{
+    double needed = std::min((double)bytes, bucket.capacity);
+    while (true)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - bucket.last_update).count();
+        bucket.tokens = std::min(bucket.capacity, bucket.tokens + elapsed * bucket.rate);
+        bucket.last_update = now;
+        if (bucket.tokens >= needed)
+        {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>((needed - bucket.tokens) / bucket.rate));
+    }
+    // chunks larger than the burst size drive the bucket negative so the average rate still holds
+    bucket.tokens -= (double)bytes;
+}
+
+void PxStream::Server::RecordingFinished(const void *buffer)
+{
+    std::unique_lock<std::mutex> lock(_event_mutex);
+    auto frame = _in_flight_frames.find(const_cast<void*>(buffer));
+    if (frame != _in_flight_frames.end())
+    {
+        frame->second.pending_sends--;
+        if (frame->second.pending_sends == 0)
+        {
+            ReleaseFrame(frame->first, lock);
+        }
+    }
+}
+
+void PxStream::Server::BuildConnectHeader()
+{
+    // connection header: region count, then width, height, offset x, offset y, priority for each region
+    uint64_t num_pixels = 0;
+    std::shared_ptr<std::vector<uint8_t>> header = std::make_shared<std::vector<uint8_t>>(4 + 20 * _regions.size());
+    uint32_t net_value = htonl(_regions.size());
+    memcpy(header->data(), &net_value, 4);
+    int i;
+    for (i = 0; i < _regions.size(); i++)
+    {
+        uint32_t region[5] = {htonl(_regions[i].width), htonl(_regions[i].height), htonl(_regions[i].offset_x),
+                              htonl(_regions[i].offset_y), htonl((uint32_t)_regions[i].priority)};
+        memcpy(header->data() + 4 + 20 * i, region, 20);
+        num_pixels += (uint64_t)_regions[i].width * _regions[i].height;
+    }
+    _connect_header = header;
+    _pixel_size = (uint32_t)(num_pixels * (double)PxStream::GetBitsPerPixel(_px_format, _px_data_type) / 8.0);
+    for (auto& channel : _channels)
+    {
+        channel.pixel_size = (uint32_t)(num_pixels * (double)PxStream::GetBitsPerPixel(channel.format, channel.data_type) / 8.0);
+    }
+}
+
+void PxStream::Server::RebalanceTiles()
+{
+    // collective - each rank's cost (render time + time to send a frame) is spread evenly over its tile,
+    // rank 0 accumulates that per row and cuts the rows into strips of equal cost
+    std::unique_lock<std::mutex> lock(_event_mutex);
+    double cost = _render_time + _frame_latency;
+    lock.unlock();
+    uint32_t tile[4] = {_local_width, _local_height, _local_offset_x, _local_offset_y};
+    std::vector<double> costs(_rank == 0 ? _num_ranks : 0);
+    std::vector<uint32_t> tiles(_rank == 0 ? 4 * _num_ranks : 0);
+    MPI_Gather(&cost, 1, MPI_DOUBLE, costs.data(), 1, MPI_DOUBLE, 0, _comm);
+    MPI_Gather(tile, 4, MPI_UINT32_T, tiles.data(), 4, MPI_UINT32_T, 0, _comm);
+
+    // strip boundaries (rows[0] = UINT32_MAX keeps the current tiles)
+    std::vector<uint32_t> rows(_num_ranks + 1, 0);
+    int r;
+    if (_rank == 0)
+    {
+        double total = 0.0;
+        double max_cost = 0.0;
+        std::vector<double> row_cost(_global_height, 0.0);
+        for (r = 0; r < _num_ranks; r++)
+        {
+            uint32_t *t = tiles.data() + 4 * r;
+            uint64_t area = (uint64_t)t[0] * t[1];
+            uint32_t y;
+            for (y = t[3]; area > 0 && y < std::min(t[3] + t[1], _global_height); y++)
+            {
+                row_cost[y] += costs[r] * t[0] / area;
+            }
+            total += costs[r];
+            max_cost = std::max(max_cost, costs[r]);
+        }
+        if (total <= 0.0 || _global_height < _num_ranks || max_cost < PXSTREAM_BALANCE_THRESHOLD * total / _num_ranks)
+        {
+            rows[0] = UINT32_MAX;
+        }
+        else
+        {
+            // every strip keeps at least one row
+            double accumulated = 0.0;
+            uint32_t y = 0;
+            for (r = 1; r < _num_ranks; r++)
+            {
+                double target = total * r / _num_ranks;
+                while (y < _global_height - (_num_ranks - r) && (y < rows[r - 1] + 1 || accumulated + 0.5 * row_cost[y] < target))
+                {
+                    accumulated += row_cost[y];
+                    y++;
+                }
+                rows[r] = y;
+            }
+            rows[_num_ranks] = _global_height;
+            printf("PxStream::Server> load balancing: re-tiled (slowest rank %.1f%% above mean)\n", 100.0 * (max_cost * _num_ranks / total - 1.0));
+        }
+    }
+    MPI_Bcast(rows.data(), _num_ranks + 1, MPI_UINT32_T, 0, _comm);
+    if (rows[0] == UINT32_MAX)
+    {
+        return;
+    }
+
+    // new tile is announced in-band, between this frame and the next, on every connection that already has a
+    // connection header (new connections get the new header) - with pacing, frames still wait in the send queue,
+    // so the layout is queued behind them rather than overtaking a frame sent with the old tile
+    _local_width = _global_width;
+    _local_height = rows[_rank + 1] - rows[_rank];
+    _local_offset_x = 0;
+    _local_offset_y = rows[_rank];
+    _regions[0] = {_local_width, _local_height, _local_offset_x, _local_offset_y, 0};
+    lock.lock();
+    BuildConnectHeader();
+    std::shared_ptr<std::vector<uint8_t>> layout = std::make_shared<std::vector<uint8_t>>(std::initializer_list<uint8_t>{3, 0, 0, 0});
+    layout->insert(layout->end(), _connect_header->begin(), _connect_header->end());
+    bool paced = PacingEnabled();
+    PacedFrame paced_layout = {NULL, FrameHeader(), 0, {}, layout};
+    for (auto& c : _connections)
+    {
+        if (c.second.state == ClientState::Handshake || c.second.state == ClientState::Streaming)
+        {
+            if (paced)
+            {
+                paced_layout.connection_ids.push_back(c.first);
+            }
+            else
+            {
+                c.second.client->Send(layout->data(), layout->size(), NetSocket::CopyMode::MemCopy);
+            }
+        }
+    }
+    if (paced && !paced_layout.connection_ids.empty())
+    {
+        if (!_send_thread.joinable())
+        {
+            _send_thread = std::thread(&PxStream::Server::SendLoop, this);
+        }
+        _send_queue.push_back(paced_layout);
+        _send_condition.notify_all();
+    }
+}
+
+void PxStream::Server::SetupCompositing()
+{
+    bool supported = (_composite_op == CompositeOperator::DepthTest && _px_format != PixelFormat::DXT1 && _px_format != PixelFormat::EncodedImage
+                      && PxStream::GetBitsPerPixel(_px_format, _px_data_type) % 8 == 0)
+                  || (_composite_op == CompositeOperator::AlphaOver && _px_format == PixelFormat::RGBA && _px_data_type == PixelDataType::Uint8);
+    if (!supported)
+    {
+        fprintf(stderr, "PxStream::Server> Error: compositing requires uncompressed pixels (premultiplied Uint8 RGBA for alpha)\n");
+        MPI_Abort(_comm, 1);
+    }
+
+    // binary swap runs on the largest power-of-two group of ranks - the remaining ranks fold into a neighbour
+    _composite_vranks = 1;
+    while (_composite_vranks * 2 <= _num_ranks)
+    {
+        _composite_vranks *= 2;
+    }
+    int extra = _num_ranks - _composite_vranks;
+    if (_rank < 2 * extra)
+    {
+        _composite_vrank = (_rank % 2 == 0) ? _rank / 2 : -1;
+    }
+    else
+    {
+        _composite_vrank = _rank - extra;
+    }
+
+    // each rank streams a full-width strip of rows
+    uint32_t row, rows;
+    if (extra == 0)
+    {
+        CompositeStrip(_composite_vrank, &row, &rows);
+    }
+    else
+    {
+        row = (uint64_t)_rank * _global_height / _num_ranks;
+        rows = (uint64_t)(_rank + 1) * _global_height / _num_ranks - row;
+    }
+    _local_width = _global_width;
+    _local_height = rows;
+    _local_offset_x = 0;
+    _local_offset_y = row;
+
+    uint64_t num_pixels = (uint64_t)_global_width * _global_height;
+    uint32_t pixel_bytes = PxStream::GetBitsPerPixel(_px_format, _px_data_type) / 8;
+    uint64_t row_bytes = (uint64_t)_global_width * pixel_bytes;
+    if (row_bytes > INT_MAX || _global_height > INT_MAX)
+    {
+        fprintf(stderr, "PxStream::Server> Error: image too large to composite (rows of at most %d bytes)\n", INT_MAX);
+        MPI_Abort(_comm, 1);
+    }
+    MPI_Type_contiguous((int)row_bytes, MPI_UINT8_T, &_composite_row_type);
+    MPI_Type_commit(&_composite_row_type);
+    if (_composite_op == CompositeOperator::DepthTest)
+    {
+        MPI_Type_contiguous((int)_global_width, MPI_FLOAT, &_composite_depth_row_type);
+        MPI_Type_commit(&_composite_depth_row_type);
+    }
+    _composite_color.resize(num_pixels * pixel_bytes);
+    _composite_recv_color.resize(num_pixels * pixel_bytes);
+    if (_composite_op == CompositeOperator::DepthTest)
+    {
+        _composite_depth.resize(num_pixels);
+        _composite_recv_depth.resize(num_pixels);
+    }
+}
+
+int PxStream::Server::CompositeActualRank(int vrank)
+{
+    int extra = _num_ranks - _composite_vranks;
+    return (vrank < extra) ? 2 * vrank : vrank + extra;
+}
+
+void PxStream::Server::CompositeStrip(int vrank, uint32_t *row, uint32_t *rows)
+{
+    // strip left to `vrank` after binary swap (it takes the upper half in every round its bit is set)
+    uint32_t s0 = 0;
+    uint32_t s1 = _composite_vranks;
+    int m;
+    for (m = 1; m < _composite_vranks; m *= 2)
+    {
+        uint32_t mid = (s0 + s1) / 2;
+        if (vrank & m)
+        {
+            s0 = mid;
+        }
+        else
+        {
+            s1 = mid;
+        }
+    }
+    *row = (uint64_t)s0 * _global_height / _composite_vranks;
+    *rows = (uint64_t)s1 * _global_height / _composite_vranks - *row;
+}
+
+void PxStream::Server::CompositeRows(const void *color, const float *depth, uint32_t row, uint32_t rows, bool received_in_front)
+{
+    // merges the received rows into the working image (`color` / `depth` hold this rank's current image)
+    uint32_t pixel_bytes = PxStream::GetBitsPerPixel(_px_format, _px_data_type) / 8;
+    uint64_t offset = (uint64_t)row * _global_width;
+    uint64_t num_pixels = (uint64_t)rows * _global_width;
+    uint8_t *dst_color = _composite_color.data() + offset * pixel_bytes;
+    const uint8_t *src_color = reinterpret_cast<const uint8_t*>(color) + offset * pixel_bytes;
+    if (_composite_op == CompositeOperator::DepthTest && received_in_front)
+    {
+        // equal depths go to the lower rank - merge ours into the received rows, then take the result
+        float *dst_depth = _composite_depth.data() + offset;
+        PxStream::CompositeDepth(src_color, depth + offset, _composite_recv_color.data(), _composite_recv_depth.data(), num_pixels, pixel_bytes);
+        memcpy(dst_color, _composite_recv_color.data(), num_pixels * pixel_bytes);
+        memcpy(dst_depth, _composite_recv_depth.data(), num_pixels * sizeof(float));
+        return;
+    }
+    if (src_color != dst_color)
+    {
+        memcpy(dst_color, src_color, num_pixels * pixel_bytes);
+    }
+    if (_composite_op == CompositeOperator::DepthTest)
+    {
+        float *dst_depth = _composite_depth.data() + offset;
+        if (depth + offset != dst_depth)
+        {
+            memcpy(dst_depth, depth + offset, num_pixels * sizeof(float));
+        }
+        PxStream::CompositeDepth(_composite_recv_color.data(), _composite_recv_depth.data(), dst_color, dst_depth, num_pixels, pixel_bytes);
+    }
+    else if (received_in_front)
+    {
+        PxStream::CompositeOver(_composite_recv_color.data(), dst_color, dst_color, num_pixels);
+    }
+    else
+    {
+        PxStream::CompositeOver(dst_color, _composite_recv_color.data(), dst_color, num_pixels);
     }
-    return new_connection_event;
 }